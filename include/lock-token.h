@@ -1,57 +1,98 @@
 #ifndef _LOCK_TOKEN_H_
 #define  _LOCK_TOKEN_H_
 
+#include <pthread.h>
+#include "tree.h"
 #include "tangramfs-rpc.h"
 
 #define LOCK_TYPE_RD        0
 #define LOCK_TYPE_WR        1
+#include <stdint.h>
+
+// Owner of tokens that belong to no one, e.g., copies sent in a grant
+#define LOCK_OWNER_NONE     0
+
+// Default lock granularity. Requesters align their ranges to
+// their own block size (see lock_range_align()), tokens keep
+// byte ranges, so different block sizes can be mixed in one file.
 #define LOCK_BLOCK_SIZE     4096
 
 typedef struct lock_token {
-    int block_start;
-    int block_end;
+    RB_ENTRY(lock_token) entry;
+    int64_t start;                  // first byte
+    int64_t end;                    // last byte, inclusive
+    int64_t max_end;                // max end of the subtree rooted here
     int type;
-    tangram_uct_addr_t* owner;
-    struct lock_token*  next;
+    uint32_t owner;                 // client id, see tangram_uct_addr_t
+
+    // Read tokens can be shared, the holders are
+    // the owner plus these readers. Only used by server.
+    int num_readers;
+    uint32_t* readers;
 } lock_token_t;
 
+/**
+ * Tokens of a file, indexed by an interval tree: a red-black
+ * tree ordered by start and augmented with the max
+ * end of each subtree. Conflict, cover and neighbour
+ * lookups are O(log n) in the number of tokens.
+ */
 typedef struct lock_token_list {
     pthread_rwlock_t rwlock;
-    lock_token_t*    head;
+    RB_HEAD(lock_token_tree, lock_token) head;
 } lock_token_list_t;
 
 
+// Return the conflicting token with the lowest start
 lock_token_t* lock_token_find_conflict(lock_token_list_t* token_list, size_t offset, size_t count);
+// Return the number of conflicting tokens, and the tokens in *tokens
+// sorted by start. The caller needs to free *tokens.
+int           lock_token_find_conflicts(lock_token_list_t* token_list, size_t offset, size_t count, lock_token_t*** tokens);
 lock_token_t* lock_token_find_cover(lock_token_list_t* token_list, size_t offset, size_t count);
 lock_token_t* lock_token_find_exact(lock_token_list_t* token_list, size_t offset, size_t count);
 
 
-lock_token_t* lock_token_create(int start, int end, int type, tangram_uct_addr_t* owner);
+lock_token_t* lock_token_create(int64_t start, int64_t end, int type, uint32_t owner);
+// Free a token that is not in any list
+void          lock_token_free(lock_token_t* token);
 lock_token_t* lock_token_add_direct(lock_token_list_t* token_list, lock_token_t* token);
 
 // Ask for [start, end] will get exactly [start, end]
-lock_token_t* lock_token_add_exact(lock_token_list_t* token_list, size_t offset, size_t count, int type, tangram_uct_addr_t* owner);
+lock_token_t* lock_token_add_exact(lock_token_list_t* token_list, size_t offset, size_t count, int type, uint32_t owner);
 
 // Add a extended lock token
-// e.g., user ask [0-100], we can give [0-inf] if possible
-lock_token_t* lock_token_add_extend(lock_token_list_t* token_list, size_t offset, size_t count, int type, tangram_uct_addr_t* owner);
+// e.g., user ask [0-100], we can give [0-inf] if possible.
+// The token grows at most `max_extend` bytes on each side.
+#define LOCK_EXTEND_UNBOUNDED   0
+lock_token_t* lock_token_add_extend(lock_token_list_t* token_list, size_t offset, size_t count, int type, uint32_t owner, size_t max_extend);
 
 // Add from the data stream generated by lock_token_serialize()
-lock_token_t* lock_token_add_from_buf(lock_token_list_t* token_list, void* buf, tangram_uct_addr_t* owner);
+lock_token_t* lock_token_add_from_buf(lock_token_list_t* token_list, void* buf, uint32_t owner);
 
 
 void  lock_token_delete(lock_token_list_t* token_list, lock_token_t* token);
-// Delete all tokens owned by a specific client
-void  lock_token_delete_client(lock_token_list_t* token_list, tangram_uct_addr_t* owner);
+// Delete all tokens owned by a specific client, or remove
+// it from the holders if the token is shared
+void  lock_token_delete_client(lock_token_list_t* token_list, uint32_t owner);
+
+// Reader set of shared read tokens
+bool  lock_token_held_by(lock_token_list_t* token_list, lock_token_t* token, uint32_t holder);
+int   lock_token_num_holders(lock_token_list_t* token_list, lock_token_t* token);
+void  lock_token_add_reader(lock_token_list_t* token_list, lock_token_t* token, uint32_t reader);
+// Remove a holder from a shared token, the token is kept
+void  lock_token_remove_holder(lock_token_list_t* token_list, lock_token_t* token, uint32_t holder);
 void* lock_token_serialize(lock_token_t* token, size_t *size);
 lock_token_t* lock_token_deserialize(void* buf, size_t *size);
 
 void lock_token_update_type(lock_token_list_t* token_list, lock_token_t* token, int type);
-int lock_token_start(lock_token_list_t* token_list, lock_token_t* token);
-int lock_token_end(lock_token_list_t* token_list, lock_token_t* token);
+int64_t lock_token_start(lock_token_list_t* token_list, lock_token_t* token);
+int64_t lock_token_end(lock_token_list_t* token_list, lock_token_t* token);
 int lock_token_type(lock_token_list_t* token_list, lock_token_t* token);
-tangram_uct_addr_t* lock_token_owner(lock_token_list_t* token_list, lock_token_t* token);
-int lock_token_update_range(lock_token_list_t* token_list, lock_token_t* token, int start, int end);
+uint32_t lock_token_owner(lock_token_list_t* token_list, lock_token_t* token);
+int lock_token_update_range(lock_token_list_t* token_list, lock_token_t* token, int64_t start, int64_t end);
+
+// Expand [offset, offset+count) to whole blocks of `block_size`
+void lock_range_align(size_t block_size, size_t* offset, size_t* count);
 
 
 void lock_token_list_init(lock_token_list_t* token_list);
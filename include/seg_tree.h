@@ -21,8 +21,9 @@
 
 struct seg_tree_node {
     RB_ENTRY(seg_tree_node) entry;
-    tangram_uct_addr_t* owner;      /* owner of this segment, use by metadata server */
+    uint32_t owner;                 /* client id of the owner, use by metadata server */
     bool posted;                    /* wheather the segment has been posted, only meaningful on clients */
+    bool dirty;                     /* wheather the segment has not been flushed to PFS, only meaningful on clients */
     unsigned long start;            /* starting logical offset of range */
     unsigned long end;              /* ending logical offset of range */
     unsigned long ptr;              /* physical offset of data in log */
@@ -47,7 +48,7 @@ void seg_tree_clear(struct seg_tree* seg_tree);
 /*
  * Remove all nodes in seg_tree that belong to the given client.
  */
-void seg_tree_clear_client(struct seg_tree* seg_tree, tangram_uct_addr_t* client);
+void seg_tree_clear_client(struct seg_tree* seg_tree, uint32_t client);
 
 /*
  * Remove and free all nodes in the seg_tree.
@@ -58,7 +59,7 @@ void seg_tree_destroy(struct seg_tree* seg_tree);
  * Add an entry to the range tree.  Returns 0 on success, nonzero otherwise.
  */
 int seg_tree_add(struct seg_tree* seg_tree, unsigned long start, unsigned long end,
-                 unsigned long ptr, tangram_uct_addr_t* owner, bool posted);
+                 unsigned long ptr, uint32_t owner, bool posted);
 
 /*
  * Remove or truncate one or more entries from the range tree
@@ -150,6 +151,16 @@ void seg_tree_unlock(struct seg_tree* seg_tree);
 bool seg_tree_posted_nolock(struct seg_tree* seg_tree, struct seg_tree_node* node);
 void seg_tree_set_posted_nolock(struct seg_tree* seg_tree, struct seg_tree_node* node);
 
+bool seg_tree_dirty_nolock(struct seg_tree* seg_tree, struct seg_tree_node* node);
+void seg_tree_set_clean_nolock(struct seg_tree* seg_tree, struct seg_tree_node* node);
+
+/*
+ * Mark [start, start+count) dirty again if it still maps to `ptr`
+ * of the local buffer file. Parts that were overwritten since are
+ * dirty already. Used when flushing them to PFS failed.
+ */
+void seg_tree_set_dirty(struct seg_tree* seg_tree, unsigned long start, unsigned long ptr, unsigned long count);
+
 void seg_tree_coalesce_nolock(struct seg_tree* seg_tree, struct seg_tree_node* target);
 void seg_tree_coalesce_all_nolock(struct seg_tree* seg_tree);
 
@@ -14,7 +14,7 @@ ssize_t sessionfs_read_lazy(tfs_file_t* tf, void* buf, size_t size);
 size_t  sessionfs_seek(tfs_file_t* tf, size_t offset, int whence);
 size_t  sessionfs_tell(tfs_file_t* tf);
 void    sessionfs_stat(tfs_file_t* tf, struct stat* buf);
-void    sessionfs_flush(tfs_file_t* tf);
+int     sessionfs_flush(tfs_file_t* tf);
 int     sessionfs_session_open(tfs_file_t* tf, size_t* offsets, size_t* sizes, int num);
 int     sessionfs_session_close(tfs_file_t* tf);
 
@@ -12,4 +12,16 @@
 void tangram_delegator_start(tfs_info_t* tfs_info);
 void tangram_delegator_stop();
 
+/**
+ * Revocation epoch of this node, kept in MPI shared memory.
+ * The delegator bumps it whenever it gives up tokens, so
+ * clients know their cached tokens may be stale.
+ *
+ * init() and finalize() are collective over the intra-node
+ * communicator.
+ */
+void     tangram_delegator_epoch_init(tfs_info_t* tfs_info);
+void     tangram_delegator_epoch_finalize();
+uint64_t tangram_delegator_epoch();
+
 #endif
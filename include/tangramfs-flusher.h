@@ -0,0 +1,50 @@
+#ifndef _TANGRAMFS_FLUSHER_H_
+#define _TANGRAMFS_FLUSHER_H_
+#include <stdint.h>
+#include "tangramfs-utils.h"
+#include "seg_tree.h"
+
+/**
+ * Background flusher, copies dirty extents from the
+ * node-local buffer files to PFS.
+ *
+ * A flush is split into jobs, each job covers a logically
+ * contiguous range of at most TANGRAM_FLUSH_JOB_SIZE bytes
+ * and is written to PFS with a single pwrite(). Jobs of one
+ * flush never overlap, so a pool of I/O threads can run
+ * them in parallel.
+ */
+
+#define TANGRAM_FLUSH_JOB_SIZE      (8*1024*1024)
+
+typedef struct tfs_flush_handle tfs_flush_handle_t;
+
+void tangram_flusher_init(tfs_info_t* tfs_info);
+void tangram_flusher_finalize();
+
+// Create a handle for flushing buffer file `local_fd` to `pfs_fd`,
+// with one reference held by the caller. Jobs wait for write-behind
+// `wb_ticket` before reading the buffer file. Extents of failed jobs
+// are marked dirty again in `seg_tree`, which must outlive the jobs.
+tfs_flush_handle_t* tangram_flusher_handle_create(int pfs_fd, int local_fd, uint64_t wb_ticket, struct seg_tree* seg_tree);
+void tangram_flusher_handle_retain(tfs_flush_handle_t* handle);
+void tangram_flusher_handle_release(tfs_flush_handle_t* handle);
+
+/*
+ * Add an extent [start, start+count) stored at `ptr` of the buffer
+ * file. Extents must be added in increasing logical order. Logically
+ * contiguous extents are coalesced into one job, large extents are
+ * split into multiple jobs. Full jobs are dispatched right away.
+ */
+void tangram_flusher_add(tfs_flush_handle_t* handle, size_t start, size_t ptr, size_t count);
+
+// Dispatch the last job, no more extents can be added after this
+void tangram_flusher_submit(tfs_flush_handle_t* handle);
+
+// Wait for all jobs of `handle`, return 0 on success, -1 if any job failed
+int  tangram_flusher_wait(tfs_flush_handle_t* handle);
+
+// Return true if all jobs of `handle` are finished
+bool tangram_flusher_test(tfs_flush_handle_t* handle);
+
+#endif
@@ -1,41 +1,127 @@
 #ifndef _TANGRAMFS_LOCK_MANAGER_H_
 #define _TANGRAMFS_LOCK_MANAGER_H_
 #include <stdbool.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include "lock-token.h"
 #include "tangramfs-rpc.h"
 
 #define LOCK_ACQUIRE_SUCCESS        0
-#define LOCK_ACQUIRE_CONFLICT       1
 
+/**
+ * An acquire request of one or more ranges. Ranges become ready
+ * one by one, but their tokens are only added, and the respond
+ * sent, once all of them are ready. A range granted early could
+ * otherwise be revoked before the requestor even receives it.
+ */
+typedef struct lock_batch {
+    int num;
+    int remaining;                  // ranges not ready yet
+    int queued;                     // ranges still in the queue
+    lock_token_t** grants;          // what is granted for each range
+    struct lock_waiter** waiters;   // queued waiter of each range, NULL if none
+} lock_batch_t;
+
+// A range of an acquire request parked on the server
+typedef struct lock_waiter {
+    uint32_t owner;                 // client id of the requestor
+    uint64_t seq_id;                // seq_id of the acquire request, used by the grant
+    lock_batch_t* batch;
+    int      index;                 // which range of the batch
+    size_t   offset;
+    size_t   count;
+    int      type;
+    bool     ready;                 // no conflict left, waiting for the rest of the batch
+    int      blockers;              // earlier waiters in the queue that overlap us
+    uint64_t revoke_id;             // seq_id of the revocations in flight, 0 if none
+    uint32_t* victims;              // whom we are revoking from, LOCK_OWNER_NONE once acked
+    int      num_victims;
+    int      pending;               // number of acks we are still waiting for
+    struct lock_waiter *next, *prev;
+    struct lock_waiter *run_next, *run_prev;    // in lock_table_t.runnable
+} lock_waiter_t;
+
+// Per-file lock statistics, only kept by server
+typedef struct lock_stats {
+    uint64_t grants;
+    uint64_t extends;               // grants larger than asked
+    uint64_t splits;                // tokens cut to make room for others
+    uint64_t conflicts;             // rounds of revocations
+    uint64_t switches;              // policy changes
+
+    // Counters since the last policy decision
+    uint64_t window_grants;
+    uint64_t window_splits;
+    uint64_t window_conflicts;
+} lock_stats_t;
+
+// A range revoked while acquires were in flight, only used by delegator
+typedef struct lock_range {
+    size_t offset;
+    size_t count;
+    struct lock_range *next, *prev;
+} lock_range_t;
+
+/**
+ * Lock state of one file. Requests of a file may come from
+ * different worker threads, `lock` serializes them.
+ */
 typedef struct lock_table {
     char filename[256];
+    pthread_mutex_t lock;
     lock_token_list_t token_list;
+    lock_waiter_t* waiters;         // FIFO, only used by server
+    lock_waiter_t* runnable;        // waiters to look at by the next lock_queue_progress()
+    int  acquiring;                 // acquires waiting for the server, only used by delegator
+    lock_range_t* revoked;          // revoked while acquires are in flight, applied to their grants
+    int  lock_algo;                 // configured algorithm
+    int  policy;                    // algorithm in use, differs only if lock_algo is adaptive
+    lock_stats_t stats;
+    bool callback;
     UT_hash_handle hh;
 } lock_table_t;
 
+// Tokens are serialized without owner, which is the requestor
 typedef struct lock_acquire_result {
-    int result;                     // SUCCESS, CONFLICT
-    tangram_uct_addr_t* owner;      // only set if conflict was found
-    lock_token_t* token;
+    int result;                     // SUCCESS
+    int num_tokens;                 // one for each range of the request
+    lock_token_t** tokens;
 } lock_acquire_result_t;
 
 void tangram_lockmgr_init(lock_table_t** lt);
 void tangram_lockmgr_finalize(lock_table_t** lt);
 
-// Delegator has its own acquire lock function
-lock_token_t* tangram_lockmgr_delegator_acquire_lock(lock_table_t** lt, tangram_uct_addr_t* client, char* filename, size_t offset, size_t count, int type);
-lock_acquire_result_t* tangram_lockmgr_server_acquire_lock(lock_table_t** lt, tangram_uct_addr_t* client, char* filename, size_t offset, size_t count, int type, int lock_algo);
+// Clients are given by their ids, registry ids on the server,
+// local ids on the delegator, see tangram_uct_addr_t.
+//
+// Delegator has its own acquire lock function, it only asks
+// the server for the ranges it does not hold yet, in one RPC.
+// `upgrade_cb`, if not NULL, is called under the file's lock
+// before a read token is dropped to upgrade it.
+void tangram_lockmgr_delegator_acquire_lock(lock_table_t** lt, uint32_t client, char* filename, interval_t* intervals, int num, void (*upgrade_cb)());
+// The grant of all ranges is sent to the requestor with `seq_id`,
+// either right away or once conflicting tokens are revoked. If
+// `callback` is set, the server asks the holders to release
+// conflicting tokens. Ranges of one request must not overlap.
+// Granted tokens count as held once the grant is sent, the
+// requestor applies revocations that overtake the grant.
+void tangram_lockmgr_server_acquire_lock(lock_table_t** lt, uint32_t client, uint64_t seq_id, char* filename, interval_t* intervals, int num, int lock_algo, bool callback);
+void tangram_lockmgr_server_revoke_done(lock_table_t* lt, uint32_t victim, char* filename, uint64_t revoke_id);
 
-void tangram_lockmgr_delegator_split_lock(lock_table_t* lt, char* filename, size_t offset, size_t count, int type);
+void tangram_lockmgr_delegator_revoke_lock(lock_table_t* lt, char* filename, size_t offset, size_t count);
 
 // Thse three functions are used by both delegator and server
-void tangram_lockmgr_server_release_lock(lock_table_t* lt, tangram_uct_addr_t* client, char* filename, size_t offset, size_t count);
-void tangram_lockmgr_server_release_lock_file(lock_table_t* lt, tangram_uct_addr_t* client, char* filename);
-void tangram_lockmgr_server_release_lock_client(lock_table_t* lt, tangram_uct_addr_t* client);
+void tangram_lockmgr_server_release_lock(lock_table_t* lt, uint32_t client, char* filename, interval_t* intervals, int num);
+void tangram_lockmgr_server_release_lock_file(lock_table_t* lt, uint32_t client, char* filename);
+void tangram_lockmgr_server_release_lock_client(lock_table_t* lt, uint32_t client);
+
+// Print the lock stats and the policy of each file
+void tangram_lockmgr_print_stats(lock_table_t* lt);
 
 
 void*                  lock_acquire_result_serialize(lock_acquire_result_t* res, size_t* len);
-lock_acquire_result_t* lock_acquire_result_deserialize();
+lock_acquire_result_t* lock_acquire_result_deserialize(void* buf);
+// Free the result, but not its tokens
+void                   lock_acquire_result_free(lock_acquire_result_t* res);
 
 #endif
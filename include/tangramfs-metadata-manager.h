@@ -6,10 +6,12 @@
 
 void tangram_metamgr_init();
 void tangram_metamgr_finalize();
-void tangram_metamgr_handle_post(tangram_uct_addr_t* client, char* filename, size_t offset, size_t count);
-void tangram_metamgr_handle_unpost_file(tangram_uct_addr_t* client, char* filename);
-void tangram_metamgr_handle_unpost_client(tangram_uct_addr_t* client);
+// Clients are given by their registry ids, see tangram_ucx_server_client_addr()
+void tangram_metamgr_handle_post(uint32_t client, char* filename, size_t offset, size_t count, size_t ptr);
+void tangram_metamgr_handle_expose(uint32_t client, char* filename, void* region, size_t region_len);
+void tangram_metamgr_handle_unpost_file(uint32_t client, char* filename);
+void tangram_metamgr_handle_unpost_client(uint32_t client);
 void tangram_metamgr_handle_stat(char* path, struct stat* buf);
-tangram_uct_addr_t* tangram_metamgr_handle_query(char* filename, size_t offset, size_t count);
+int  tangram_metamgr_handle_query(char* filename, size_t offset, size_t count, rpc_piece_t** pieces);
 
 #endif
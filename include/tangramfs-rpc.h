@@ -2,14 +2,35 @@
 #define _TANGRAMFS_RPC_H_
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include "tangramfs-ucx-comm.h"
 
 typedef struct rpc_interval {
     size_t offset;
     size_t count;
     int    type;        // used for lock type
+    size_t ptr;         // used for post, offset of the data in the poster's buffer file
 } interval_t;
 
+/**
+ * Query result, [offset, offset+count) has
+ * been posted by owner.
+ *
+ * The data is at `ptr` of the owner's buffer file.
+ * If the owner has exposed its buffer file for RMA,
+ * `region` describes the registered memory (see
+ * tangram_rma_mem_reg()), otherwise it is NULL.
+ */
+typedef struct rpc_piece {
+    size_t offset;
+    size_t count;
+    size_t ptr;
+    tangram_uct_addr_t* owner;
+    void*  region;
+    size_t region_len;
+} rpc_piece_t;
+
 typedef struct rpc_in {
     int num_intervals;
     int filename_len;
@@ -18,6 +39,19 @@ typedef struct rpc_in {
 } rpc_in_t;
 
 
+/**
+ * Packed rpc_in:
+ * num_intervals | filename_len | filename '\0' | padding | intervals
+ *
+ * The intervals have the layout of interval_t and start at a
+ * multiple of its alignment. The RPC data is aligned as well (see
+ * pack_rpc_buffer()), so handlers can use them in place.
+ */
+static size_t rpc_in_intervals_pos(int filename_len) {
+    size_t align = __alignof__(interval_t);
+    return (sizeof(int)*2 + filename_len + 1 + align - 1) / align * align;
+}
+
 /**
  * Incase we want to send too many intervals a time,
  * We need to split them into multiple am messages
@@ -26,16 +60,15 @@ typedef struct rpc_in {
  * send in one AM
  */
 static int rpc_in_intervals_per_am(char* filename, size_t am_max_size) {
-    size_t filelen = filename ? strlen(filename) : 0;
-    filelen += sizeof(int);
+    size_t filelen = rpc_in_intervals_pos(filename ? strlen(filename) : 0);
 
-    size_t interval_size = sizeof(size_t)*2+sizeof(int);
+    size_t interval_size = sizeof(interval_t);
 
     int num_intervals = (am_max_size - filelen - 40/*a safe guard, just in case*/) / interval_size;
     return num_intervals;
 }
 
-static void* rpc_in_pack(char* filename, int num_intervals, size_t *offsets, size_t *counts, int* types, size_t *size) {
+static void* rpc_in_pack(char* filename, int num_intervals, size_t *offsets, size_t *counts, int* types, size_t* ptrs, size_t *size) {
     if(num_intervals == 0 && filename == NULL) {
         *size = 0;
         return NULL;
@@ -43,74 +76,101 @@ static void* rpc_in_pack(char* filename, int num_intervals, size_t *offsets, siz
 
     int filename_len = strlen(filename);
 
-    size_t total = sizeof(int)*2;           // filename_len, num_intervals
-    total += strlen(filename);              // filename
-    for(int i = 0; i < num_intervals; i++)  // intervals (offset, count, type)
-        total += (sizeof(size_t) * 2 + sizeof(int));
-
-    int pos = 0;
-    void* data = malloc(total);
-    memset(data, 0, total);
-    memcpy(data+pos, &num_intervals, sizeof(int));
-    pos+= sizeof(int);
-    memcpy(data+pos, &filename_len, sizeof(int));
-    pos+=sizeof(int);
-    memcpy(data+pos, filename, filename_len);
-    pos+=filename_len;
+    size_t pos   = rpc_in_intervals_pos(filename_len);
+    size_t total = pos + sizeof(interval_t) * num_intervals;
+
+    // Zeroed, so the filename is null-terminated and
+    // the padding does not send uninitialized bytes
+    void* data = calloc(1, total);
+    memcpy(data, &num_intervals, sizeof(int));
+    memcpy(data+sizeof(int), &filename_len, sizeof(int));
+    memcpy(data+sizeof(int)*2, filename, filename_len);
+
+    interval_t* intervals = (interval_t*) (data + pos);
     for(int i = 0; i < num_intervals; i++) {
-        memcpy(data+pos, &offsets[i], sizeof(size_t));
-        pos += sizeof(size_t);
-        memcpy(data+pos, &counts[i], sizeof(size_t));
-        pos += sizeof(size_t);
-        if(types != NULL)
-            memcpy(data+pos, &types[i], sizeof(int));
-        pos += sizeof(int);
+        intervals[i].offset = offsets[i];
+        intervals[i].count  = counts[i];
+        intervals[i].type   = types ? types[i] : 0;
+        intervals[i].ptr    = ptrs ? ptrs[i] : 0;
     }
 
     *size = total;
     return data;
 }
 
+/**
+ * The filename and the intervals point into `data`, which must
+ * outlive the result. The intervals are only copied if they are
+ * not aligned, i.e., `data` itself is not.
+ */
 static rpc_in_t* rpc_in_unpack(void* data) {
-    size_t pos = 0;
-    rpc_in_t *in = malloc(sizeof(rpc_in_t));
-
-    memcpy(&in->num_intervals, data+pos, sizeof(int));
-    pos += sizeof(int);
-
-    memcpy(&in->filename_len, data+pos, sizeof(int));
-    pos += sizeof(int);
-
-    in->filename = malloc(in->filename_len + 1);
-    memset(in->filename, 0, in->filename_len+1);
-    memcpy(in->filename, data+pos, in->filename_len);
-    pos += in->filename_len;
-
-    in->intervals = malloc(sizeof(interval_t) * in->num_intervals);
-    for(int i = 0; i < in->num_intervals; i++) {
-        memcpy(&(in->intervals[i].offset), data+pos, sizeof(size_t));
-        pos += sizeof(size_t);
-        memcpy(&(in->intervals[i].count), data+pos, sizeof(size_t));
-        pos += sizeof(size_t);
-        memcpy(&(in->intervals[i].type), data+pos, sizeof(int));
-        pos += sizeof(int);
+    int num_intervals, filename_len;
+    memcpy(&num_intervals, data, sizeof(int));
+    memcpy(&filename_len, data+sizeof(int), sizeof(int));
+
+    void* intervals = data + rpc_in_intervals_pos(filename_len);
+    bool aligned = (uintptr_t) intervals % __alignof__(interval_t) == 0;
+
+    rpc_in_t *in = malloc(sizeof(rpc_in_t) + (aligned ? 0 : sizeof(interval_t)*num_intervals));
+    in->num_intervals = num_intervals;
+    in->filename_len  = filename_len;
+    in->filename      = (char*) data + sizeof(int)*2;
+    if(aligned) {
+        in->intervals = (interval_t*) intervals;
+    } else {
+        in->intervals = (interval_t*) (in + 1);
+        memcpy(in->intervals, intervals, sizeof(interval_t)*num_intervals);
     }
     return in;
 }
 
+// Point to the filename of a packed rpc_in without unpacking it
+static char* rpc_in_peek_filename(void* data, int* filename_len) {
+    memcpy(filename_len, data+sizeof(int), sizeof(int));
+    return (char*) data + sizeof(int)*2;
+}
+
+// Number of bytes rpc_in_pack() produced for `in`
+static size_t rpc_in_packed_size(rpc_in_t* in) {
+    return rpc_in_intervals_pos(in->filename_len) + in->num_intervals * sizeof(interval_t);
+}
+
 static void rpc_in_free(rpc_in_t *in) {
-    free(in->filename);
-    free(in->intervals);
+    // filename and intervals are in the packed data, or
+    // in the same allocation if they had to be copied
     free(in);
 }
 
+static void rpc_pieces_free(rpc_piece_t* pieces, int num_pieces) {
+    for(int i = 0; i < num_pieces; i++) {
+        tangram_uct_addr_free(pieces[i].owner);
+        free(pieces[i].owner);
+        free(pieces[i].region);
+    }
+    free(pieces);
+}
+
+typedef struct tangram_rpc_req tangram_rpc_req_t;
+
 void tangram_issue_rpc(uint8_t id, char* filename, size_t* offsets, size_t* counts, int* types, int len, void** respond_ptr);
+tangram_rpc_req_t* tangram_issue_rpc_nb(uint8_t id, char* filename, size_t* offsets, size_t* counts, int* types, int len);
+int  tangram_rpc_wait(tangram_rpc_req_t* req, void*** responds);
 void tangram_issue_rma(uint8_t id, char* filename, tangram_uct_addr_t* dest, size_t *offsets, size_t *counts, int len, void* recv_buf);
 void tangram_issue_metadata_rpc(uint8_t id, const char* filename, void** respond_ptr);
+void tangram_issue_post(char* filename, size_t* offsets, size_t* counts, size_t* ptrs, int len, void* region, size_t region_len);
+void tangram_issue_rma_get(tangram_uct_addr_t* dest, void* region, size_t ptr, size_t count, void* recv_buf);
+int  tangram_rpc_intervals_per_am(char* filename);
 
 void tangram_rma_service_start(tfs_info_t *tfs_info, void* (*serve_rma_data_cb)(void*, size_t*));
 void tangram_rma_service_stop();
 
+// Register [addr, addr+len) for RMA so that peers can read it with
+// tangram_issue_rma_get(). The region to hand out to peers is returned
+// in `region`, the returned handle is passed to tangram_rma_mem_dereg().
+void* tangram_rma_mem_reg(void* addr, size_t len, void** region, size_t* region_len);
+void  tangram_rma_mem_dereg(void* handle);
+bool  tangram_rma_pull_enabled();
+
 void tangram_rpc_service_start(tfs_info_t* tfs_info);
 void tangram_rpc_service_stop();
 
@@ -40,7 +40,19 @@ typedef struct tfs_info {
 
     int  role;                  // client (delegator) or server
     bool use_delegator;
-    int  lock_algo;             // Lock accquire algorithm, exact or extend
+    int  lock_algo;             // Lock accquire algorithm, exact, extend, bounded or adaptive
+
+    bool   write_behind;        // Stage writes in memory and append them to the buffer file asynchronously
+    size_t write_behind_size;   // Size of the write-behind staging ring in bytes
+    int    flush_threads;       // Number of I/O threads flushing buffer files to PFS
+    size_t rma_window_size;     // Size of the pre-registered RMA receive window of each stream in bytes
+    int    rma_streams;         // Number of outgoing RMA requests that can be in flight at the same time
+    bool   rma_pull;            // Readers get data from owners' exposed buffer files with one-sided RMA
+    int    ep_cache_size;       // Max number of cached endpoints per context
+    bool   lock_cache;          // Cache granted locks, acquires they cover need no RPC
+    size_t lock_block_size;     // Lock granularity in bytes, 0 to adapt it to the I/O sizes of each file
+    int    progress_spin;       // Empty polling rounds before a progress thread blocks, -1 to never block
+    int    progress_timeout;    // Max time in ms a progress thread blocks for
 
 } tfs_info_t;
 
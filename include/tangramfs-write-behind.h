@@ -0,0 +1,32 @@
+#ifndef _TANGRAMFS_WRITE_BEHIND_H_
+#define _TANGRAMFS_WRITE_BEHIND_H_
+#include <stdint.h>
+#include "tangramfs-utils.h"
+
+/**
+ * Write-behind engine for the node-local buffer log.
+ *
+ * tfs_write() copies the user data into an in-memory
+ * staging ring and returns. A background thread appends
+ * staged records to the buffer log files in large batches.
+ *
+ * Every staged record gets a ticket. Records are written
+ * in FIFO order, so once a ticket is written, all records
+ * staged before it are in the buffer log as well.
+ */
+
+void     tangram_write_behind_init(tfs_info_t* tfs_info);
+void     tangram_write_behind_finalize();
+
+// Stage `size` bytes that belong at `log_offset` of buffer log `fd`.
+// Return the ticket of the staged record.
+uint64_t tangram_write_behind_stage(int fd, const void* buf, size_t size, size_t log_offset);
+
+// Wait until the record of `ticket` reaches the buffer log.
+void     tangram_write_behind_drain(uint64_t ticket);
+
+// drain() + fdatasync(), used at commit and close points.
+// One fdatasync() covers all records batched since the last sync.
+int      tangram_write_behind_sync(int fd, uint64_t ticket);
+
+#endif
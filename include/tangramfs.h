@@ -1,10 +1,13 @@
 #ifndef __TANGRAM_FS_H__
 #define __TANGRAM_FS_H__
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include "seg_tree.h"
 #include "uthash.h"
 #include "tangramfs-rpc.h"
+#include "tangramfs-flusher.h"
+#include "lock-token.h"
 
 #define TANGRAM_STRONG_SEMANTICS        1
 #define TANGRAM_COMMIT_SEMANTICS        2
@@ -13,6 +16,8 @@
 
 #define TANGRAM_LOCK_ALGO_EXACT         1
 #define TANGRAM_LOCK_ALGO_EXTEND        2
+#define TANGRAM_LOCK_ALGO_BOUNDED       3       // extend, but only up to a few times the request
+#define TANGRAM_LOCK_ALGO_ADAPTIVE      4       // pick one of the above per file
 
 /**
  * A list of environment variables can be set
@@ -28,6 +33,17 @@
 #define TANGRAM_DEBUG_ENV               "TANGRAM_DEBUG"
 #define TANGRAM_USE_DELEGATOR_ENV       "TANGRAM_USE_DELEGATOR"
 #define TANGRAM_LOCK_ALGO_ENV           "TANGRAM_LOCK_ALGO"
+#define TANGRAM_WRITE_BEHIND_ENV        "TANGRAM_WRITE_BEHIND"
+#define TANGRAM_WRITE_BEHIND_SIZE_ENV   "TANGRAM_WRITE_BEHIND_SIZE"     // in MB
+#define TANGRAM_FLUSH_THREADS_ENV       "TANGRAM_FLUSH_THREADS"
+#define TANGRAM_RMA_WINDOW_SIZE_ENV     "TANGRAM_RMA_WINDOW_SIZE"       // in MB
+#define TANGRAM_RMA_STREAMS_ENV         "TANGRAM_RMA_STREAMS"
+#define TANGRAM_RMA_PULL_ENV            "TANGRAM_RMA_PULL"
+#define TANGRAM_EP_CACHE_SIZE_ENV       "TANGRAM_EP_CACHE_SIZE"
+#define TANGRAM_LOCK_CACHE_ENV          "TANGRAM_LOCK_CACHE"
+#define TANGRAM_LOCK_BLOCK_SIZE_ENV     "TANGRAM_LOCK_BLOCK_SIZE"       // in bytes, 0 for adaptive
+#define TANGRAM_PROGRESS_SPIN_ENV       "TANGRAM_PROGRESS_SPIN"         // -1 to always poll
+#define TANGRAM_PROGRESS_TIMEOUT_ENV    "TANGRAM_PROGRESS_TIMEOUT"      // in ms
 
 
 typedef struct tfs_file {
@@ -39,9 +55,18 @@ typedef struct tfs_file {
     size_t offset;                  // Offset of the targeting file in this process
 
     int    local_fd;                // File descriptor of the local buffer file
+    size_t local_size;              // Size of the local buffer file, i.e., next append offset
+    uint64_t wb_ticket;             // Write-behind ticket of the last write to the local buffer file
+    tfs_flush_handle_t* flush;      // Last flush of this file, NULL if none
+    struct buffer_mapping* mappings;// Local buffer file mappings exposed for RMA, newest first
 
     struct seg_tree seg_tree;
 
+    lock_token_list_t lock_tokens;  // Locks held by this process, only with delegators
+    uint64_t lock_epoch;            // Delegator epoch the cached locks belong to
+    size_t lock_block_size;         // Lock granularity of this file
+    size_t lock_io_size;            // Running average of the I/O sizes, for adaptive lock granularity
+
     UT_hash_handle hh;              // filename as key
 
 } tfs_file_t;
@@ -59,7 +84,10 @@ ssize_t tfs_read_local(tfs_file_t* tf, void* buf, size_t size);
 size_t  tfs_seek(tfs_file_t* tf, size_t offset, int whence);
 size_t  tfs_tell(tfs_file_t* tf);
 void    tfs_stat(tfs_file_t* tf, struct stat* buf);
-void    tfs_flush(tfs_file_t* tf);
+int     tfs_flush(tfs_file_t* tf);
+tfs_flush_handle_t* tfs_flush_async(tfs_file_t* tf);
+int     tfs_flush_wait(tfs_flush_handle_t* handle);
+int     tfs_sync(tfs_file_t* tf);
 
 void    tfs_post(tfs_file_t* tf, size_t offset, size_t count);
 void    tfs_post_file(tfs_file_t* tf);
@@ -74,6 +102,9 @@ int     tfs_query_many(tfs_file_t* tf, size_t* offsets, size_t* sizes, int num,
 // to test the performance penalty
 int tfs_acquire_lock(tfs_file_t* tf, size_t offset, size_t count, int type);
 int tfs_release_lock(tfs_file_t* tf, size_t offset, size_t count);
+// Many ranges with one RPC, overlapping ranges are merged
+int tfs_acquire_lock_many(tfs_file_t* tf, size_t* offsets, size_t* counts, int* types, int num);
+int tfs_release_lock_many(tfs_file_t* tf, size_t* offsets, size_t* counts, int num);
 int tfs_release_lock_file(tfs_file_t* tf);
 int tfs_release_lock_client();
 
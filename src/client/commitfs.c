@@ -19,8 +19,8 @@ void commitfs_stat(tfs_file_t* tf, struct stat* buf) {
     tfs_stat(tf, buf);
 }
 
-void commitfs_flush(tfs_file_t *tf) {
-    tfs_flush(tf);
+int commitfs_flush(tfs_file_t *tf) {
+    return tfs_flush(tf);
 }
 
 ssize_t commitfs_write(tfs_file_t* tf, const void* buf, size_t size) {
@@ -34,8 +34,8 @@ void sessionfs_stat(tfs_file_t* tf, struct stat* buf) {
     tfs_stat(tf, buf);
 }
 
-void sessionfs_flush(tfs_file_t *tf) {
-    tfs_flush(tf);
+int sessionfs_flush(tfs_file_t *tf) {
+    return tfs_flush(tf);
 }
 
 ssize_t sessionfs_write(tfs_file_t* tf, const void* buf, size_t size) {
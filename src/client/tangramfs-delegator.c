@@ -5,12 +5,67 @@
 #include <string.h>
 #include <unistd.h>
 #include <mpi.h>
+#include "uthash.h"
 #include "tangramfs-delegator.h"
 #include "tangramfs-ucx-delegator.h"
 #include "tangramfs-lock-manager.h"
 
 static lock_table_t *g_lt;
 
+static MPI_Win            g_epoch_win = MPI_WIN_NULL;
+static volatile uint64_t* g_epoch;
+
+static void epoch_bump() {
+    __atomic_add_fetch(g_epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Clients of this node send us their intra-node addresses, which
+ * have no server id. Give each a local id for the lock table, the
+ * same way the server does. Ids start from 1 and are never reused.
+ */
+typedef struct local_client {
+    void*          key;             // serialized addr
+    size_t         key_len;
+    uint32_t       id;
+    UT_hash_handle hh;
+} local_client_t;
+
+static pthread_mutex_t  g_clients_lock = PTHREAD_MUTEX_INITIALIZER;
+static local_client_t*  g_clients;
+static uint32_t         g_num_clients;
+
+static uint32_t client_id(tangram_uct_addr_t* client) {
+    size_t key_len;
+    void* key = tangram_uct_addr_serialize(client, &key_len);
+
+    local_client_t* entry = NULL;
+    pthread_mutex_lock(&g_clients_lock);
+    HASH_FIND(hh, g_clients, key, key_len, entry);
+    if(entry) {
+        free(key);
+    } else {
+        entry = malloc(sizeof(local_client_t));
+        entry->key     = key;
+        entry->key_len = key_len;
+        entry->id      = ++g_num_clients;
+        HASH_ADD_KEYPTR(hh, g_clients, entry->key, entry->key_len, entry);
+    }
+    uint32_t id = entry->id;
+    pthread_mutex_unlock(&g_clients_lock);
+    return id;
+}
+
+static void clients_destroy() {
+    local_client_t *entry, *tmp;
+    HASH_ITER(hh, g_clients, entry, tmp) {
+        HASH_DEL(g_clients, entry);
+        free(entry->key);
+        free(entry);
+    }
+    g_num_clients = 0;
+}
+
 /**
  * Return a respond, can be NULL
  */
@@ -23,19 +78,19 @@ void* delegator_rpc_handler(uint8_t id, tangram_uct_addr_t* client, void* data,
 
     if(id == AM_ID_ACQUIRE_LOCK_REQUEST) {
         rpc_in_t* in = rpc_in_unpack(data);
-        tangram_assert(in->num_intervals == 1);
-        //tangram_debug("[tangramfs delegator %s] acquire lock start, filename: %s, ask [%ld-%ld]\n", hostname, in->filename, in->intervals[0].offset/LOCK_BLOCK_SIZE, (in->intervals[0].offset+in->intervals[0].count-1)/LOCK_BLOCK_SIZE);
-        tangram_lockmgr_delegator_acquire_lock(&g_lt, client, in->filename, in->intervals[0].offset, in->intervals[0].count, in->intervals[0].type);
-        tangram_debug("[tangramfs delegator %s] acquire lock done, filename: %s, ask [%ld-%ld]\n", hostname, in->filename, in->intervals[0].offset/LOCK_BLOCK_SIZE, (in->intervals[0].offset+in->intervals[0].count-1)/LOCK_BLOCK_SIZE);
+        //tangram_debug("[tangramfs delegator %s] acquire lock start, filename: %s, ask [%ld-%ld]\n", hostname, in->filename, in->intervals[0].offset, in->intervals[0].offset+in->intervals[0].count-1);
+        // Upgrading a read token drops it for all clients of this node
+        tangram_lockmgr_delegator_acquire_lock(&g_lt, client_id(client), in->filename, in->intervals, in->num_intervals, epoch_bump);
+        tangram_debug("[tangramfs delegator %s] acquire lock done, filename: %s, num_intervals: %d, ask [%ld-%ld]\n", hostname, in->filename, in->num_intervals, in->intervals[0].offset, in->intervals[0].offset+in->intervals[0].count-1);
         rpc_in_free(in);
         respond = malloc(sizeof(int));
         *respond_len = sizeof(int);
         *respond_id = AM_ID_ACQUIRE_LOCK_RESPOND;
     } else if(id == AM_ID_RELEASE_LOCK_REQUEST) {
         rpc_in_t* in = rpc_in_unpack(data);
-        tangram_assert(in->num_intervals == 1);
-        tangram_debug("[tangramfs delegator] release lock, filename: %s, offset:%lu, count: %lu\n", in->filename, in->intervals[0].offset, in->intervals[0].count);
-        tangram_lockmgr_server_release_lock(g_lt, client, in->filename, in->intervals[0].offset, in->intervals[0].count);
+        tangram_debug("[tangramfs delegator] release lock, filename: %s, num_intervals: %d, offset:%lu, count: %lu\n", in->filename, in->num_intervals, in->intervals[0].offset, in->intervals[0].count);
+        tangram_lockmgr_server_release_lock(g_lt, client_id(client), in->filename, in->intervals, in->num_intervals);
+        epoch_bump();
         //tangram_debug("[tangramfs] release lock success, filename: %s, offset:%lu, count: %lu\n", in->filename, in->intervals[0].offset, in->intervals[0].count);
         rpc_in_free(in);
         respond = malloc(sizeof(int));
@@ -43,7 +98,8 @@ void* delegator_rpc_handler(uint8_t id, tangram_uct_addr_t* client, void* data,
         *respond_id = AM_ID_RELEASE_LOCK_RESPOND;
     } else if(id == AM_ID_RELEASE_LOCK_FILE_REQUEST) {
         rpc_in_t* in = rpc_in_unpack(data);
-        tangram_lockmgr_server_release_lock_file(g_lt, client, in->filename);
+        tangram_lockmgr_server_release_lock_file(g_lt, client_id(client), in->filename);
+        epoch_bump();
         tangram_debug("[tangramfs delegator] release lock file: %s\n", in->filename);
         rpc_in_free(in);
         respond = malloc(sizeof(int));
@@ -51,20 +107,26 @@ void* delegator_rpc_handler(uint8_t id, tangram_uct_addr_t* client, void* data,
         *respond_id = AM_ID_RELEASE_LOCK_FILE_RESPOND;
     } else if(id == AM_ID_RELEASE_LOCK_CLIENT_REQUEST) {
         tangram_debug("[tangramfs delegator %s] release lock client.\n", hostname);
-        tangram_lockmgr_server_release_lock_client(g_lt, client);
+        tangram_lockmgr_server_release_lock_client(g_lt, client_id(client));
+        epoch_bump();
         respond = malloc(sizeof(int));
         *respond_len = sizeof(int);
         *respond_id = AM_ID_RELEASE_LOCK_CLIENT_RESPOND;
-    } else if(id == AM_ID_SPLIT_LOCK_REQUEST) {
+    } else if(id == AM_ID_REVOKE_LOCK_REQUEST) {
         rpc_in_t* in = rpc_in_unpack(data);
         tangram_assert(in->num_intervals == 1);
-        tangram_debug("[tangramfs delegator %s] split lock start, filename: %s, offset:%lu, count: %lu\n", hostname, in->filename, in->intervals[0].offset, in->intervals[0].count);
-        tangram_lockmgr_delegator_split_lock(g_lt, in->filename, in->intervals[0].offset, in->intervals[0].count, in->intervals[0].type);
-        tangram_debug("[tangramfs delegator %s] split lock done, filename: %s, offset:%lu, count: %lu\n", hostname, in->filename, in->intervals[0].offset, in->intervals[0].count);
+        // Bump the epoch before the tokens go away, clients
+        // that see the old epoch acquired them before this.
+        epoch_bump();
+        tangram_lockmgr_delegator_revoke_lock(g_lt, in->filename, in->intervals[0].offset, in->intervals[0].count);
+        tangram_debug("[tangramfs delegator %s] revoke lock done, filename: %s, offset:%lu, count: %lu\n", hostname, in->filename, in->intervals[0].offset, in->intervals[0].count);
+
+        // Echo the request, so the server knows which file it was
+        *respond_len = rpc_in_packed_size(in);
+        respond = malloc(*respond_len);
+        memcpy(respond, data, *respond_len);
+        *respond_id = AM_ID_REVOKE_LOCK_RESPOND;
         rpc_in_free(in);
-        respond = malloc(sizeof(int));
-        *respond_len = sizeof(int);
-        *respond_id = AM_ID_SPLIT_LOCK_RESPOND;
     }
 
     return respond;
@@ -83,4 +145,29 @@ void tangram_delegator_start(tfs_info_t* tfs_info) {
 void tangram_delegator_stop() {
     tangram_ucx_delegator_stop();
     tangram_lockmgr_finalize(&g_lt);
+    clients_destroy();
+}
+
+void tangram_delegator_epoch_init(tfs_info_t* tfs_info) {
+    // Only the delegator's rank allocates the counter
+    MPI_Aint size = tfs_info->mpi_intra_rank == 0 ? sizeof(uint64_t) : 0;
+    uint64_t* base;
+    MPI_Win_allocate_shared(size, sizeof(uint64_t), MPI_INFO_NULL, tfs_info->mpi_intra_comm, &base, &g_epoch_win);
+
+    int disp_unit;
+    MPI_Win_shared_query(g_epoch_win, 0, &size, &disp_unit, &base);
+    g_epoch = base;
+    if(tfs_info->mpi_intra_rank == 0)
+        *g_epoch = 0;
+    MPI_Barrier(tfs_info->mpi_intra_comm);
+}
+
+void tangram_delegator_epoch_finalize() {
+    if(g_epoch_win != MPI_WIN_NULL)
+        MPI_Win_free(&g_epoch_win);
+    g_epoch = NULL;
+}
+
+uint64_t tangram_delegator_epoch() {
+    return __atomic_load_n(g_epoch, __ATOMIC_SEQ_CST);
 }
@@ -0,0 +1,273 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "utlist.h"
+#include "tangramfs.h"
+#include "tangramfs-utils.h"
+#include "tangramfs-posix-wrapper.h"
+#include "tangramfs-write-behind.h"
+#include "tangramfs-flusher.h"
+
+typedef struct flush_job {
+    int         num;
+    int         capacity;
+    size_t      size;               // total bytes of this job
+    size_t*     starts;             // logical offsets
+    size_t*     ptrs;               // offsets in the buffer file
+    size_t*     counts;
+
+    struct tfs_flush_handle* handle;
+    struct flush_job *next, *prev;
+} flush_job_t;
+
+struct tfs_flush_handle {
+    int             pfs_fd;
+    int             local_fd;
+    uint64_t        wb_ticket;
+    struct seg_tree* seg_tree;      // to mark extents of failed jobs dirty again
+    flush_job_t*    building;       // job that is still accepting extents
+
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    int             pending;        // number of unfinished jobs
+    int             refs;
+    int             error;
+};
+
+typedef struct flusher {
+    int             num_threads;
+    pthread_t*      threads;
+    bool            running;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    flush_job_t*    jobs;
+} flusher_t;
+
+static flusher_t g_flusher;
+
+
+tfs_flush_handle_t* tangram_flusher_handle_create(int pfs_fd, int local_fd, uint64_t wb_ticket, struct seg_tree* seg_tree) {
+    tfs_flush_handle_t* handle = malloc(sizeof(tfs_flush_handle_t));
+    handle->pfs_fd    = pfs_fd;
+    handle->local_fd  = local_fd;
+    handle->wb_ticket = wb_ticket;
+    handle->seg_tree  = seg_tree;
+    handle->building  = NULL;
+    handle->pending   = 0;
+    handle->refs      = 1;
+    handle->error     = 0;
+    pthread_mutex_init(&handle->lock, NULL);
+    pthread_cond_init(&handle->cond, NULL);
+    return handle;
+}
+
+void tangram_flusher_handle_retain(tfs_flush_handle_t* handle) {
+    pthread_mutex_lock(&handle->lock);
+    handle->refs++;
+    pthread_mutex_unlock(&handle->lock);
+}
+
+void tangram_flusher_handle_release(tfs_flush_handle_t* handle) {
+    pthread_mutex_lock(&handle->lock);
+    int refs = --handle->refs;
+    pthread_mutex_unlock(&handle->lock);
+
+    if(refs == 0) {
+        pthread_cond_destroy(&handle->cond);
+        pthread_mutex_destroy(&handle->lock);
+        free(handle);
+    }
+}
+
+int tangram_flusher_wait(tfs_flush_handle_t* handle) {
+    pthread_mutex_lock(&handle->lock);
+    while(handle->pending > 0)
+        pthread_cond_wait(&handle->cond, &handle->lock);
+    int error = handle->error;
+    pthread_mutex_unlock(&handle->lock);
+    return error;
+}
+
+bool tangram_flusher_test(tfs_flush_handle_t* handle) {
+    pthread_mutex_lock(&handle->lock);
+    bool done = (handle->pending == 0);
+    pthread_mutex_unlock(&handle->lock);
+    return done;
+}
+
+static void flusher_dispatch(tfs_flush_handle_t* handle) {
+    flush_job_t* job = handle->building;
+    handle->building = NULL;
+    if(job == NULL)
+        return;
+
+    // Each job holds a reference, so the handle outlives
+    // the jobs even if the caller releases it first.
+    pthread_mutex_lock(&handle->lock);
+    handle->pending++;
+    handle->refs++;
+    pthread_mutex_unlock(&handle->lock);
+
+    pthread_mutex_lock(&g_flusher.lock);
+    DL_APPEND(g_flusher.jobs, job);
+    pthread_cond_signal(&g_flusher.cond);
+    pthread_mutex_unlock(&g_flusher.lock);
+}
+
+void tangram_flusher_add(tfs_flush_handle_t* handle, size_t start, size_t ptr, size_t count) {
+
+    while(count > 0) {
+        flush_job_t* job = handle->building;
+
+        // Start a new job if this extent is not
+        // logically contiguous with the current one
+        if(job && job->starts[job->num-1] + job->counts[job->num-1] != start)
+            flusher_dispatch(handle);
+
+        if(handle->building == NULL) {
+            job = calloc(1, sizeof(flush_job_t));
+            job->handle = handle;
+            handle->building = job;
+        }
+
+        if(job->num == job->capacity) {
+            job->capacity = job->capacity ? job->capacity * 2 : 8;
+            job->starts   = realloc(job->starts, sizeof(size_t) * job->capacity);
+            job->ptrs     = realloc(job->ptrs,   sizeof(size_t) * job->capacity);
+            job->counts   = realloc(job->counts, sizeof(size_t) * job->capacity);
+        }
+
+        size_t n = TANGRAM_FLUSH_JOB_SIZE - job->size;
+        if(n > count) n = count;
+
+        job->starts[job->num] = start;
+        job->ptrs[job->num]   = ptr;
+        job->counts[job->num] = n;
+        job->num++;
+        job->size += n;
+
+        if(job->size == TANGRAM_FLUSH_JOB_SIZE)
+            flusher_dispatch(handle);
+
+        start += n;
+        ptr   += n;
+        count -= n;
+    }
+}
+
+void tangram_flusher_submit(tfs_flush_handle_t* handle) {
+    flusher_dispatch(handle);
+}
+
+/*
+ * Gather the extents of the job into `buf`, then
+ * write them to PFS with one pwrite().
+ */
+static int flush_job_run(flush_job_t* job, char* buf) {
+
+    tfs_flush_handle_t* handle = job->handle;
+
+    // Staged writes must reach the buffer file first
+    tangram_write_behind_drain(handle->wb_ticket);
+
+    size_t total = 0;
+    for(int i = 0; i < job->num; i++) {
+        size_t done = 0;
+        while(done < job->counts[i]) {
+            ssize_t n = TANGRAM_REAL_CALL(pread)(handle->local_fd, buf+total+done, job->counts[i]-done, job->ptrs[i]+done);
+            // something wrong, the file was deleted?
+            if(n <= 0) return -1;
+            done += n;
+        }
+        total += done;
+    }
+
+    size_t done = 0;
+    while(done < total) {
+        ssize_t n = TANGRAM_REAL_CALL(pwrite)(handle->pfs_fd, buf+done, total-done, job->starts[0]+done);
+        if(n <= 0) return -1;
+        done += n;
+    }
+
+    return 0;
+}
+
+static void* flusher_loop(void* arg) {
+
+    char* buf = malloc(TANGRAM_FLUSH_JOB_SIZE);
+
+    while(true) {
+        pthread_mutex_lock(&g_flusher.lock);
+        while(g_flusher.jobs == NULL && g_flusher.running)
+            pthread_cond_wait(&g_flusher.cond, &g_flusher.lock);
+
+        // Only exit after all submitted jobs are done
+        flush_job_t* job = g_flusher.jobs;
+        if(job == NULL) {
+            pthread_mutex_unlock(&g_flusher.lock);
+            break;
+        }
+        DL_DELETE(g_flusher.jobs, job);
+        pthread_mutex_unlock(&g_flusher.lock);
+
+        int rc = flush_job_run(job, buf);
+
+        // Not on PFS, a later flush needs to retry them.
+        // Done before the job completes, so the seg_tree
+        // is still alive.
+        tfs_flush_handle_t* handle = job->handle;
+        if(rc != 0) {
+            for(int i = 0; i < job->num; i++)
+                seg_tree_set_dirty(handle->seg_tree, job->starts[i], job->ptrs[i], job->counts[i]);
+        }
+
+        pthread_mutex_lock(&handle->lock);
+        if(rc != 0)
+            handle->error = rc;
+        if(--handle->pending == 0)
+            pthread_cond_broadcast(&handle->cond);
+        pthread_mutex_unlock(&handle->lock);
+        tangram_flusher_handle_release(handle);
+
+        free(job->starts);
+        free(job->ptrs);
+        free(job->counts);
+        free(job);
+    }
+
+    free(buf);
+    return NULL;
+}
+
+void tangram_flusher_init(tfs_info_t* tfs_info) {
+    // Real calls are mapped per translation unit
+    tangram_map_real_calls();
+
+    g_flusher.num_threads = tfs_info->flush_threads;
+    g_flusher.threads     = malloc(sizeof(pthread_t) * g_flusher.num_threads);
+    g_flusher.running     = true;
+    g_flusher.jobs        = NULL;
+    pthread_mutex_init(&g_flusher.lock, NULL);
+    pthread_cond_init(&g_flusher.cond, NULL);
+
+    for(int i = 0; i < g_flusher.num_threads; i++)
+        pthread_create(&g_flusher.threads[i], NULL, flusher_loop, NULL);
+}
+
+void tangram_flusher_finalize() {
+    pthread_mutex_lock(&g_flusher.lock);
+    g_flusher.running = false;
+    pthread_cond_broadcast(&g_flusher.cond);
+    pthread_mutex_unlock(&g_flusher.lock);
+
+    for(int i = 0; i < g_flusher.num_threads; i++)
+        pthread_join(g_flusher.threads[i], NULL);
+
+    pthread_cond_destroy(&g_flusher.cond);
+    pthread_mutex_destroy(&g_flusher.lock);
+    free(g_flusher.threads);
+}
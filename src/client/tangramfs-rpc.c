@@ -24,77 +24,258 @@ typedef struct rpc_rma_addr_entry {
 static rpc_rma_addr_entry_t *g_rpc_rma_addr_map;
 
 /*
- * Perform RPC (send to server).
+ * A RPC that may be split into multiple AMs,
+ * each AM gets its own respond.
+ */
+struct tangram_rpc_req {
+    int                num;
+    tangram_ucx_req_t* reqs;
+    void**             responds;
+};
+
+static tangram_rpc_req_t* rpc_req_alloc(int num) {
+    tangram_rpc_req_t* req = malloc(sizeof(tangram_rpc_req_t));
+    req->num      = num;
+    req->reqs     = malloc(sizeof(tangram_ucx_req_t) * num);
+    req->responds = calloc(num, sizeof(void*));
+    return req;
+}
+
+static void rpc_send_nb(uint8_t id, void* data, size_t length, tangram_rpc_req_t* req, int i) {
+    if(g_tfs_info->use_delegator)
+        tangram_ucx_send_delegator_nb(id, data, length, &req->responds[i], &req->reqs[i]);
+    else
+        tangram_ucx_send_server_nb(id, data, length, &req->responds[i], &req->reqs[i]);
+}
+
+/*
+ * Perform RPC (send to server) without waiting for responds.
  * The underlying implementaiton is in src/ucx/tangram-ucx-client.c
+ *
+ * In case the intervals do not fit in one AM, we split them
+ * into multiple AMs, which are all in flight at the same time.
  */
-void tangram_issue_rpc(uint8_t id, char* filename, size_t *offsets, size_t *counts, int* types, int num_intervals, void** respond_ptr) {
+tangram_rpc_req_t* tangram_issue_rpc_nb(uint8_t id, char* filename, size_t *offsets, size_t *counts, int* types, int num_intervals) {
 
     // Some message does not send intervals
     if(num_intervals == 0) {
+        tangram_rpc_req_t* req = rpc_req_alloc(1);
         size_t data_size;
-        void* user_data = rpc_in_pack(filename, num_intervals, offsets, counts, types, &data_size);
-
-        if(g_tfs_info->use_delegator)
-            tangram_ucx_sendrecv_delegator(id, user_data, data_size, respond_ptr);
-        else
-            tangram_ucx_sendrecv_server(id, user_data, data_size, respond_ptr);
-
+        void* user_data = rpc_in_pack(filename, num_intervals, offsets, counts, types, NULL, &data_size);
+        rpc_send_nb(id, user_data, data_size, req, 0);
         free(user_data);
-        return;
+        return req;
     }
 
     // We need to guarantee the message size
     // does not exceed max am size
-    // In case its too large, we split it into multiple AM
     size_t am_max_size = tangram_uct_am_short_max_size();
     int num_per_am = rpc_in_intervals_per_am(filename, am_max_size);
-    int remain = num_intervals;
+    tangram_rpc_req_t* req = rpc_req_alloc((num_intervals + num_per_am - 1) / num_per_am);
 
-    int i = 0;
-    while(remain > 0) {
-        size_t data_size;
-        void* user_data = rpc_in_pack(filename, num_per_am < remain ? num_per_am : remain,
-                                      &offsets[i*num_per_am], &counts[i*num_per_am], types?&types[i*num_per_am]:NULL, &data_size);
-        if(g_tfs_info->use_delegator)
-            tangram_ucx_sendrecv_delegator(id, user_data, data_size, respond_ptr);
-        else
-            tangram_ucx_sendrecv_server(id, user_data, data_size, respond_ptr);
+    for(int i = 0; i < req->num; i++) {
+        int start = i * num_per_am;
+        int n = num_per_am < (num_intervals-start) ? num_per_am : (num_intervals-start);
 
+        size_t data_size;
+        void* user_data = rpc_in_pack(filename, n, &offsets[start], &counts[start], types?&types[start]:NULL, NULL, &data_size);
+        rpc_send_nb(id, user_data, data_size, req, i);
         free(user_data);
+    }
+    return req;
+}
 
-        remain -= num_per_am;
-        i++;
+/*
+ * Wait for all AMs of a RPC. Return the number of AMs, the
+ * respond of the i-th AM is returned in (*responds)[i], which
+ * covers the i-th tangram_rpc_intervals_per_am() intervals.
+ *
+ * If responds is NULL, the responds are freed.
+ */
+int tangram_rpc_wait(tangram_rpc_req_t* req, void*** responds) {
+    int num = req->num;
+    for(int i = 0; i < num; i++)
+        tangram_ucx_wait(&req->reqs[i]);
+
+    if(responds) {
+        *responds = req->responds;
+    } else {
+        for(int i = 0; i < num; i++)
+            free(req->responds[i]);
+        free(req->responds);
     }
+
+    free(req->reqs);
+    free(req);
+    return num;
+}
+
+/*
+ * Perform RPC and wait for the respond.
+ *
+ * If the intervals are split into multiple AMs, only the
+ * respond of the last one is returned.
+ */
+void tangram_issue_rpc(uint8_t id, char* filename, size_t *offsets, size_t *counts, int* types, int num_intervals, void** respond_ptr) {
+    void** responds;
+    tangram_rpc_req_t* req = tangram_issue_rpc_nb(id, filename, offsets, counts, types, num_intervals);
+    int num = tangram_rpc_wait(req, &responds);
+
+    for(int i = 0; i < num-1; i++)
+        free(responds[i]);
+    if(respond_ptr)
+        *respond_ptr = responds[num-1];
+    else
+        free(responds[num-1]);
+    free(responds);
 }
 
 
 /*
- * Perform RPC (between clients)
- * The underlying implementaiton is in src/ucx/tangram-ucx-client.c
+ * Post intervals along with where they are in my buffer file.
+ *
+ * Format of a post request:
+ * rpc_in (with ptrs) | region_len | region
+ *
+ * region can be NULL if the buffer file is not exposed for RMA.
+ * Posts are only handled by the server, so they never go through
+ * the delegator.
  */
-void tangram_issue_rma(uint8_t id, char* filename, tangram_uct_addr_t* dest,
-                            size_t *offsets, size_t *counts, int num_intervals, void* recv_buf) {
+void tangram_issue_post(char* filename, size_t* offsets, size_t* counts, size_t* ptrs, int num_intervals, void* region, size_t region_len) {
+    size_t am_max_size = tangram_uct_am_short_max_size() - sizeof(size_t) - region_len;
+    int num_per_am = rpc_in_intervals_per_am(filename, am_max_size);
+    tangram_assert(num_per_am > 0);
+
+    // All chunks are in flight at the same time
+    tangram_rpc_req_t* req = rpc_req_alloc((num_intervals + num_per_am - 1) / num_per_am);
+
+    for(int k = 0; k < req->num; k++) {
+        int i = k * num_per_am;
+        int n = num_per_am < (num_intervals-i) ? num_per_am : (num_intervals-i);
+
+        size_t in_size;
+        void* in = rpc_in_pack(filename, n, &offsets[i], &counts[i], NULL, &ptrs[i], &in_size);
 
-    size_t data_size;
-    void* user_data = rpc_in_pack(filename, num_intervals, offsets, counts, NULL, &data_size);
+        size_t data_size = in_size + sizeof(size_t) + region_len;
+        void* user_data = malloc(data_size);
+        memcpy(user_data, in, in_size);
+        memcpy(user_data+in_size, &region_len, sizeof(size_t));
+        if(region_len > 0)
+            memcpy(user_data+in_size+sizeof(size_t), region, region_len);
 
-    size_t total_recv_size = 0;
-    for(int i = 0; i < num_intervals; i++)
-        total_recv_size += counts[i];
+        tangram_ucx_send_server_nb(AM_ID_POST_REQUEST, user_data, data_size, &req->responds[k], &req->reqs[k]);
 
+        free(in);
+        free(user_data);
+    }
+
+    tangram_rpc_wait(req, NULL);
+}
 
+static tangram_uct_addr_t* rpc_to_rma_addr(tangram_uct_addr_t* rpc_addr) {
     size_t key_len;
-    void* key = tangram_uct_addr_serialize(dest, &key_len);
+    void* key = tangram_uct_addr_serialize(rpc_addr, &key_len);
     rpc_rma_addr_entry_t* entry = NULL;
     HASH_FIND(hh, g_rpc_rma_addr_map, key, key_len, entry);
     free(key);
-    if(entry) {
-        tangram_ucx_rma_request(&entry->rma_addr, user_data, data_size, recv_buf, total_recv_size);
-    } else {
+    if(!entry) {
         printf("No map from the given client RPC addr to RMA addr!\n");
+        return NULL;
+    }
+    return &entry->rma_addr;
+}
+
+/*
+ * Perform RPC (between clients)
+ * The underlying implementaiton is in src/ucx/tangram-ucx-client.c
+ */
+void tangram_issue_rma(uint8_t id, char* filename, tangram_uct_addr_t* dest,
+                            size_t *offsets, size_t *counts, int num_intervals, void* recv_buf) {
+
+    tangram_uct_addr_t* rma_addr = rpc_to_rma_addr(dest);
+    if(!rma_addr)
+        return;
+
+    // Leave some room for the sender address and the RMA request
+    // header. In case we have too many intervals or too many bytes
+    // for the peer to put into our RMA window, we split them into
+    // multiple RMA requests.
+    size_t am_max_size = tangram_uct_am_short_max_size() - 256 - tangram_ucx_rma_request_overhead();
+    int num_per_am = rpc_in_intervals_per_am(filename, am_max_size);
+    tangram_assert(num_per_am > 0);
+    size_t window = tangram_ucx_rma_window_size();
+
+    size_t* req_offsets = malloc(sizeof(size_t) * num_per_am);
+    size_t* req_counts  = malloc(sizeof(size_t) * num_per_am);
+
+    int i = 0;
+    size_t done = 0;        // bytes of interval i already requested
+    while(i < num_intervals) {
+        int n = 0;
+        size_t total_recv_size = 0;
+
+        // Intervals larger than the window are split as well
+        while(i < num_intervals && n < num_per_am && total_recv_size < window) {
+            size_t count = counts[i] - done;
+            if(count > window - total_recv_size)
+                count = window - total_recv_size;
+
+            req_offsets[n] = offsets[i] + done;
+            req_counts[n]  = count;
+            total_recv_size += count;
+            n++;
+
+            done += count;
+            if(done == counts[i]) {
+                done = 0;
+                i++;
+            }
+        }
+
+        size_t data_size;
+        void* user_data = rpc_in_pack(filename, n, req_offsets, req_counts, NULL, NULL, &data_size);
+        tangram_ucx_rma_request(rma_addr, user_data, data_size, recv_buf, total_recv_size);
+        free(user_data);
+
+        recv_buf += total_recv_size;
     }
 
-    free(user_data);
+    free(req_offsets);
+    free(req_counts);
+}
+
+/*
+ * Pull [ptr, ptr+count) of dest's buffer file with one-sided
+ * RMA get, `region` comes from the query respond.
+ */
+void tangram_issue_rma_get(tangram_uct_addr_t* dest, void* region, size_t ptr, size_t count, void* recv_buf) {
+    tangram_uct_addr_t* rma_addr = rpc_to_rma_addr(dest);
+    if(rma_addr)
+        tangram_ucx_rma_get(rma_addr, region, ptr, count, recv_buf);
+}
+
+void* tangram_rma_mem_reg(void* addr, size_t len, void** region, size_t* region_len) {
+    tangram_rma_mem_t* mem = tangram_ucx_rma_mem_reg(addr, len);
+    *region     = mem->region;
+    *region_len = mem->region_len;
+    return mem;
+}
+
+void tangram_rma_mem_dereg(void* handle) {
+    tangram_ucx_rma_mem_dereg((tangram_rma_mem_t*) handle);
+}
+
+bool tangram_rma_pull_enabled() {
+    return g_tfs_info->rma_pull && tangram_ucx_rma_get_supported();
+}
+
+/*
+ * Max number of intervals tangram_issue_rpc()
+ * sends in one AM. Callers that need the respond
+ * of every interval should not send more than this.
+ */
+int tangram_rpc_intervals_per_am(char* filename) {
+    return rpc_in_intervals_per_am(filename, tangram_uct_am_short_max_size());
 }
 
 void tangram_issue_metadata_rpc(uint8_t id, const char* path, void** respond_ptr) {
@@ -117,6 +298,8 @@ void tangram_rpc_service_start(tfs_info_t *tfs_info){
     // later the client will need to broadcast delegator's address
     // to all clients
 
+    if(tfs_info->use_delegator)
+        tangram_delegator_epoch_init(tfs_info);
     if(tfs_info->use_delegator && tfs_info->mpi_intra_rank == 0)
         tangram_delegator_start(tfs_info);
 
@@ -132,6 +315,9 @@ void tangram_rpc_service_stop() {
     }
 
     tangram_ucx_client_stop();
+
+    if(g_tfs_info->use_delegator)
+        tangram_delegator_epoch_finalize();
 }
 
 tangram_uct_addr_t* tangram_rpc_client_inter_addr() {
@@ -11,16 +11,26 @@ ssize_t tangram_write_impl(tfs_file_t* tf, const void* buf, size_t count) {
 
     ssize_t res = tfs_write(tf, buf, count);
 
+    // Post before the write returns, and wait for the server.
+    // We are not notified when the lock is revoked, so this is
+    // the only point where we know our data is not posted yet.
+    // The grant does not carry the last writer, readers find it
+    // with the server's query instead, see tangram_read_impl().
+    if(semantics == TANGRAM_STRONG_SEMANTICS && res > 0)
+        tfs_post(tf, origin_offset, res);
+
     return res;
 }
 
 ssize_t tangram_read_impl(tfs_file_t *tf, void* buf, size_t count) {
     int semantics = tangram_get_semantics();
 
-    if(semantics == TANGRAM_STRONG_SEMANTICS) {
+    // Every write that completed before we get the read lock has
+    // been posted, so the query in tfs_read() finds its writer and
+    // the data is pulled from it by RMA. Writes still in progress
+    // are concurrent with this read and may or may not be seen.
+    if(semantics == TANGRAM_STRONG_SEMANTICS)
         tfs_acquire_lock(tf, tf->offset, count, LOCK_TYPE_RD);
-        return tfs_read_local(tf, buf, count);
-    }
 
     // All three semantics use tfs_read()
     return tfs_read(tf, buf, count);
@@ -32,8 +42,7 @@ int tangram_commit_impl(tfs_file_t* tf) {
         tfs_post_file(tf);
     }
 
-    // TODO return value of fsync?
-    return 0;
+    return tfs_sync(tf);
 }
 
 
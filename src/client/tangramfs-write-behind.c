@@ -0,0 +1,214 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "utlist.h"
+#include "tangramfs.h"
+#include "tangramfs-utils.h"
+#include "tangramfs-posix-wrapper.h"
+#include "tangramfs-write-behind.h"
+
+// Upper bound of bytes appended by a single pwrite()
+#define WRITE_BEHIND_BATCH_SIZE     (8*1024*1024)
+
+typedef struct wb_record {
+    int      fd;                    // buffer log file descriptor
+    size_t   log_offset;            // where the data goes in the buffer log
+    size_t   size;
+    size_t   ring_pos;              // where the data is in the staging ring
+    uint64_t ring_end;              // ring head right after this record was staged
+    uint64_t ticket;
+    struct wb_record *next, *prev;
+} wb_record_t;
+
+typedef struct write_behind {
+    char*           ring;
+    size_t          capacity;
+
+    // Monotonic byte counters, head - tail is the
+    // number of ring bytes currently in use
+    uint64_t        head;
+    uint64_t        tail;
+
+    uint64_t        staged;         // ticket of the last staged record
+    uint64_t        written;        // ticket of the last record in the buffer log
+
+    wb_record_t*    records;        // FIFO of staged records
+
+    bool            running;
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  staged_cond;    // new records were staged
+    pthread_cond_t  written_cond;   // records were written and ring space released
+} write_behind_t;
+
+static write_behind_t g_wb;
+
+
+static void write_fully(int fd, const char* buf, size_t size, size_t offset) {
+    size_t done = 0;
+    while(done < size) {
+        ssize_t n = TANGRAM_REAL_CALL(pwrite)(fd, buf+done, size-done, offset+done);
+        tangram_assert(n > 0);
+        done += n;
+    }
+}
+
+/**
+ * Background thread, append staged records to the buffer log.
+ *
+ * Consecutive records of the same file are contiguous both in the
+ * buffer log (the log is append-only) and in the ring (records never
+ * wrap around), so a run of them is written with one pwrite().
+ */
+static void* write_behind_loop(void* arg) {
+
+    pthread_mutex_lock(&g_wb.lock);
+
+    while(true) {
+        while(g_wb.records == NULL && g_wb.running)
+            pthread_cond_wait(&g_wb.staged_cond, &g_wb.lock);
+
+        // Only exit after all staged records are written
+        if(g_wb.records == NULL)
+            break;
+
+        wb_record_t* first = g_wb.records;
+        wb_record_t* last  = first;
+        size_t total = first->size;
+        while(last->next && total + last->next->size <= WRITE_BEHIND_BATCH_SIZE &&
+              last->next->fd == first->fd &&
+              last->next->log_offset == last->log_offset + last->size &&
+              last->next->ring_pos == last->ring_pos + last->size) {
+            last   = last->next;
+            total += last->size;
+        }
+
+        // Writers only append after the head, and the ring
+        // space of [first, last] is not released until we
+        // advance the tail, so no lock is needed here.
+        pthread_mutex_unlock(&g_wb.lock);
+        write_fully(first->fd, g_wb.ring+first->ring_pos, total, first->log_offset);
+        pthread_mutex_lock(&g_wb.lock);
+
+        g_wb.tail    = last->ring_end;
+        g_wb.written = last->ticket;
+
+        bool done = false;
+        while(!done) {
+            wb_record_t* record = g_wb.records;
+            done = (record == last);
+            DL_DELETE(g_wb.records, record);
+            free(record);
+        }
+
+        pthread_cond_broadcast(&g_wb.written_cond);
+    }
+
+    pthread_mutex_unlock(&g_wb.lock);
+    return NULL;
+}
+
+uint64_t tangram_write_behind_stage(int fd, const void* buf, size_t size, size_t log_offset) {
+
+    // Large writes are already bandwidth-bound,
+    // write them directly to the buffer log.
+    if(size > g_wb.capacity / 2) {
+        write_fully(fd, buf, size, log_offset);
+        pthread_mutex_lock(&g_wb.lock);
+        uint64_t ticket = g_wb.staged;
+        pthread_mutex_unlock(&g_wb.lock);
+        return ticket;
+    }
+
+    wb_record_t* record = malloc(sizeof(wb_record_t));
+    record->fd         = fd;
+    record->size       = size;
+    record->log_offset = log_offset;
+
+    pthread_mutex_lock(&g_wb.lock);
+
+    // A record never wraps around the end of the ring,
+    // skip the tail part of the ring if it is too small.
+    size_t pos, pad;
+    while(true) {
+        pos = g_wb.head % g_wb.capacity;
+        pad = (pos + size > g_wb.capacity) ? (g_wb.capacity - pos) : 0;
+        if(g_wb.head + pad + size - g_wb.tail <= g_wb.capacity)
+            break;
+        pthread_cond_wait(&g_wb.written_cond, &g_wb.lock);
+    }
+
+    g_wb.head += pad;
+    record->ring_pos = g_wb.head % g_wb.capacity;
+    g_wb.head += size;
+    record->ring_end = g_wb.head;
+    record->ticket   = ++g_wb.staged;
+
+    memcpy(g_wb.ring+record->ring_pos, buf, size);
+    DL_APPEND(g_wb.records, record);
+
+    pthread_cond_signal(&g_wb.staged_cond);
+    pthread_mutex_unlock(&g_wb.lock);
+
+    return record->ticket;
+}
+
+void tangram_write_behind_drain(uint64_t ticket) {
+    if(g_wb.ring == NULL)
+        return;
+
+    pthread_mutex_lock(&g_wb.lock);
+    while(g_wb.written < ticket)
+        pthread_cond_wait(&g_wb.written_cond, &g_wb.lock);
+    pthread_mutex_unlock(&g_wb.lock);
+}
+
+int tangram_write_behind_sync(int fd, uint64_t ticket) {
+    tangram_write_behind_drain(ticket);
+    return fdatasync(fd);
+}
+
+void tangram_write_behind_init(tfs_info_t* tfs_info) {
+    g_wb.ring = NULL;
+    if(!tfs_info->write_behind)
+        return;
+
+    // Real calls are mapped per translation unit
+    tangram_map_real_calls();
+
+    g_wb.capacity = tfs_info->write_behind_size;
+    g_wb.ring     = malloc(g_wb.capacity);
+    g_wb.head     = 0;
+    g_wb.tail     = 0;
+    g_wb.staged   = 0;
+    g_wb.written  = 0;
+    g_wb.records  = NULL;
+    g_wb.running  = true;
+
+    pthread_mutex_init(&g_wb.lock, NULL);
+    pthread_cond_init(&g_wb.staged_cond, NULL);
+    pthread_cond_init(&g_wb.written_cond, NULL);
+    pthread_create(&g_wb.thread, NULL, write_behind_loop, NULL);
+}
+
+void tangram_write_behind_finalize() {
+    if(g_wb.ring == NULL)
+        return;
+
+    pthread_mutex_lock(&g_wb.lock);
+    g_wb.running = false;
+    pthread_cond_signal(&g_wb.staged_cond);
+    pthread_mutex_unlock(&g_wb.lock);
+    pthread_join(g_wb.thread, NULL);
+
+    pthread_cond_destroy(&g_wb.written_cond);
+    pthread_cond_destroy(&g_wb.staged_cond);
+    pthread_mutex_destroy(&g_wb.lock);
+
+    free(g_wb.ring);
+    g_wb.ring = NULL;
+}
@@ -7,10 +7,22 @@
 #include <fcntl.h>
 #include <mpi.h>
 #include <errno.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include "uthash.h"
 #include "tangramfs.h"
 #include "tangramfs-utils.h"
 #include "tangramfs-posix-wrapper.h"
+#include "tangramfs-write-behind.h"
+#include "tangramfs-flusher.h"
+#include "tangramfs-delegator.h"
+
+// Initial size of the buffer file mapping exposed for RMA
+#define TANGRAM_BUFFER_MAPPING_MIN  (4*1024*1024)
+
+// Bounds of the adaptive lock granularity
+#define TANGRAM_LOCK_BLOCK_MIN      64
+#define TANGRAM_LOCK_BLOCK_MAX      (1024*1024*1024)
 
 static tfs_info_t  g_tfs_info;
 static tfs_file_t* g_tfs_files;
@@ -18,6 +30,10 @@ static tfs_file_t* g_tfs_files;
 // Below callbacks will be invoked by tangram-ucx-client/rma
 void* serve_rma_data_cb(void* in_arg, size_t* size);
 
+ssize_t read_local_or_pfs(tfs_file_t* tf, void* buf, size_t req_start, size_t req_end);
+static void query_pieces(tfs_file_t* tf, size_t* offsets, size_t* counts, int num, int* num_pieces, rpc_piece_t** pieces);
+static void unexpose_buffer(tfs_file_t* tf);
+
 
 void tfs_init() {
 
@@ -37,6 +53,8 @@ void tfs_init() {
     tangram_map_real_calls();
     tangram_rpc_service_start(&g_tfs_info);
     tangram_rma_service_start(&g_tfs_info, serve_rma_data_cb);
+    tangram_write_behind_init(&g_tfs_info);
+    tangram_flusher_init(&g_tfs_info);
 
     MPI_Barrier(g_tfs_info.mpi_comm);
     g_tfs_info.initialized = true;
@@ -46,6 +64,8 @@ void tfs_init() {
 void tfs_release(tfs_file_t* tf) {
     // Clean up seg-tree and lock tokens
     seg_tree_destroy(&tf->seg_tree);
+    lock_token_list_destroy(&tf->lock_tokens);
+    unexpose_buffer(tf);
 
     // Delete from hash table
     HASH_DEL(g_tfs_files, tf);
@@ -58,16 +78,13 @@ void tfs_finalize() {
 
     g_tfs_info.initialized = false;
 
-    // Notify the server to unpost all and release all locks
-    if(tangram_get_semantics() != TANGRAM_STRONG_SEMANTICS)
-        tfs_unpost_client();
-    // We use lock-based implementation for strong consistency
-    else
+    // Notify the server to unpost all and release all locks.
+    // We use lock-based implementation for strong consistency,
+    // where writes are posted as well.
+    tfs_unpost_client();
+    if(tangram_get_semantics() == TANGRAM_STRONG_SEMANTICS)
         tfs_release_lock_client();
 
-    // TODO
-    // need to free local lock tokens
-
     // We should have no files in the table now.
     // Just in case users did not close all files
     // before calling finalize()
@@ -77,6 +94,9 @@ void tfs_finalize() {
         tfs_release(tf);
     }
 
+    tangram_flusher_finalize();
+    tangram_write_behind_finalize();
+
     // Need to have a barrier here because we can not allow
     // server stoped before all other clients
     MPI_Barrier(g_tfs_info.mpi_comm);
@@ -113,6 +133,10 @@ tfs_file_t* tfs_open(const char* pathname) {
         tf->stream = NULL;
         tf->fd     = -1;
         tf->offset = 0;
+        tf->local_size = 0;
+        tf->wb_ticket  = 0;
+        tf->flush      = NULL;
+        tf->mappings   = NULL;
         strcpy(tf->filename, shortname);
 
         #ifndef TANGRAMFS_PRELOAD
@@ -122,6 +146,10 @@ tfs_file_t* tfs_open(const char* pathname) {
         #endif
 
         seg_tree_init(&tf->seg_tree);
+        lock_token_list_init(&tf->lock_tokens);
+        tf->lock_epoch      = 0;
+        tf->lock_block_size = g_tfs_info.lock_block_size ? g_tfs_info.lock_block_size : LOCK_BLOCK_SIZE;
+        tf->lock_io_size    = 0;
 
                                 // TODO remove() call is not intercepted
         remove(bb_filename);   // delete the local file first
@@ -130,7 +158,11 @@ tfs_file_t* tfs_open(const char* pathname) {
 
     // We didn't use O_DIRECT as it requires buffer to be blok aligned
     // open node-local buffer file
-    tf->local_fd = TANGRAM_REAL_CALL(open)(bb_filename, O_CREAT|O_RDWR|O_SYNC, S_IRWXU);
+    // With write-behind, durability is provided by tfs_sync() at commit/close points
+    int flags = O_CREAT|O_RDWR;
+    if(!g_tfs_info.write_behind)
+        flags |= O_SYNC;
+    tf->local_fd = TANGRAM_REAL_CALL(open)(bb_filename, flags, S_IRWXU);
 
     return tf;
 }
@@ -143,62 +175,93 @@ void tfs_stat(tfs_file_t* tf, struct stat* buf) {
 }
 
 /*
- * Flush from local buffer file to PFS
+ * File descriptor of the targeting file on PFS,
+ * in case the file was opened with fopen()
+ */
+static int pfs_fd(tfs_file_t* tf) {
+    if(tf->fd == -1 && tf->stream != NULL)
+        return fileno(tf->stream);
+    return tf->fd;
+}
+
+/*
+ * Flush dirty segments from local buffer file to PFS
+ * in background. Return a handle that must be passed
+ * to tfs_flush_wait() exactly once.
+ *
+ * Dirty segments are marked clean once they are handed
+ * over to the flusher, the flusher marks them dirty again
+ * if writing them to PFS fails. Flushes of the same file are
+ * serialized, so an older snapshot never overwrites
+ * a newer one on PFS.
  *
- * TODO 1. Only flush dirty segments, i.e., tfs_fetch() also adds to seg_tree
- *      2. We can not guarantee that our segments are the latest, someone else
- *         probably has overwriten the same location.
- *         -- A coordinated flush mechanism is needed.
+ * TODO We can not guarantee that our segments are the latest, someone else
+ *      probably has overwriten the same location.
+ *      -- A coordinated flush mechanism is needed.
  */
-void tfs_flush(tfs_file_t *tf) {
-    size_t chunk_size = 4*1024*1024;
-    char* buf = malloc(chunk_size);
+tfs_flush_handle_t* tfs_flush_async(tfs_file_t *tf) {
+    if(tf->flush) {
+        tangram_flusher_wait(tf->flush);
+        tangram_flusher_handle_release(tf->flush);
+        tf->flush = NULL;
+    }
 
-    seg_tree_rdlock(&tf->seg_tree);
-    struct seg_tree_node *node = NULL;
+    tfs_flush_handle_t* handle = tangram_flusher_handle_create(pfs_fd(tf), tf->local_fd, tf->wb_ticket, &tf->seg_tree);
 
+    seg_tree_wrlock(&tf->seg_tree);
+    struct seg_tree_node *node = NULL;
     while ((node = seg_tree_iter(&tf->seg_tree, node))) {
+        if(!seg_tree_dirty_nolock(&tf->seg_tree, node))
+            continue;
+        tangram_flusher_add(handle, node->start, node->ptr, node->end-node->start+1);
+        seg_tree_set_clean_nolock(&tf->seg_tree, node);
+    }
+    seg_tree_unlock(&tf->seg_tree);
 
-        ssize_t n;  // use ssize_t, as n can be -1
-        ssize_t all = node->end - node->start + 1;
-
-        ssize_t local_offset;
-        ssize_t done = 0;
-
-
-        while(done < all) {
-
-            size_t s = chunk_size < all ? chunk_size : all;
-            n = TANGRAM_REAL_CALL(pread)(tf->local_fd, buf, s, node->ptr+done);
-
-            // something wrong, the file was deleted?
-            if(n <= 0) break;
-
-            // In case file opend with fopen()
-            int fd = tf->fd;
-            if(fd == -1 && tf->stream != NULL)
-                fd = fileno(tf->stream);
-
-            TANGRAM_REAL_CALL(pwrite)(fd, buf, n, node->start+done);
+    tangram_flusher_submit(handle);
 
-            done += n;
-        }
-    }
+    // One reference for the caller, one for tf->flush
+    tangram_flusher_handle_retain(handle);
+    tf->flush = handle;
+    return handle;
+}
 
-    seg_tree_unlock(&tf->seg_tree);
+/*
+ * Wait for a flush started by tfs_flush_async()
+ * Return 0 on success
+ */
+int tfs_flush_wait(tfs_flush_handle_t* handle) {
+    int rc = tangram_flusher_wait(handle);
+    tangram_flusher_handle_release(handle);
+    return rc;
+}
 
-    free(buf);
+/*
+ * Flush from local buffer file to PFS
+ * Return 0 on success
+ */
+int tfs_flush(tfs_file_t *tf) {
+    return tfs_flush_wait(tfs_flush_async(tf));
 }
 
 
 ssize_t tfs_write(tfs_file_t* tf, const void* buf, size_t size) {
-    size_t local_offset = TANGRAM_REAL_CALL(lseek)(tf->local_fd, 0, SEEK_END);
-    ssize_t res = TANGRAM_REAL_CALL(pwrite)(tf->local_fd, buf, size, local_offset);
-    tangram_assert(res == size);
-    // BB file opened with O_SYNC, no need to use fsync()
-    //TANGRAM_REAL_CALL(fsync)(tf->local_fd);
+    // The local buffer file is append-only
+    size_t local_offset = tf->local_size;
+    ssize_t res = size;
+
+    if(g_tfs_info.write_behind) {
+        tf->wb_ticket = tangram_write_behind_stage(tf->local_fd, buf, size, local_offset);
+    } else {
+        res = TANGRAM_REAL_CALL(pwrite)(tf->local_fd, buf, size, local_offset);
+        tangram_assert(res == size);
+        // BB file opened with O_SYNC, no need to use fsync()
+        //TANGRAM_REAL_CALL(fsync)(tf->local_fd);
+    }
+    tf->local_size += size;
 
-    int rc = seg_tree_add(&tf->seg_tree, tf->offset, tf->offset+size-1, local_offset, tangram_rpc_client_inter_addr(), false);
+    // Owners are only kept by the server, all segments here are ours
+    int rc = seg_tree_add(&tf->seg_tree, tf->offset, tf->offset+size-1, local_offset, 0, false);
     tangram_assert(rc == 0);
 
     tf->offset += size;
@@ -215,125 +278,260 @@ ssize_t tfs_read_peer(tfs_file_t* tf, void* buf, size_t size, tangram_uct_addr_t
     return size;
 }
 
-ssize_t tfs_read(tfs_file_t* tf, void* buf, size_t size) {
-    tangram_uct_addr_t *self  = tangram_rpc_client_inter_addr();
-    tangram_uct_addr_t *owner = NULL;
-    int res = tfs_query(tf, tf->offset, size, &owner);
-    //printf("[tangramfs %d] res: %d, read %s ([%luKB,%luKB])\n", g_tfs_info.mpi_rank, res, tf->filename, tf->offset/1024, size/1024);
+/*
+ * Pieces of one tfs_read() that are held by the same peer.
+ *
+ * If the peer has exposed its buffer file, we pull each piece
+ * with one-sided RMA get. Otherwise, they are fetched with one
+ * multi-interval RMA request served by the peer.
+ */
+typedef struct peer_read {
+    tfs_file_t*         tf;
+    tangram_uct_addr_t* owner;
+    int                 num;
+    int                 capacity;
+    size_t*             offsets;
+    size_t*             counts;
+    size_t*             ptrs;       // offsets in the peer's buffer file
+    void*               region;     // NULL if the peer has not exposed its buffer file
+    char*               buf;        // user buffer
+    size_t              buf_start;  // file offset of buf[0]
+} peer_read_t;
+
+static void peer_read(peer_read_t* pr) {
+
+    if(pr->region) {
+        for(int i = 0; i < pr->num; i++)
+            tangram_issue_rma_get(pr->owner, pr->region, pr->ptrs[i], pr->counts[i],
+                                  pr->buf + (pr->offsets[i] - pr->buf_start));
+        return;
+    }
 
-    // Another client holds the latest data,
-    // issue a RMA request to get the data
-    if(res == 0 && tangram_uct_addr_compare(owner, self) != 0) {
-        tfs_read_peer(tf, buf, size, owner);
-        if(owner)
-            tangram_uct_addr_free(owner);
-        return size;
+    // Single interval, receive directly into the user buffer
+    if(pr->num == 1) {
+        tangram_issue_rma(AM_ID_RMA_REQUEST, pr->tf->filename, pr->owner, pr->offsets, pr->counts, 1,
+                          pr->buf + (pr->offsets[0] - pr->buf_start));
+        return;
     }
 
+    size_t total = 0;
+    for(int i = 0; i < pr->num; i++)
+        total += pr->counts[i];
 
-    // Otherwise, two cases:
-    // 1. res != 0, server doesn't know, which means:
-    //      (a) client (possibly myself) has not posted, or
-    //      (b) the file already exists on PFS
-    // 2. res = 0, but myself has the latest data
-    // In both case, we read it locally
-    if(res != 0 || tangram_uct_addr_compare(owner, self) == 0) {
-        //printf("tfs_read(). not written by others, perform local or pfs read\n");
-        if(owner)
-            tangram_uct_addr_free(owner);
-        return tfs_read_local(tf, buf, size);
-    }
+    // The peer sends back all intervals back-to-back,
+    // scatter them into the user buffer.
+    char* tmp = malloc(total);
+    tangram_issue_rma(AM_ID_RMA_REQUEST, pr->tf->filename, pr->owner, pr->offsets, pr->counts, pr->num, tmp);
 
-    return size;
+    size_t pos = 0;
+    for(int i = 0; i < pr->num; i++) {
+        memcpy(pr->buf + (pr->offsets[i] - pr->buf_start), tmp+pos, pr->counts[i]);
+        pos += pr->counts[i];
+    }
+    free(tmp);
 }
 
+/*
+ * Peers of one tfs_read(), fetched by a few threads. Each thread
+ * takes the next peer until none is left. No more threads than
+ * RMA streams are started, as requests beyond that would only
+ * wait for a stream.
+ */
+typedef struct peer_reads {
+    peer_read_t* peers;
+    int          num;
+    int          next;              // next peer to fetch, bumped atomically
+} peer_reads_t;
+
+static void* peer_reads_func(void* arg) {
+    peer_reads_t* prs = (peer_reads_t*) arg;
+    int j;
+    while((j = __atomic_fetch_add(&prs->next, 1, __ATOMIC_RELAXED)) < prs->num)
+        peer_read(&prs->peers[j]);
+    return NULL;
+}
 
-/**
- * Read from local buffer or PFS directly
+/*
+ * The range may be written by multiple clients. Ask the server
+ * who holds each piece of it, then fetch the pieces from their
+ * owners concurrently, see peer_reads_t. Pieces owned by myself
+ * and pieces no one has posted are read locally or from PFS.
  */
-ssize_t read_local_or_pfs(tfs_file_t* tf, void* buf, size_t req_start, size_t req_end) {
+ssize_t tfs_read(tfs_file_t* tf, void* buf, size_t size) {
+    if(size == 0) return 0;
 
-    struct seg_tree *extents = &tf->seg_tree;
+    tangram_uct_addr_t *self = tangram_rpc_client_inter_addr();
+    size_t req_start = tf->offset;
+    size_t req_end   = tf->offset + size - 1;
 
-    seg_tree_rdlock(extents);
+    int num_pieces;
+    rpc_piece_t* pieces;
+    query_pieces(tf, &req_start, &size, 1, &num_pieces, &pieces);
+
+    // Group the pieces held by others by owner
+    int num_peers = 0;
+    peer_read_t* peers = NULL;
+    for(int i = 0; i < num_pieces; i++) {
+        if(tangram_uct_addr_compare(pieces[i].owner, self) == 0)
+            continue;
+
+        peer_read_t* pr = NULL;
+        for(int j = 0; j < num_peers; j++) {
+            if(tangram_uct_addr_compare(peers[j].owner, pieces[i].owner) == 0) {
+                pr = &peers[j];
+                break;
+            }
+        }
+        if(pr == NULL) {
+            peers = realloc(peers, sizeof(peer_read_t) * (num_peers+1));
+            pr = &peers[num_peers++];
+            memset(pr, 0, sizeof(peer_read_t));
+            pr->tf        = tf;
+            pr->owner     = pieces[i].owner;
+            pr->buf       = buf;
+            pr->buf_start = req_start;
+            if(tangram_rma_pull_enabled())
+                pr->region = pieces[i].region;
+        }
+        if(pr->num == pr->capacity) {
+            pr->capacity = pr->capacity ? pr->capacity * 2 : 4;
+            pr->offsets  = realloc(pr->offsets, sizeof(size_t) * pr->capacity);
+            pr->counts   = realloc(pr->counts,  sizeof(size_t) * pr->capacity);
+            pr->ptrs     = realloc(pr->ptrs,    sizeof(size_t) * pr->capacity);
+        }
+        pr->offsets[pr->num] = pieces[i].offset;
+        pr->counts[pr->num]  = pieces[i].count;
+        pr->ptrs[pr->num]    = pieces[i].ptr;
+        pr->num++;
+    }
 
-    /* can we fully satisfy this request? assume we can */
-    int have_local = 1;
-
-    /* this will point to the offset of the next byte we
-     * need to account for */
-    size_t expected_start = req_start;
-
-    /* iterate over extents we have for this file,
-     * and check that there are no holes in coverage.
-     * we search for a starting extent using a range
-     * of just the very first byte that we need */
-    struct seg_tree_node* first;
-    first = seg_tree_find_nolock(extents, req_start, req_start);
-    struct seg_tree_node* next = first;
-    while (next != NULL && next->start < req_end) {
-        if (expected_start >= next->start) {
-            /* this extent has the next byte we expect,
-             * bump up to the first byte past the end
-             * of this extent */
-            expected_start = next->end + 1;
-        } else {
-            /* there is a gap between extents so we're missing
-             * some bytes */
-            have_local = 0;
+    // A single peer is fetched by us after the local part. We
+    // also help once the local part is done, so if no thread can
+    // be created the peers are still read.
+    peer_reads_t prs = {peers, num_peers, 0};
+    int num_threads = num_peers < g_tfs_info.rma_streams ? num_peers : g_tfs_info.rma_streams;
+    if(num_peers == 1)
+        num_threads = 0;
+    pthread_t* threads = NULL;
+    if(num_threads > 0)
+        threads = malloc(sizeof(pthread_t) * num_threads);
+    for(int j = 0; j < num_threads; j++) {
+        if(pthread_create(&threads[j], NULL, peer_reads_func, &prs) != 0) {
+            num_threads = j;
             break;
         }
+    }
 
-        /* get the next element in the tree */
-        next = seg_tree_iter(extents, next);
+    // Meanwhile, read the rest locally, two cases:
+    // 1. the server doesn't know, which means:
+    //      (a) client (possibly myself) has not posted, or
+    //      (b) the file already exists on PFS
+    // 2. myself has the latest data
+    ssize_t res = size;
+    size_t pos = req_start;
+    for(int i = 0; i <= num_pieces; i++) {
+        bool last = (i == num_pieces);
+        if(!last && tangram_uct_addr_compare(pieces[i].owner, self) == 0)
+            continue;
+
+        size_t end = last ? req_end+1 : pieces[i].offset;
+        if(pos < end) {
+            ssize_t n = read_local_or_pfs(tf, buf+(pos-req_start), pos, end-1);
+            if(last)
+                res = pos - req_start + n;
+            else if(n < end-pos)
+                memset(buf+(pos-req_start)+n, 0, end-pos-n);
+        }
+        if(!last)
+            pos = pieces[i].offset + pieces[i].count;
     }
 
-    /* check that we account for the full request
-     * up until the last byte */
-    if (expected_start < req_end) {
-        /* missing some bytes at the end of the request */
-        have_local = 0;
+    peer_reads_func(&prs);
+    for(int j = 0; j < num_threads; j++)
+        pthread_join(threads[j], NULL);
+    free(threads);
+
+    for(int j = 0; j < num_peers; j++) {
+        free(peers[j].offsets);
+        free(peers[j].counts);
+        free(peers[j].ptrs);
     }
 
-    /*
-     * If we can't fully satisfy the request,
-     * flush first my local writes, then directly read from PFS
-     */
-    if(!have_local) {
-        seg_tree_unlock(extents);
+    free(peers);
+    rpc_pieces_free(pieces, num_pieces);
 
-        // TODO opt possible: can we avoid the flush?
-        tfs_flush(tf);
+    tf->offset += res;
+    return res;
+}
 
-        // TODO what if opend as tf->stream?
-        ssize_t res = TANGRAM_REAL_CALL(pread)(tf->fd, buf, req_end-req_start+1, req_start);
-        tangram_debug("[tangramfs client %d] read from PFS %s, [%luKB, %luKB], res: %ld\n", g_tfs_info.mpi_rank, tf->filename, req_start/1024, (req_end-req_start+1)/1024, res);
 
-        return res;
+/**
+ * Read [offset, offset+count) from PFS.
+ * Return the number of bytes read, which is
+ * less than count if we hit the EOF.
+ */
+static size_t read_pfs(tfs_file_t* tf, char* buf, size_t offset, size_t count) {
+    int fd = pfs_fd(tf);
+    size_t done = 0;
+    while(done < count) {
+        ssize_t n = TANGRAM_REAL_CALL(pread)(fd, buf+done, count-done, offset+done);
+        if(n <= 0) break;
+        done += n;
     }
+    tangram_debug("[tangramfs client %d] read from PFS %s, [%luKB, %luKB], res: %lu\n", g_tfs_info.mpi_rank, tf->filename, offset/1024, count/1024, done);
+    return done;
+}
 
+/**
+ * Read from local buffer or PFS directly
+ *
+ * Walk the extents that overlap the request, the covered
+ * pieces are served from the local buffer file and only
+ * the holes between them are read from PFS.
+ */
+ssize_t read_local_or_pfs(tfs_file_t* tf, void* buf, size_t req_start, size_t req_end) {
 
-    /* otherwise we can copy the data locally, iterate
-     * over the extents and copy data into request buffer.
-     * again search for a starting extent using a range
-     * of just the very first byte that we need */
-    next = first;
-    size_t off = 0;
-    expected_start = req_start;
-    while ((next != NULL) && (next->start < req_end)) {
-        /* get start and length of this extent */
-        size_t ext_start = next->start;
-        size_t ext_length = (next->end + 1) - ext_start;
-        size_t ext_pos = next->ptr;
+    struct seg_tree *extents = &tf->seg_tree;
+
+    // Staged writes must reach the local buffer file before we read it
+    tangram_write_behind_drain(tf->wb_ticket);
+
+    seg_tree_rdlock(extents);
+
+    /* the next byte we need to account for, and the
+     * end of valid data we have read so far */
+    size_t pos = req_start;
+    size_t valid_end = req_start;
+
+    struct seg_tree_node* next = seg_tree_find_nolock(extents, req_start, req_end);
+    while (pos <= req_end) {
+
+        if (next == NULL || next->start > req_end) {
+            /* no more extents, the rest is on PFS */
+            size_t count = req_end - pos + 1;
+            valid_end = pos + read_pfs(tf, buf+(pos-req_start), pos, count);
+            break;
+        }
+
+        if (pos < next->start) {
+            /* a hole before this extent, anything PFS does not
+             * have in the hole is zero, as the file extends beyond
+             * it by this extent */
+            size_t count = next->start - pos;
+            size_t n = read_pfs(tf, buf+(pos-req_start), pos, count);
+            memset(buf+(pos-req_start)+n, 0, count-n);
+            pos = next->start;
+        }
 
         /* the bytes this extent can provide */
-        size_t this_pos = ext_pos + (req_start - ext_start);
-        size_t this_length = (next->end < req_end) ? (next->end-req_start+1) : (req_end-req_start+1);
-        TANGRAM_REAL_CALL(pread)(tf->local_fd, buf+off, this_length, this_pos);
-        //printf("%d read from local file %d: %lu %lu\n", g_tfs_info.mpi_rank, tf->local_fd, this_pos, this_length);
+        size_t this_end    = (next->end < req_end) ? next->end : req_end;
+        size_t this_length = this_end - pos + 1;
+        size_t this_pos    = next->ptr + (pos - next->start);
+        ssize_t n = TANGRAM_REAL_CALL(pread)(tf->local_fd, buf+(pos-req_start), this_length, this_pos);
+        tangram_assert(n == this_length);
 
-        off += this_length;
-        expected_start = next->end + 1;
+        pos = this_end + 1;
+        valid_end = pos;
 
         /* get the next element in the tree */
         next = seg_tree_iter(extents, next);
@@ -341,7 +539,7 @@ ssize_t read_local_or_pfs(tfs_file_t* tf, void* buf, size_t req_start, size_t re
 
     /* done reading the tree */
     seg_tree_unlock(extents);
-    return req_end-req_start+1;
+    return valid_end - req_start;
 }
 
 ssize_t tfs_read_local(tfs_file_t* tf, void* buf, size_t size) {
@@ -384,6 +582,76 @@ size_t tfs_tell(tfs_file_t* tf) {
     return tf->offset;
 }
 
+/*
+ * A read-only mapping of the local buffer file
+ * registered for RMA, see expose_buffer().
+ */
+typedef struct buffer_mapping {
+    void*   addr;
+    size_t  size;
+    void*   handle;         // returned by tangram_rma_mem_reg()
+    void*   region;
+    size_t  region_len;
+    struct buffer_mapping* next;
+} buffer_mapping_t;
+
+/*
+ * Expose the local buffer file for peers to read with one-sided
+ * RMA get, so serving reads does not need our CPU.
+ *
+ * The buffer file is append-only, once the mapping does not cover
+ * all of it, we extend the file and map it again with doubled size.
+ * Older mappings are kept until the file is released, as peers may
+ * still be reading through them.
+ *
+ * Return the region of the newest mapping, or NULL if pull mode
+ * is disabled.
+ */
+static void expose_buffer(tfs_file_t* tf, void** region, size_t* region_len) {
+    *region = NULL;
+    *region_len = 0;
+    if(!tangram_rma_pull_enabled() || tf->local_size == 0)
+        return;
+
+    // Peers read the buffer file directly, staged writes must be in it
+    tangram_write_behind_drain(tf->wb_ticket);
+
+    buffer_mapping_t* mapping = tf->mappings;
+    if(mapping == NULL || mapping->size < tf->local_size) {
+        size_t size = mapping ? mapping->size : TANGRAM_BUFFER_MAPPING_MIN;
+        while(size < tf->local_size)
+            size *= 2;
+
+        // Holes beyond local_size are never read, and
+        // later writes only append at local_size
+        int rc = ftruncate(tf->local_fd, size);
+        tangram_assert(rc == 0);
+
+        mapping = malloc(sizeof(buffer_mapping_t));
+        mapping->size = size;
+        mapping->addr = mmap(NULL, size, PROT_READ, MAP_SHARED, tf->local_fd, 0);
+        tangram_assert(mapping->addr != MAP_FAILED);
+        mapping->handle = tangram_rma_mem_reg(mapping->addr, size, &mapping->region, &mapping->region_len);
+        mapping->next = tf->mappings;
+        tf->mappings = mapping;
+    }
+
+    *region = mapping->region;
+    *region_len = mapping->region_len;
+}
+
+static void unexpose_buffer(tfs_file_t* tf) {
+    buffer_mapping_t* mapping = tf->mappings;
+    while(mapping) {
+        buffer_mapping_t* next = mapping->next;
+        tangram_rma_mem_dereg(mapping->handle);
+        munmap(mapping->addr, mapping->size);
+        free(mapping);
+        mapping = next;
+    }
+    tf->mappings = NULL;
+}
+
 void tfs_post(tfs_file_t* tf, size_t offset, size_t count) {
     if(count <= 0 || offset < 0) return;
 
@@ -392,9 +660,12 @@ void tfs_post(tfs_file_t* tf, size_t offset, size_t count) {
     struct seg_tree_node* node = seg_tree_find_exact(&tf->seg_tree, offset, offset+count-1);
     tangram_assert(node != NULL);
 
-    int* ack;
-    tangram_issue_rpc(AM_ID_POST_REQUEST, tf->filename, &offset, &count, NULL, 1, (void**)&ack);
-    free(ack);
+    void* region = NULL;
+    size_t region_len = 0;
+    expose_buffer(tf, &region, &region_len);
+
+    size_t ptr = node->ptr;
+    tangram_issue_post(tf->filename, &offset, &count, &ptr, 1, region, region_len);
 
     seg_tree_wrlock(&tf->seg_tree);
     seg_tree_set_posted_nolock(&tf->seg_tree, node);
@@ -407,6 +678,7 @@ void tfs_post_file(tfs_file_t* tf) {
     int i = 0;
     size_t *offsets = NULL;
     size_t *counts  = NULL;
+    size_t *ptrs    = NULL;
 
     seg_tree_wrlock(&tf->seg_tree);
     struct seg_tree_node *node = NULL;
@@ -423,11 +695,13 @@ void tfs_post_file(tfs_file_t* tf) {
 
     offsets = malloc(sizeof(size_t) * num);
     counts  = malloc(sizeof(size_t) * num);
+    ptrs    = malloc(sizeof(size_t) * num);
 
     node = NULL;
     while ((node = seg_tree_iter(&tf->seg_tree, node))) {
         if(!seg_tree_posted_nolock(&tf->seg_tree, node)) {
             offsets[i]  = node->start;
+            ptrs[i]     = node->ptr;
             counts[i++] = node->end - node->start + 1;
             seg_tree_set_posted_nolock(&tf->seg_tree, node);
         }
@@ -436,12 +710,14 @@ void tfs_post_file(tfs_file_t* tf) {
     // Coalesce all ranges in the tree
     seg_tree_coalesce_all_nolock(&tf->seg_tree);
 
-    int* ack;
-    tangram_issue_rpc(AM_ID_POST_REQUEST, tf->filename, offsets, counts, NULL, num, (void**)&ack);
-    free(ack);
+    void* region = NULL;
+    size_t region_len = 0;
+    expose_buffer(tf, &region, &region_len);
+    tangram_issue_post(tf->filename, offsets, counts, ptrs, num, region, region_len);
 
     free(offsets);
     free(counts);
+    free(ptrs);
 
     seg_tree_unlock(&tf->seg_tree);
 }
@@ -458,47 +734,149 @@ void tfs_unpost_client() {
     free(ack);
 }
 
-int tfs_query(tfs_file_t* tf, size_t offset, size_t size, tangram_uct_addr_t** owner) {
-    void* buf = NULL;
-    tangram_issue_rpc(AM_ID_QUERY_REQUEST, tf->filename, &offset, &size, NULL, 1, &buf);
-
-    int err = 0;
-    bool found_owner;
-    memcpy(&found_owner, buf, sizeof(bool));
-    if(found_owner) {
-        *owner = malloc(sizeof(tangram_uct_addr_t));
-        tangram_uct_addr_deserialize(buf+sizeof(bool), *owner);
-    } else {
-        *owner = NULL;
-        err = -1;
+/*
+ * Ask the server who holds each piece of the intervals.
+ * For interval i, num_pieces[i] pieces are returned in pieces[i].
+ *
+ * The server may not be able to fit all pieces in one respond,
+ * it then tells how much of each interval it has answered and
+ * we query again for the remaining part.
+ */
+static void query_pieces(tfs_file_t* tf, size_t* offsets, size_t* counts, int num, int* num_pieces, rpc_piece_t** pieces) {
+    size_t* q_offsets = malloc(sizeof(size_t) * num);
+    size_t* q_counts  = malloc(sizeof(size_t) * num);
+    int*    q_index   = malloc(sizeof(int) * num);
+    int*    capacity  = malloc(sizeof(int) * num);
+
+    int remain = 0;
+    for(int i = 0; i < num; i++) {
+        num_pieces[i] = 0;
+        pieces[i]     = NULL;
+        capacity[i]   = 0;
+        if(counts[i] == 0) continue;
+        q_offsets[remain] = offsets[i];
+        q_counts[remain]  = counts[i];
+        q_index[remain]   = i;
+        remain++;
+    }
+
+    int num_per_am = tangram_rpc_intervals_per_am(tf->filename);
+
+    while(remain > 0) {
+        // Query all remaining intervals at once, the AMs
+        // are in flight at the same time. The m-th respond
+        // answers intervals [m*num_per_am, (m+1)*num_per_am).
+        void** bufs = NULL;
+        tangram_rpc_req_t* req = tangram_issue_rpc_nb(AM_ID_QUERY_REQUEST, tf->filename, q_offsets, q_counts, NULL, remain);
+        int num_ams = tangram_rpc_wait(req, &bufs);
+
+        void* ptr = NULL;
+        bool progress = false;
+        for(int j = 0; j < remain; j++) {
+            if(j % num_per_am == 0)
+                ptr = bufs[j / num_per_am];
+
+            size_t answered;
+            int np;
+            memcpy(&answered, ptr, sizeof(size_t));
+            ptr += sizeof(size_t);
+            memcpy(&np, ptr, sizeof(int));
+            ptr += sizeof(int);
+
+            int i = q_index[j];
+            for(int k = 0; k < np; k++) {
+                if(num_pieces[i] == capacity[i]) {
+                    capacity[i] = capacity[i] ? capacity[i] * 2 : 4;
+                    pieces[i] = realloc(pieces[i], sizeof(rpc_piece_t) * capacity[i]);
+                }
+                rpc_piece_t* piece = &pieces[i][num_pieces[i]++];
+                memcpy(&piece->offset, ptr, sizeof(size_t));
+                ptr += sizeof(size_t);
+                memcpy(&piece->count, ptr, sizeof(size_t));
+                ptr += sizeof(size_t);
+                memcpy(&piece->ptr, ptr, sizeof(size_t));
+                ptr += sizeof(size_t);
+                piece->owner = malloc(sizeof(tangram_uct_addr_t));
+                tangram_uct_addr_deserialize(ptr, piece->owner);
+                ptr += (sizeof(size_t)*2 + piece->owner->dev_len + piece->owner->iface_len);
+                memcpy(&piece->region_len, ptr, sizeof(size_t));
+                ptr += sizeof(size_t);
+                piece->region = NULL;
+                if(piece->region_len > 0) {
+                    piece->region = malloc(piece->region_len);
+                    memcpy(piece->region, ptr, piece->region_len);
+                    ptr += piece->region_len;
+                }
+            }
+
+            q_offsets[j] += answered;
+            q_counts[j]  -= answered;
+            progress = progress || (answered > 0);
+        }
+        for(int m = 0; m < num_ams; m++)
+            free(bufs[m]);
+        free(bufs);
+        tangram_assert(progress);
+
+        // Keep only the intervals not fully answered
+        int k = 0;
+        for(int j = 0; j < remain; j++) {
+            if(q_counts[j] == 0) continue;
+            q_offsets[k] = q_offsets[j];
+            q_counts[k]  = q_counts[j];
+            q_index[k]   = q_index[j];
+            k++;
+        }
+        remain = k;
     }
 
-    free(buf);
-    return err;
+    free(q_offsets);
+    free(q_counts);
+    free(q_index);
+    free(capacity);
+}
+
+/*
+ * Return 0 and set *owner if one client holds the entire range
+ */
+int tfs_query(tfs_file_t* tf, size_t offset, size_t size, tangram_uct_addr_t** owner) {
+    return tfs_query_many(tf, &offset, &size, 1, owner) == 1 ? 0 : -1;
 }
 
+/*
+ * For each interval, set owners[i] if one client holds the
+ * entire interval, otherwise owners[i] is NULL.
+ * Return the number of intervals that have an owner.
+ */
 int tfs_query_many(tfs_file_t* tf, size_t* offsets, size_t* sizes, int num, tangram_uct_addr_t** owners) {
-    void* buf = NULL;
-    tangram_issue_rpc(AM_ID_QUERY_REQUEST, tf->filename, offsets, sizes, NULL, num, &buf);
+    int* num_pieces = malloc(sizeof(int) * num);
+    rpc_piece_t** pieces = malloc(sizeof(rpc_piece_t*) * num);
+    query_pieces(tf, offsets, sizes, num, num_pieces, pieces);
 
-    void* ptr = buf;
+    int found = 0;
     for(int i = 0; i < num; i++) {
-        bool found_owner;
-        memcpy(&found_owner, ptr, sizeof(bool));
-        ptr += sizeof(bool);
         owners[i] = NULL;
-        if(found_owner) {
-            owners[i] = malloc(sizeof(tangram_uct_addr_t));
-            tangram_uct_addr_deserialize(ptr, owners[i]);
-            tangram_uct_addr_t* owner = owners[i];
-            ptr += (sizeof(size_t)*2 + owners[i]->dev_len + owners[i]->iface_len);
-            //char *tmp = (char*)owner->dev;
-            //printf("query_many([%lu, %lu] %d/%d), owner: %02X:%02X:%02X:%02X:%02X:%02X\n", offsets[i]/1024, sizes[i]/1024,
-            //        i, num, tmp[0], tmp[1], tmp[2], tmp[3], tmp[4], tmp[5]);
+        if(num_pieces[i] == 1 && pieces[i][0].offset == offsets[i] && pieces[i][0].count == sizes[i]) {
+            owners[i] = pieces[i][0].owner;
+            pieces[i][0].owner = NULL;
+            found++;
         }
+        rpc_pieces_free(pieces[i], num_pieces[i]);
     }
-    free(buf);
-    return 0;
+
+    free(num_pieces);
+    free(pieces);
+    return found;
+}
+
+/**
+ * Make all previous writes of this file
+ * durable in the local buffer file
+ */
+int tfs_sync(tfs_file_t* tf) {
+    if(tf->local_fd == -1 || !g_tfs_info.write_behind)
+        return 0;
+    return tangram_write_behind_sync(tf->local_fd, tf->wb_ticket);
 }
 
 int tfs_close(tfs_file_t* tf) {
@@ -512,6 +890,14 @@ int tfs_close(tfs_file_t* tf) {
     // Flush from BB to PFS
     //tfs_flush(tf);
 
+    // The buffer file must stay open until
+    // a pending flush has read all its data
+    if(tf->flush) {
+        tangram_flusher_wait(tf->flush);
+        tangram_flusher_handle_release(tf->flush);
+        tf->flush = NULL;
+    }
+
     // Close all file descriptors
     if(tf->stream != NULL) {
         TANGRAM_REAL_CALL(fclose)(tf->stream);
@@ -522,6 +908,7 @@ int tfs_close(tfs_file_t* tf) {
         tf->fd = -1;
     }
     if(tf->local_fd != -1) {
+        tfs_sync(tf);
         res = TANGRAM_REAL_CALL(close)(tf->local_fd);
         tf->local_fd = -1;
     }
@@ -536,16 +923,170 @@ int tfs_close(tfs_file_t* tf) {
     return res;
 }
 
-int tfs_acquire_lock(tfs_file_t* tf, size_t offset, size_t count, int type) {
-    // Do not have the lock, ask lock manager for it
-    //printf("acquire lock %d\n", offset/4096);
-    void* ack;
-    tangram_issue_rpc(AM_ID_ACQUIRE_LOCK_REQUEST, tf->filename, &offset, &count, &type, 1, &ack);
-    free(ack);
+/**
+ * Locks granted by the delegator are cached in tf->lock_tokens,
+ * so acquires they cover need no RPC at all. The cache is only
+ * valid within one delegator epoch; any revocation on this node
+ * bumps the epoch and we drop the whole cache.
+ *
+ * Without delegators the server drops tokens without telling
+ * us, so there is nothing to cache.
+ */
+static bool lock_cache_enabled() {
+    return g_tfs_info.lock_cache && g_tfs_info.use_delegator;
+}
+
+static uint64_t lock_cache_validate(tfs_file_t* tf) {
+    uint64_t epoch = tangram_delegator_epoch();
+    if(tf->lock_epoch != epoch) {
+        lock_token_list_destroy(&tf->lock_tokens);
+        tf->lock_epoch = epoch;
+    }
+    return epoch;
+}
+
+static void lock_cache_drop(tfs_file_t* tf, size_t offset, size_t count) {
+    lock_token_t* token;
+    while((token = lock_token_find_conflict(&tf->lock_tokens, offset, count)) != NULL)
+        lock_token_delete(&tf->lock_tokens, token);
+}
+
+/**
+ * Adaptive lock granularity, the block size follows the average
+ * I/O size of the file, rounded up to a power of two. Large
+ * sequential I/O gets few large tokens, small records get small
+ * blocks so neighbouring records of other ranks do not conflict.
+ *
+ * Tokens of different block sizes can coexist, as tokens keep
+ * byte ranges.
+ */
+static void lock_block_adapt(tfs_file_t* tf, size_t count) {
+    if(g_tfs_info.lock_block_size != 0)
+        return;
+
+    tf->lock_io_size = tf->lock_io_size ? (tf->lock_io_size*3 + count) / 4 : count;
+
+    size_t block_size = TANGRAM_LOCK_BLOCK_MIN;
+    while(block_size < tf->lock_io_size && block_size < TANGRAM_LOCK_BLOCK_MAX)
+        block_size *= 2;
+    tf->lock_block_size = block_size;
+}
+
+typedef struct lock_range {
+    size_t offset;
+    size_t count;
+    int    type;
+} lock_range_t;
+
+static int lock_range_compare(const void* a, const void* b) {
+    const lock_range_t* r1 = a;
+    const lock_range_t* r2 = b;
+    if(r1->offset != r2->offset)
+        return r1->offset < r2->offset ? -1 : 1;
     return 0;
 }
 
+/**
+ * If `align` is set, align the ranges to the lock granularity of
+ * the file, then sort them and merge the ones that overlap or
+ * touch. A merged range takes the stronger type. The server
+ * requires ranges of one request do not overlap. Return the
+ * number of ranges left.
+ */
+static int lock_ranges_merge(tfs_file_t* tf, size_t* offsets, size_t* counts, int* types, int num, bool align, lock_range_t* ranges) {
+    for(int i = 0; i < num; i++) {
+        ranges[i].offset = offsets[i];
+        ranges[i].count  = counts[i];
+        ranges[i].type   = types ? types[i] : LOCK_TYPE_RD;
+        if(align)
+            lock_range_align(tf->lock_block_size, &ranges[i].offset, &ranges[i].count);
+    }
+    qsort(ranges, num, sizeof(lock_range_t), lock_range_compare);
+
+    int n = 0;
+    for(int i = 0; i < num; i++) {
+        lock_range_t* last = n > 0 ? &ranges[n-1] : NULL;
+        if(last && ranges[i].offset <= last->offset + last->count) {
+            size_t end = ranges[i].offset + ranges[i].count;
+            if(end > last->offset + last->count)
+                last->count = end - last->offset;
+            if(ranges[i].type == LOCK_TYPE_WR)
+                last->type = LOCK_TYPE_WR;
+        } else {
+            ranges[n++] = ranges[i];
+        }
+    }
+    return n;
+}
+
+/**
+ * Acquire locks of many ranges, e.g., the pieces of a hyperslab,
+ * with one RPC (or as few AMs as the ranges fit in). Ranges the
+ * cache covers are not sent. Each range is granted on its own,
+ * the call returns once all of them are granted.
+ */
+int tfs_acquire_lock_many(tfs_file_t* tf, size_t* offsets, size_t* counts, int* types, int num) {
+    if(num <= 0)
+        return 0;
+
+    for(int i = 0; i < num; i++)
+        lock_block_adapt(tf, counts[i]);
+
+    lock_range_t* ranges = malloc(sizeof(lock_range_t) * num);
+    int n = lock_ranges_merge(tf, offsets, counts, types, num, true, ranges);
+
+    size_t* req_offsets = malloc(sizeof(size_t) * n);
+    size_t* req_counts  = malloc(sizeof(size_t) * n);
+    int*    req_types   = malloc(sizeof(int) * n);
+    int     missing     = 0;
+
+    uint64_t epoch = 0;
+    if(lock_cache_enabled())
+        epoch = lock_cache_validate(tf);
+
+    for(int i = 0; i < n; i++) {
+        if(lock_cache_enabled()) {
+            lock_token_t* token = lock_token_find_cover(&tf->lock_tokens, ranges[i].offset, ranges[i].count);
+            if(token && (ranges[i].type == LOCK_TYPE_RD || lock_token_type(&tf->lock_tokens, token) == LOCK_TYPE_WR))
+                continue;
+        }
+        req_offsets[missing] = ranges[i].offset;
+        req_counts[missing]  = ranges[i].count;
+        req_types[missing]   = ranges[i].type;
+        missing++;
+    }
+
+    // Do not have the locks, ask lock manager for them
+    if(missing > 0) {
+        tangram_rpc_req_t* req = tangram_issue_rpc_nb(AM_ID_ACQUIRE_LOCK_REQUEST, tf->filename, req_offsets, req_counts, req_types, missing);
+        tangram_rpc_wait(req, NULL);
+
+        // Do not cache the grants if a revocation happened in
+        // between, they may have been revoked already.
+        if(lock_cache_enabled() && tangram_delegator_epoch() == epoch) {
+            for(int i = 0; i < missing; i++) {
+                lock_cache_drop(tf, req_offsets[i], req_counts[i]);
+                lock_token_add_exact(&tf->lock_tokens, req_offsets[i], req_counts[i], req_types[i], LOCK_OWNER_NONE);
+            }
+        }
+    }
+
+    free(req_offsets);
+    free(req_counts);
+    free(req_types);
+    free(ranges);
+    return 0;
+}
+
+int tfs_acquire_lock(tfs_file_t* tf, size_t offset, size_t count, int type) {
+    return tfs_acquire_lock_many(tf, &offset, &count, &type, 1);
+}
+
 int tfs_release_lock_client() {
+    tfs_file_t *tf, *tmp;
+    HASH_ITER(hh, g_tfs_files, tf, tmp)
+        lock_token_list_destroy(&tf->lock_tokens);
+
     int* ack;
     tangram_issue_rpc(AM_ID_RELEASE_LOCK_CLIENT_REQUEST, NULL, NULL, NULL, NULL, 0, (void**)&ack);
     free(ack);
@@ -553,19 +1094,48 @@ int tfs_release_lock_client() {
 }
 
 int tfs_release_lock_file(tfs_file_t* tf) {
+    lock_token_list_destroy(&tf->lock_tokens);
+
     int* ack;
     tangram_issue_rpc(AM_ID_RELEASE_LOCK_FILE_REQUEST, tf->filename, NULL, NULL, NULL, 0, (void**)&ack);
     free(ack);
     return 0;
 }
 
-int tfs_release_lock(tfs_file_t* tf, size_t offset, size_t count) {
-    int* ack;
-    tangram_issue_rpc(AM_ID_RELEASE_LOCK_REQUEST, tf->filename, &offset, &count, NULL, 1, (void**)&ack);
-    free(ack);
+/**
+ * Release the exact byte ranges. The block size may have grown
+ * since they were acquired, aligning to it would release
+ * neighbouring ranges we still hold. Tokens keep byte ranges,
+ * so the lock manager does not need aligned ones.
+ */
+int tfs_release_lock_many(tfs_file_t* tf, size_t* offsets, size_t* counts, int num) {
+    if(num <= 0)
+        return 0;
+
+    lock_range_t* ranges = malloc(sizeof(lock_range_t) * num);
+    int n = lock_ranges_merge(tf, offsets, counts, NULL, num, false, ranges);
+
+    size_t* req_offsets = malloc(sizeof(size_t) * n);
+    size_t* req_counts  = malloc(sizeof(size_t) * n);
+    for(int i = 0; i < n; i++) {
+        req_offsets[i] = ranges[i].offset;
+        req_counts[i]  = ranges[i].count;
+        lock_cache_drop(tf, req_offsets[i], req_counts[i]);
+    }
+
+    tangram_rpc_req_t* req = tangram_issue_rpc_nb(AM_ID_RELEASE_LOCK_REQUEST, tf->filename, req_offsets, req_counts, NULL, n);
+    tangram_rpc_wait(req, NULL);
+
+    free(req_offsets);
+    free(req_counts);
+    free(ranges);
     return 0;
 }
 
+int tfs_release_lock(tfs_file_t* tf, size_t offset, size_t count) {
+    return tfs_release_lock_many(tf, &offset, &count, 1);
+}
+
 
 
 size_t tfs_fetch_pfs(const char* filename, void* buf, size_t size) {
@@ -680,16 +1250,23 @@ void* serve_rma_data_cb(void* in_arg, size_t* size) {
 
     tangram_assert(tf != NULL);
 
-    *size = in->intervals[0].count;
+    // Serve all intervals back-to-back
+    *size = 0;
+    for(int i = 0; i < in->num_intervals; i++)
+        *size += in->intervals[i].count;
     void* data = malloc(*size);
 
-    size_t req_start = in->intervals[0].offset;
-    size_t req_end = req_start + in->intervals[0].count - 1;
+    size_t pos = 0;
+    for(int i = 0; i < in->num_intervals; i++) {
+        size_t req_start = in->intervals[i].offset;
+        size_t req_end = req_start + in->intervals[i].count - 1;
 
-    tangram_debug("[tangramfs client %d]Serve rma data cb [%luKB-%luKB]\n", g_tfs_info.mpi_rank, req_start/1024, req_end/1024);
+        tangram_debug("[tangramfs client %d]Serve rma data cb [%luKB-%luKB]\n", g_tfs_info.mpi_rank, req_start/1024, req_end/1024);
 
-    ssize_t res = read_local_or_pfs(tf, data, req_start, req_end);
-    tangram_assert(res == *size);
+        ssize_t res = read_local_or_pfs(tf, data+pos, req_start, req_end);
+        tangram_assert(res == in->intervals[i].count);
+        pos += in->intervals[i].count;
+    }
 
     rpc_in_free(in);
     return data;
@@ -1,29 +1,138 @@
 #include <stdio.h>
+#include <stdint.h>
 #include <limits.h>
-#include "utlist.h"
 #include "uthash.h"
 #include "lock-token.h"
 #include "tangramfs-utils.h"
 
+// Serialized start, end and type
+#define TOKEN_HEADER_SIZE   (sizeof(int64_t)*2 + sizeof(int))
+// Serialized token: header and owner
+#define TOKEN_SIZE          (TOKEN_HEADER_SIZE + sizeof(uint32_t))
+
+static int token_compare(lock_token_t* t1, lock_token_t* t2) {
+    if(t1->start != t2->start)
+        return t1->start < t2->start ? -1 : 1;
+    // Tokens of the same start are ordered by address,
+    // so overlapping tokens (e.g. read locks) can coexist
+    if(t1 != t2)
+        return (uintptr_t)t1 < (uintptr_t)t2 ? -1 : 1;
+    return 0;
+}
+
+/**
+ * Recompute max_end from the node up to the root.
+ *
+ * tree.h only augments the node it touches, not its ancestors,
+ * so we walk up to keep max_end correct after inserts/removals.
+ */
+static void token_augment(lock_token_t* token) {
+    while(token) {
+        int64_t max_end = token->end;
+        lock_token_t* left  = RB_LEFT(token, entry);
+        lock_token_t* right = RB_RIGHT(token, entry);
+        if(left && left->max_end > max_end)
+            max_end = left->max_end;
+        if(right && right->max_end > max_end)
+            max_end = right->max_end;
+        token->max_end = max_end;
+        token = RB_PARENT(token, entry);
+    }
+}
+
+#undef  RB_AUGMENT
+#define RB_AUGMENT(x) token_augment(x)
+
+RB_PROTOTYPE_STATIC(lock_token_tree, lock_token, entry, token_compare)
+RB_GENERATE_STATIC(lock_token_tree, lock_token, entry, token_compare)
+
+static void token_insert(lock_token_list_t* token_list, lock_token_t* token) {
+    token->max_end = token->end;
+    RB_INSERT(lock_token_tree, &token_list->head, token);
+    token_augment(token);
+}
+
+static void token_remove(lock_token_list_t* token_list, lock_token_t* token) {
+    RB_REMOVE(lock_token_tree, &token_list->head, token);
+}
+
+// Return the first token that starts at or after `start`
+static lock_token_t* token_lower_bound(lock_token_list_t* token_list, int64_t start) {
+    lock_token_t* found = NULL;
+    lock_token_t* token = RB_ROOT(&token_list->head);
+    while(token) {
+        if(token->start >= start) {
+            found = token;
+            token = RB_LEFT(token, entry);
+        } else {
+            token = RB_RIGHT(token, entry);
+        }
+    }
+    return found;
+}
+
+static bool token_overlap(lock_token_t* token, int64_t start, int64_t end) {
+    return !(start > token->end || end < token->start);
+}
+
 void lock_token_free(lock_token_t* token) {
-    tangram_uct_addr_free(token->owner);
-    free(token->owner);
+    free(token->readers);
     free(token);
 }
 
+static bool token_held_by(lock_token_t* token, uint32_t holder) {
+    if(token->owner == holder)
+        return true;
+    for(int i = 0; i < token->num_readers; i++) {
+        if(token->readers[i] == holder)
+            return true;
+    }
+    return false;
+}
+
+// Return false if `holder` was the only holder
+static bool token_remove_holder(lock_token_t* token, uint32_t holder) {
+    if(token->num_readers == 0)
+        return false;
+
+    // Move the last reader into the removed slot,
+    // or promote it to owner if the owner leaves
+    uint32_t last = token->readers[--token->num_readers];
+    if(token->owner == holder) {
+        token->owner = last;
+        return true;
+    }
+    for(int i = 0; i < token->num_readers; i++) {
+        if(token->readers[i] == holder) {
+            token->readers[i] = last;
+            return true;
+        }
+    }
+    // Was the last one
+    return true;
+}
+
 lock_token_t* lock_token_find_conflict(lock_token_list_t* token_list, size_t offset, size_t count) {
-    int start = offset / LOCK_BLOCK_SIZE;
-    int end   = (offset + count - 1) / LOCK_BLOCK_SIZE;
+    int64_t start = offset;
+    int64_t end   = offset + count - 1;
 
     pthread_rwlock_rdlock(&token_list->rwlock);
 
+    // If the left subtree ends after `start` but has no overlap,
+    // its tokens start after `end`, so do all tokens to the right.
     lock_token_t* found = NULL;
-    lock_token_t* token = NULL;
-    LL_FOREACH(token_list->head, token) {
-        if(start > token->block_end || end < token->block_start) {
-            // non-overlapping
-        } else {
+    lock_token_t* token = RB_ROOT(&token_list->head);
+    while(token) {
+        lock_token_t* left = RB_LEFT(token, entry);
+        if(left && left->max_end >= start) {
+            token = left;
+        } else if(token_overlap(token, start, end)) {
             found = token;
+            break;
+        } else if(token->start > end) {
+            break;
+        } else {
+            token = RB_RIGHT(token, entry);
         }
     }
 
@@ -32,40 +141,82 @@ lock_token_t* lock_token_find_conflict(lock_token_list_t* token_list, size_t off
     return found;
 }
 
-lock_token_t* lock_token_find_cover(lock_token_list_t* token_list, size_t offset, size_t count) {
-    int start = offset / LOCK_BLOCK_SIZE;
-    int end   = (offset + count - 1) / LOCK_BLOCK_SIZE;
+static void collect_conflicts(lock_token_t* token, int64_t start, int64_t end, lock_token_t*** tokens, int* num, int* capacity) {
+    if(token == NULL || token->max_end < start)
+        return;
 
-    lock_token_t* found = NULL;
-    lock_token_t* token = NULL;
+    collect_conflicts(RB_LEFT(token, entry), start, end, tokens, num, capacity);
 
-    pthread_rwlock_rdlock(&token_list->rwlock);
+    if(token->start > end)
+        return;
 
-    LL_FOREACH(token_list->head, token) {
-        if(token->block_start <= start && token->block_end >= end) {
-            found = token;
-            break;
+    if(token_overlap(token, start, end)) {
+        if(*num == *capacity) {
+            *capacity = *capacity ? *capacity * 2 : 4;
+            *tokens = realloc(*tokens, sizeof(lock_token_t*) * (*capacity));
         }
+        (*tokens)[(*num)++] = token;
     }
 
+    collect_conflicts(RB_RIGHT(token, entry), start, end, tokens, num, capacity);
+}
+
+int lock_token_find_conflicts(lock_token_list_t* token_list, size_t offset, size_t count, lock_token_t*** tokens) {
+    int64_t start = offset;
+    int64_t end   = offset + count - 1;
+
+    int num = 0, capacity = 0;
+    *tokens = NULL;
+
+    pthread_rwlock_rdlock(&token_list->rwlock);
+    collect_conflicts(RB_ROOT(&token_list->head), start, end, tokens, &num, &capacity);
+    pthread_rwlock_unlock(&token_list->rwlock);
+
+    return num;
+}
+
+static lock_token_t* search_cover(lock_token_t* token, int64_t start, int64_t end) {
+    if(token == NULL || token->max_end < end)
+        return NULL;
+
+    lock_token_t* found = search_cover(RB_LEFT(token, entry), start, end);
+    if(found)
+        return found;
+
+    // Tokens from here on start after `start`
+    if(token->start > start)
+        return NULL;
+    if(token->end >= end)
+        return token;
+
+    return search_cover(RB_RIGHT(token, entry), start, end);
+}
+
+lock_token_t* lock_token_find_cover(lock_token_list_t* token_list, size_t offset, size_t count) {
+    int64_t start = offset;
+    int64_t end   = offset + count - 1;
+
+    pthread_rwlock_rdlock(&token_list->rwlock);
+    lock_token_t* found = search_cover(RB_ROOT(&token_list->head), start, end);
     pthread_rwlock_unlock(&token_list->rwlock);
 
     return found;
 }
 
 lock_token_t* lock_token_find_exact(lock_token_list_t* token_list, size_t offset, size_t count) {
-    int start = offset / LOCK_BLOCK_SIZE;
-    int end   = (offset + count - 1) / LOCK_BLOCK_SIZE;
+    int64_t start = offset;
+    int64_t end   = offset + count - 1;
 
     pthread_rwlock_rdlock(&token_list->rwlock);
 
     lock_token_t* found = NULL;
-    lock_token_t* token = NULL;
-    LL_FOREACH(token_list->head, token) {
-        if(start == token->block_start && end == token->block_end) {
+    lock_token_t* token = token_lower_bound(token_list, start);
+    while(token && token->start == start) {
+        if(token->end == end) {
             found = token;
             break;
         }
+        token = RB_NEXT(lock_token_tree, &token_list->head, token);
     }
 
     pthread_rwlock_unlock(&token_list->rwlock);
@@ -74,148 +225,179 @@ lock_token_t* lock_token_find_exact(lock_token_list_t* token_list, size_t offset
 }
 
 void* lock_token_serialize(lock_token_t* token, size_t *size) {
-    size_t addr_size;
-    void* addr_buf = tangram_uct_addr_serialize(token->owner, &addr_size);
-
-    *size = sizeof(int) * 3 + sizeof(size_t) + addr_size ;
+    *size = TOKEN_SIZE;
     void* buf = malloc(*size);
-    memcpy(buf, &token->block_start, sizeof(int));
-    memcpy(buf+sizeof(int), &token->block_end, sizeof(int));
-    memcpy(buf+2*sizeof(int), &token->type, sizeof(int));
-    memcpy(buf+3*sizeof(int), &addr_size, sizeof(size_t));
-
-    // It is possible token->owner is TANGRAM_UCT_ADDR_IGNORE (which is just null)
-    if(addr_size > 0)
-        memcpy(buf+3*sizeof(int)+sizeof(size_t), addr_buf, addr_size);
-
+    memcpy(buf, &token->start, sizeof(int64_t));
+    memcpy(buf+sizeof(int64_t), &token->end, sizeof(int64_t));
+    memcpy(buf+2*sizeof(int64_t), &token->type, sizeof(int));
+    memcpy(buf+TOKEN_HEADER_SIZE, &token->owner, sizeof(uint32_t));
     return buf;
 }
 
 lock_token_t* lock_token_deserialize(void* buf, size_t* size) {
     lock_token_t* token = malloc(sizeof(lock_token_t));
 
-    memcpy(&token->block_start, buf, sizeof(int));
-    memcpy(&token->block_end, buf+sizeof(int), sizeof(int));
-    memcpy(&token->type, buf+sizeof(int)*2, sizeof(int));
-
-    size_t addr_size;
-    memcpy(&addr_size, buf+sizeof(int)*3, sizeof(size_t));
-    if(addr_size > 0) {
-        token->owner = malloc(sizeof(tangram_uct_addr_t));
-        tangram_uct_addr_deserialize(buf+sizeof(int)*3+sizeof(size_t), token->owner);
-    }
+    memcpy(&token->start, buf, sizeof(int64_t));
+    memcpy(&token->end, buf+sizeof(int64_t), sizeof(int64_t));
+    memcpy(&token->type, buf+sizeof(int64_t)*2, sizeof(int));
+    memcpy(&token->owner, buf+TOKEN_HEADER_SIZE, sizeof(uint32_t));
+    token->num_readers = 0;
+    token->readers     = NULL;
 
-    *size = sizeof(int)*3 + sizeof(size_t) + addr_size;
+    *size = TOKEN_SIZE;
     return token;
 }
-lock_token_t* lock_token_create(int start, int end, int type, tangram_uct_addr_t* owner) {
+lock_token_t* lock_token_create(int64_t start, int64_t end, int type, uint32_t owner) {
     lock_token_t* token = malloc(sizeof(lock_token_t));
-    token->block_start = start;
-    token->block_end   = end;
+    token->start = start;
+    token->end   = end;
     token->type        = type;
-    token->owner       = tangram_uct_addr_duplicate(owner);
+    token->owner       = owner;
+    token->num_readers = 0;
+    token->readers     = NULL;
     return token;
 }
 
 lock_token_t* lock_token_add_direct(lock_token_list_t* token_list, lock_token_t* token) {
     pthread_rwlock_wrlock(&token_list->rwlock);
-    LL_APPEND(token_list->head, token);
+    token_insert(token_list, token);
     pthread_rwlock_unlock(&token_list->rwlock);
     return token;
 }
 
-lock_token_t* lock_token_add_exact(lock_token_list_t* token_list, size_t offset, size_t count, int type, tangram_uct_addr_t* owner) {
-    lock_token_t* token = lock_token_create(offset/LOCK_BLOCK_SIZE, (offset+count-1)/LOCK_BLOCK_SIZE, type, owner);
+lock_token_t* lock_token_add_exact(lock_token_list_t* token_list, size_t offset, size_t count, int type, uint32_t owner) {
+    lock_token_t* token = lock_token_create(offset, offset+count-1, type, owner);
     lock_token_add_direct(token_list, token);
     return token;
 }
 
-lock_token_t* lock_token_add_extend(lock_token_list_t* token_list, size_t offset, size_t count, int type, tangram_uct_addr_t* owner) {
-    lock_token_t* token = lock_token_create(offset/LOCK_BLOCK_SIZE, (offset+count-1)/LOCK_BLOCK_SIZE, type, owner);
-    int extend_start = 0;
-    int extend_end   = INT_MAX;
+lock_token_t* lock_token_add_extend(lock_token_list_t* token_list, size_t offset, size_t count, int type, uint32_t owner, size_t max_extend) {
+    lock_token_t* token = lock_token_create(offset, offset+count-1, type, owner);
+    int64_t extend_start = 0;
+    int64_t extend_end   = INT64_MAX;
 
     pthread_rwlock_wrlock(&token_list->rwlock);
-    lock_token_t* tmp;
-
-    int algo = 1;
-
-    // Algorithm 1: Extend to the farest possible start and end block
-    if(algo == 1) {
-        LL_FOREACH(token_list->head, tmp) {
-            if( (tmp->block_start > token->block_end) && (tmp->block_start-1 < extend_end ) ) {
-                extend_end   = tmp->block_start - 1;
-            }
-            if( (tmp->block_end < token->block_start) && (tmp->block_end+1 > extend_start) ) {
-                extend_start = tmp->block_end + 1;
-            }
-        }
-    }
 
-    // Algorithm 2: Extend to infinity or do not extend at all
-    if(algo == 2) {
-        LL_FOREACH(token_list->head, tmp) {
-            if( tmp->block_start > token->block_end) {
-                extend_end = token->block_end;
-                break;
-            }
+    // The first token after the requested range
+    lock_token_t* next = token_lower_bound(token_list, token->end+1);
+
+    // Extend to the farest possible start and end
+    //
+    // The caller has made sure no token overlaps the requested
+    // range, so tokens that start before it also end before it.
+    // The closest end is the max end among them.
+    if(next)
+        extend_end = next->start - 1;
+
+    int64_t prev_end = -1;
+    lock_token_t* tmp = RB_ROOT(&token_list->head);
+    while(tmp) {
+        if(tmp->start < token->start) {
+            lock_token_t* left = RB_LEFT(tmp, entry);
+            if(tmp->end > prev_end)
+                prev_end = tmp->end;
+            if(left && left->max_end > prev_end)
+                prev_end = left->max_end;
+            tmp = RB_RIGHT(tmp, entry);
+        } else {
+            tmp = RB_LEFT(tmp, entry);
         }
     }
+    if(prev_end >= 0 && prev_end < token->start)
+        extend_start = prev_end + 1;
+
+    // Do not go further than max_extend bytes on either side
+    if(max_extend != LOCK_EXTEND_UNBOUNDED) {
+        if(token->start - extend_start > (int64_t)max_extend)
+            extend_start = token->start - max_extend;
+        if(extend_end - token->end > (int64_t)max_extend)
+            extend_end = token->end + max_extend;
+    }
 
-    token->block_start = extend_start;
-    token->block_end   = extend_end;
-    LL_APPEND(token_list->head, token);
+    token->start = extend_start;
+    token->end   = extend_end;
+    token_insert(token_list, token);
     pthread_rwlock_unlock(&token_list->rwlock);
 
     return token;
 }
 
 
-lock_token_t* lock_token_add_from_buf(lock_token_list_t* token_list, void* buf, tangram_uct_addr_t* owner) {
+lock_token_t* lock_token_add_from_buf(lock_token_list_t* token_list, void* buf, uint32_t owner) {
     lock_token_t* token = malloc(sizeof(lock_token_t));
-    memcpy(&token->block_start, buf, sizeof(int));
-    memcpy(&token->block_end, buf+sizeof(int), sizeof(int));
-    memcpy(&token->type, buf+sizeof(int)+sizeof(int), sizeof(int));
-    token->owner = tangram_uct_addr_duplicate(owner);;
+    memcpy(&token->start, buf, sizeof(int64_t));
+    memcpy(&token->end, buf+sizeof(int64_t), sizeof(int64_t));
+    memcpy(&token->type, buf+sizeof(int64_t)*2, sizeof(int));
+    token->owner = owner;
+    token->num_readers = 0;
+    token->readers     = NULL;
     pthread_rwlock_wrlock(&token_list->rwlock);
-    LL_APPEND(token_list->head, token);
+    token_insert(token_list, token);
     pthread_rwlock_unlock(&token_list->rwlock);
     return token;
 }
 
 void lock_token_delete(lock_token_list_t* token_list, lock_token_t* token) {
     pthread_rwlock_wrlock(&token_list->rwlock);
-    LL_DELETE(token_list->head, token);
+    token_remove(token_list, token);
     lock_token_free(token);
     pthread_rwlock_unlock(&token_list->rwlock);
 }
 
-void lock_token_delete_client(lock_token_list_t* token_list, tangram_uct_addr_t* client) {
+void lock_token_delete_client(lock_token_list_t* token_list, uint32_t client) {
     pthread_rwlock_wrlock(&token_list->rwlock);
     lock_token_t *token, *tmp;
-    LL_FOREACH_SAFE(token_list->head, token, tmp) {
-        if(0 == tangram_uct_addr_compare(token->owner, client)) {
-            LL_DELETE(token_list->head, token);
+    RB_FOREACH_SAFE(token, lock_token_tree, &token_list->head, tmp) {
+        if(token_held_by(token, client) && !token_remove_holder(token, client)) {
+            token_remove(token_list, token);
             lock_token_free(token);
         }
     }
     pthread_rwlock_unlock(&token_list->rwlock);
 }
 
+bool lock_token_held_by(lock_token_list_t* token_list, lock_token_t* token, uint32_t holder) {
+    pthread_rwlock_rdlock(&token_list->rwlock);
+    bool held = token_held_by(token, holder);
+    pthread_rwlock_unlock(&token_list->rwlock);
+    return held;
+}
+
+int lock_token_num_holders(lock_token_list_t* token_list, lock_token_t* token) {
+    pthread_rwlock_rdlock(&token_list->rwlock);
+    int num = token->num_readers + 1;
+    pthread_rwlock_unlock(&token_list->rwlock);
+    return num;
+}
+
+void lock_token_add_reader(lock_token_list_t* token_list, lock_token_t* token, uint32_t reader) {
+    pthread_rwlock_wrlock(&token_list->rwlock);
+    if(!token_held_by(token, reader)) {
+        token->readers = realloc(token->readers, sizeof(uint32_t) * (token->num_readers+1));
+        token->readers[token->num_readers++] = reader;
+    }
+    pthread_rwlock_unlock(&token_list->rwlock);
+}
+
+void lock_token_remove_holder(lock_token_list_t* token_list, lock_token_t* token, uint32_t holder) {
+    pthread_rwlock_wrlock(&token_list->rwlock);
+    token_remove_holder(token, holder);
+    pthread_rwlock_unlock(&token_list->rwlock);
+}
+
 
 void lock_token_list_init(lock_token_list_t* token_list) {
-    token_list->head = NULL;
+    RB_INIT(&token_list->head);
     pthread_rwlock_init(&token_list->rwlock, NULL);
 }
 
 void lock_token_list_destroy(lock_token_list_t* token_list) {
     pthread_rwlock_wrlock(&token_list->rwlock);
     lock_token_t *token, *tmp;
-    LL_FOREACH_SAFE(token_list->head, token, tmp) {
-        LL_DELETE(token_list->head, token);
+    RB_FOREACH_SAFE(token, lock_token_tree, &token_list->head, tmp) {
+        token_remove(token_list, token);
         lock_token_free(token);
     }
-    token_list->head = NULL;
     pthread_rwlock_unlock(&token_list->rwlock);
 }
 
@@ -225,25 +407,28 @@ void lock_token_update_type(lock_token_list_t* token_list, lock_token_t* token,
     pthread_rwlock_unlock(&token_list->rwlock);
 }
 
-int lock_token_update_range(lock_token_list_t* token_list, lock_token_t* token, int start, int end) {
+int lock_token_update_range(lock_token_list_t* token_list, lock_token_t* token, int64_t start, int64_t end) {
+    // Re-insert as the key and max_end change
     pthread_rwlock_wrlock(&token_list->rwlock);
-    token->block_start = start;
-    token->block_end   = end;
+    token_remove(token_list, token);
+    token->start = start;
+    token->end   = end;
+    token_insert(token_list, token);
     pthread_rwlock_unlock(&token_list->rwlock);
 }
 
-int lock_token_start(lock_token_list_t* token_list, lock_token_t* token) {
-    int start;
+int64_t lock_token_start(lock_token_list_t* token_list, lock_token_t* token) {
+    int64_t start;
     pthread_rwlock_rdlock(&token_list->rwlock);
-    start = token->block_start;
+    start = token->start;
     pthread_rwlock_unlock(&token_list->rwlock);
     return start;
 }
 
-int lock_token_end(lock_token_list_t* token_list, lock_token_t* token) {
-    int end;
+int64_t lock_token_end(lock_token_list_t* token_list, lock_token_t* token) {
+    int64_t end;
     pthread_rwlock_rdlock(&token_list->rwlock);
-    end = token->block_end;
+    end = token->end;
     pthread_rwlock_unlock(&token_list->rwlock);
     return end;
 }
@@ -256,11 +441,17 @@ int lock_token_type(lock_token_list_t* token_list, lock_token_t* token) {
     return type;
 }
 
-tangram_uct_addr_t* lock_token_owner(lock_token_list_t* token_list, lock_token_t* token) {
-    tangram_uct_addr_t* owner;
+uint32_t lock_token_owner(lock_token_list_t* token_list, lock_token_t* token) {
+    uint32_t owner;
     pthread_rwlock_rdlock(&token_list->rwlock);
     owner = token->owner;
     pthread_rwlock_unlock(&token_list->rwlock);
     return owner;
 }
 
+void lock_range_align(size_t block_size, size_t* offset, size_t* count) {
+    size_t start = *offset / block_size * block_size;
+    size_t end   = (*offset + *count + block_size - 1) / block_size * block_size;
+    *offset = start;
+    *count  = end - start;
+}
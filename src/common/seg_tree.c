@@ -72,7 +72,7 @@ void seg_tree_destroy(struct seg_tree* seg_tree)
 /* Allocate a node for the range tree. Free node with seg_tree_node_free() when finished */
 static struct seg_tree_node*
 seg_tree_node_alloc(unsigned long start, unsigned long end, unsigned long ptr,
-                    tangram_uct_addr_t* owner, bool posted)
+                    uint32_t owner, bool posted, bool dirty)
 {
     struct seg_tree_node* node;
     node = calloc(1, sizeof(*node));
@@ -80,14 +80,14 @@ seg_tree_node_alloc(unsigned long start, unsigned long end, unsigned long ptr,
     node->start  = start;
     node->end    = end;
     node->ptr    = ptr;
-    node->owner  = tangram_uct_addr_duplicate(owner);
+    node->owner  = owner;
     node->posted = posted;
+    node->dirty  = dirty;
 
     return node;
 }
 
 void seg_tree_node_free(struct seg_tree_node* node) {
-    tangram_uct_addr_free(node->owner);
     free(node);
 }
 
@@ -150,7 +150,7 @@ static int get_non_overlapping_range(
  */
 int seg_tree_add(struct seg_tree* seg_tree,
                  unsigned long start, unsigned long end, unsigned long ptr,
-                 tangram_uct_addr_t* owner, bool posted)
+                 uint32_t owner, bool posted)
 {
     /* Assume we'll succeed */
     int rc = 0;
@@ -163,8 +163,8 @@ int seg_tree_add(struct seg_tree* seg_tree,
     long new_end;
     int ret;
 
-    /* Create our range */
-    node = seg_tree_node_alloc(start, end, ptr, owner, posted);
+    /* Create our range, newly added data is not on PFS yet */
+    node = seg_tree_node_alloc(start, end, ptr, owner, posted, true);
     if (!node) {
         return ENOMEM;
     }
@@ -206,7 +206,7 @@ int seg_tree_add(struct seg_tree* seg_tree,
              * on the next pass of this while() loop.
              */
             resized = seg_tree_node_alloc(new_start, new_end,
-                overlap->ptr+(new_start-overlap->start), overlap->owner, overlap->posted);
+                overlap->ptr+(new_start-overlap->start), overlap->owner, overlap->posted, overlap->dirty);
 
             /*
              * If the non-overlapping part came from the front portion of the
@@ -221,7 +221,7 @@ int seg_tree_add(struct seg_tree* seg_tree,
                  * part.  Add it in.
                  */
                 remaining = seg_tree_node_alloc(resized->end + 1, overlap->end,
-                    overlap->ptr+(resized->end+1-overlap->start), overlap->owner, overlap->posted);
+                    overlap->ptr+(resized->end+1-overlap->start), overlap->owner, overlap->posted, overlap->dirty);
             }
 
             /* Remove our old range */
@@ -273,6 +273,31 @@ bool seg_tree_posted_nolock(struct seg_tree* seg_tree, struct seg_tree_node* nod
     return node->posted;
 }
 
+void seg_tree_set_clean_nolock(struct seg_tree* seg_tree, struct seg_tree_node* node) {
+    node->dirty = false;
+}
+
+bool seg_tree_dirty_nolock(struct seg_tree* seg_tree, struct seg_tree_node* node) {
+    return node->dirty;
+}
+
+void seg_tree_set_dirty(struct seg_tree* seg_tree, unsigned long start, unsigned long ptr, unsigned long count) {
+    unsigned long end = start + count - 1;
+
+    seg_tree_wrlock(seg_tree);
+    struct seg_tree_node *node = NULL;
+    while ((node = seg_tree_iter(seg_tree, node))) {
+        if(node->start > end)
+            break;
+        if(node->end < start)
+            continue;
+        // Same data only if the offsets map the same way
+        if(node->ptr - node->start == ptr - start)
+            node->dirty = true;
+    }
+    seg_tree_unlock(seg_tree);
+}
+
 
 
 /*
@@ -286,7 +311,8 @@ int seg_tree_coalesce_prev_nolock(struct seg_tree* seg_tree,
 
     if ((prev != NULL) && ((prev->end + 1) == target->start) &&
         (prev->posted == target->posted) && (target->posted) &&
-        (tangram_uct_addr_compare(prev->owner, target->owner) == 0)) {
+        (prev->dirty == target->dirty) &&
+        (prev->owner == target->owner)) {
         /*
          * We found a extent that ends just before the new extent starts.
          * Check whether they are also contiguous in the log.
@@ -325,7 +351,8 @@ int seg_tree_coalesce_next_nolock(struct seg_tree* seg_tree,
 
     if ((next != NULL) && ((target->end + 1) == next->start) &&
             (next->posted == target->posted) && (target->posted) &&
-            (tangram_uct_addr_compare(next->owner, target->owner) == 0)) {
+        (next->dirty == target->dirty) &&
+            (next->owner == target->owner)) {
         /*
          * We found a extent that starts just after the new extent ends.
          * Check whether they are also contiguous in the log.
@@ -357,7 +384,8 @@ int seg_tree_coalesce_next_nolock(struct seg_tree* seg_tree,
  * 1. they are adjacent
  * 2. their local file offset are contiguous
  * 3. both are posted     (only for client)
- * 4. have the same owner (only for server)
+ * 4. both are dirty or both are clean (only for client)
+ * 5. have the same owner (only for server)
  *
  * Note: do not use this call inside a seg_tree_iter() loop,
  * because this function calls RB_PREV.
@@ -456,7 +484,7 @@ int seg_tree_remove(
                 unsigned long a_end = node->end;
                 unsigned long a_start = end + 1;
                 unsigned long a_ptr = node->ptr + (a_start - node->start);
-                tangram_uct_addr_t* a_owner = node->owner;
+                uint32_t a_owner = node->owner;
                 bool a_posted = node->posted;
 
                 /* truncate existing (before) node */
@@ -492,7 +520,7 @@ struct seg_tree_node* seg_tree_find_nolock(
     unsigned long end)
 {
     /* Create a range of just our starting byte offset */
-    struct seg_tree_node* node = seg_tree_node_alloc(start, start, 0, TANGRAM_UCT_ADDR_IGNORE, false);
+    struct seg_tree_node* node = seg_tree_node_alloc(start, start, 0, 0, false, false);
 
     /* Search tree for either a range that overlaps with
      * the target range (starting byte), or otherwise the
@@ -684,7 +712,7 @@ void seg_tree_clear(struct seg_tree* seg_tree)
 /*
  * Remove all nodes in seg_tree that belong to the given client
  */
-void seg_tree_clear_client(struct seg_tree* seg_tree, tangram_uct_addr_t* client)
+void seg_tree_clear_client(struct seg_tree* seg_tree, uint32_t client)
 {
     struct seg_tree_node* node = NULL;
     struct seg_tree_node* oldnode = NULL;
@@ -702,7 +730,7 @@ void seg_tree_clear_client(struct seg_tree* seg_tree, tangram_uct_addr_t* client
     unsigned long new_max = 0;
     while ((node = seg_tree_iter(seg_tree, node))) {
         if (oldnode) {
-            if(tangram_uct_addr_compare(oldnode->owner, client) == 0) {
+            if(oldnode->owner == client) {
                 //printf("remove [%ld-%ld]\n", oldnode->start, oldnode->end);
                 RB_REMOVE(inttree, &seg_tree->head, oldnode);
                 seg_tree_node_free(oldnode);
@@ -714,7 +742,7 @@ void seg_tree_clear_client(struct seg_tree* seg_tree, tangram_uct_addr_t* client
         oldnode = node;
     }
     if (oldnode) {
-        if(tangram_uct_addr_compare(oldnode->owner, client) == 0) {
+        if(oldnode->owner == client) {
             RB_REMOVE(inttree, &seg_tree->head, oldnode);
             seg_tree_node_free(oldnode);
         } else {
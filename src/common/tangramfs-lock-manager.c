@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <pthread.h>
 #include "utlist.h"
 #include "uthash.h"
 #include "lock-token.h"
@@ -8,63 +9,71 @@
 #include "tangramfs-ucx-server.h"
 #include "tangramfs-ucx-delegator.h"
 
-void* lock_acquire_result_serialize(lock_acquire_result_t* res, size_t* len) {
-
-    *len = sizeof(int);
-    void* buf;
+// Number of grants between two policy decisions of a file
+#define LOCK_POLICY_WINDOW          64
+// Bounded extension grows a token up to this many times the request
+#define LOCK_BOUNDED_EXTEND         16
+// Conflict/split rates (in percent) below LOW move the policy
+// towards extend, above HIGH towards exact
+#define LOCK_POLICY_LOW             5
+#define LOCK_POLICY_HIGH            25
 
-    if(res->result == LOCK_ACQUIRE_SUCCESS) {
-        size_t token_len;
-        void* token_buf = lock_token_serialize(res->token, &token_len);
+void* lock_acquire_result_serialize(lock_acquire_result_t* res, size_t* len) {
 
-        *len += token_len;
-        buf = malloc(*len);
+    void** token_bufs = malloc(sizeof(void*) * res->num_tokens);
+    size_t* token_lens = malloc(sizeof(size_t) * res->num_tokens);
 
-        memcpy(buf, &res->result, sizeof(int));
-        memcpy(buf+sizeof(int), token_buf, token_len);
-        free(token_buf);
+    *len = sizeof(int) * 2;
+    for(int i = 0; i < res->num_tokens; i++) {
+        // The owner is the requestor, no need to send it
+        lock_token_t token = *res->tokens[i];
+        token.owner = LOCK_OWNER_NONE;
+        token_bufs[i] = lock_token_serialize(&token, &token_lens[i]);
+        *len += token_lens[i];
     }
-    if(res->result == LOCK_ACQUIRE_CONFLICT) {
-        size_t owner_len;
-        void* owner_buf =  tangram_uct_addr_serialize(res->owner, &owner_len);
 
-        *len += owner_len;
-        buf = malloc(*len);
+    void* buf = malloc(*len);
+    memcpy(buf, &res->result, sizeof(int));
+    memcpy(buf+sizeof(int), &res->num_tokens, sizeof(int));
 
-        memcpy(buf, &res->result, sizeof(int));
-        memcpy(buf+sizeof(int), owner_buf, owner_len);
-        free(owner_buf);
+    size_t pos = sizeof(int) * 2;
+    for(int i = 0; i < res->num_tokens; i++) {
+        memcpy(buf+pos, token_bufs[i], token_lens[i]);
+        pos += token_lens[i];
+        free(token_bufs[i]);
     }
+    free(token_bufs);
+    free(token_lens);
 
     return buf;
 }
 
 lock_acquire_result_t* lock_acquire_result_deserialize(void* buf) {
     lock_acquire_result_t* res = malloc(sizeof(lock_acquire_result_t));
-    res->token = NULL;
-    res->owner = NULL;
-
     memcpy(&res->result, buf, sizeof(int));
+    memcpy(&res->num_tokens, buf+sizeof(int), sizeof(int));
+    res->tokens = malloc(sizeof(lock_token_t*) * res->num_tokens);
 
-    if(res->result == LOCK_ACQUIRE_SUCCESS) {
+    size_t pos = sizeof(int) * 2;
+    for(int i = 0; i < res->num_tokens; i++) {
         size_t token_buf_size;
-        res->token = lock_token_deserialize(buf+sizeof(int), &token_buf_size);
-    }
-
-    if(res->result == LOCK_ACQUIRE_CONFLICT) {
-        res->owner = malloc(sizeof(tangram_uct_addr_t));
-        tangram_uct_addr_deserialize(buf+sizeof(int), res->owner);
+        res->tokens[i] = lock_token_deserialize(buf+pos, &token_buf_size);
+        pos += token_buf_size;
     }
     return res;
 }
 
-void split_lock(lock_token_list_t* token_list, lock_token_t* conflict_token, size_t offset, size_t count, bool server) {
+void lock_acquire_result_free(lock_acquire_result_t* res) {
+    free(res->tokens);
+    free(res);
+}
 
-    int conflict_start = lock_token_start(token_list, conflict_token);
-    int conflict_end   = lock_token_end(token_list, conflict_token);
+// Compute what is left of the conflict token after relinquishing
+// [offset, offset+count). Return false if nothing is left.
+static bool split_range(int64_t conflict_start, int64_t conflict_end, size_t offset, size_t count, int64_t* new_start, int64_t* new_end) {
 
-    int start = offset / LOCK_BLOCK_SIZE;
-    int end   = (offset+count-1) / LOCK_BLOCK_SIZE;
+    int64_t start = offset;
+    int64_t end   = offset + count - 1;
 
     /**
      * Case 1: start >= conflict_start
@@ -78,224 +87,770 @@ void split_lock(lock_token_list_t* token_list, lock_token_t* conflict_token, siz
      * relinquish [conflict_start, end]
      *
      */
-    int new_start, new_end;
 
     // Case 1, shink the end
     if(start >= conflict_start) {
-        //printf("Case 1, server: %d, conflict: [%d-%d], ask: [%d-%d]\n", server, conflict_start, conflict_end, start, end);
-        new_start = conflict_start;
-        new_end   = start - 1;
+        *new_start = conflict_start;
+        *new_end   = start - 1;
     }
     // Case 2
     else {
-        //printf("Case 2, server: %d, conflict: [%d-%d], ask: [%d-%d]\n", server, conflict_start, conflict_end, start, end);
-        new_start = end + 1;
-        new_end   = conflict_end;
+        *new_start = end + 1;
+        *new_end   = conflict_end;
     }
 
-    if(new_start < new_end)
+    return *new_start <= *new_end;
+}
+
+void split_lock(lock_token_list_t* token_list, lock_token_t* conflict_token, size_t offset, size_t count, bool server) {
+
+    int64_t conflict_start = lock_token_start(token_list, conflict_token);
+    int64_t conflict_end   = lock_token_end(token_list, conflict_token);
+
+    int64_t new_start, new_end;
+    if(split_range(conflict_start, conflict_end, offset, count, &new_start, &new_end))
         lock_token_update_range(token_list, conflict_token, new_start, new_end);
     else
         lock_token_delete(token_list, conflict_token);
 }
 
 
-lock_token_t* tangram_lockmgr_delegator_acquire_lock(lock_table_t** lt, tangram_uct_addr_t* client, char* filename, size_t offset, size_t count, int type) {
+/**
+ * A process has a single lock table, either the server's or the
+ * delegator's. This rwlock only protects the hash table itself.
+ * Entries are never removed before finalize, so an entry stays
+ * valid after it is released, and entry->lock protects the rest.
+ *
+ * Lock order: g_lt_lock before entry->lock.
+ */
+static pthread_rwlock_t g_lt_lock = PTHREAD_RWLOCK_INITIALIZER;
 
+static lock_table_t* lock_table_find(lock_table_t* lt, char* filename) {
     lock_table_t* entry = NULL;
-    HASH_FIND_STR(*lt, filename, entry);
+    pthread_rwlock_rdlock(&g_lt_lock);
+    HASH_FIND_STR(lt, filename, entry);
+    pthread_rwlock_unlock(&g_lt_lock);
+    return entry;
+}
 
+static lock_table_t* lock_table_find_or_create(lock_table_t** lt, char* filename) {
+    lock_table_t* entry = lock_table_find(*lt, filename);
+    if(entry)
+        return entry;
+
+    // Someone may have created it after we looked
+    pthread_rwlock_wrlock(&g_lt_lock);
+    HASH_FIND_STR(*lt, filename, entry);
     if(!entry) {
         entry = malloc(sizeof(lock_table_t));
+        pthread_mutex_init(&entry->lock, NULL);
         lock_token_list_init(&entry->token_list);
+        entry->waiters   = NULL;
+        entry->runnable  = NULL;
+        entry->acquiring = 0;
+        entry->revoked   = NULL;
+        entry->lock_algo = TANGRAM_LOCK_ALGO_EXACT;
+        entry->policy    = TANGRAM_LOCK_ALGO_BOUNDED;
+        entry->callback  = false;
+        memset(&entry->stats, 0, sizeof(lock_stats_t));
         strcpy(entry->filename, filename);
         HASH_ADD_STR(*lt, filename, entry);
     }
+    pthread_rwlock_unlock(&g_lt_lock);
+    return entry;
+}
 
-    lock_token_t* token;
-
-    // already hold the lock - 2 cases
-    // TODO, need to compare client owner
-    token = lock_token_find_cover(&entry->token_list, offset, count);
-    if(token) {
-        // Case 1:
-        // Had the read lock but ask for a write lock
-        // Delete my lock token locally and
-        // ask the server to upgrade my lock
-        // use the same AM_ID_ACQUIRE_LOCK_REQUEST RPC
-        if(lock_token_type(&entry->token_list, token) != type && type == LOCK_TYPE_WR) {
-            lock_token_delete(&entry->token_list, token);
-        } else {
-        // Case 2:
-        // Had the write lock alraedy, nothing to do.
-            return token;
+void tangram_lockmgr_delegator_acquire_lock(lock_table_t** lt, uint32_t client, char* filename, interval_t* intervals, int num, void (*upgrade_cb)()) {
+
+    lock_table_t* entry = lock_table_find_or_create(lt, filename);
+
+    size_t* offsets = malloc(sizeof(size_t) * num);
+    size_t* counts  = malloc(sizeof(size_t) * num);
+    int*    types   = malloc(sizeof(int) * num);
+    int     missing = 0;
+    bool    upgrade = false;
+
+    pthread_mutex_lock(&entry->lock);
+
+    for(int i = 0; i < num; i++) {
+        // already hold the lock - 2 cases
+        // TODO, need to compare client owner
+        lock_token_t* token = lock_token_find_cover(&entry->token_list, intervals[i].offset, intervals[i].count);
+        if(token) {
+            // Case 1:
+            // Had the read lock but ask for a write lock
+            // Delete my lock token locally and
+            // ask the server to upgrade my lock
+            // use the same AM_ID_ACQUIRE_LOCK_REQUEST RPC
+            if(lock_token_type(&entry->token_list, token) != intervals[i].type && intervals[i].type == LOCK_TYPE_WR) {
+                if(!upgrade && upgrade_cb)
+                    upgrade_cb();
+                upgrade = true;
+                lock_token_delete(&entry->token_list, token);
+            } else {
+            // Case 2:
+            // Had the write lock alraedy, nothing to do.
+                continue;
+            }
         }
+
+        offsets[missing] = intervals[i].offset;
+        counts[missing]  = intervals[i].count;
+        types[missing]   = intervals[i].type;
+        missing++;
     }
 
-    // Do not have the lock, ask server for it
-    void* out;
-    size_t in_size;
-    void* in = rpc_in_pack(filename, 1, &offset, &count, &type, &in_size);
-    tangram_ucx_delegator_sendrecv_server(AM_ID_ACQUIRE_LOCK_REQUEST, in, in_size, &out);
+    // Not held while waiting for the server, the server may
+    // revoke tokens of this file from us in the meantime.
+    if(missing > 0)
+        entry->acquiring++;
+    pthread_mutex_unlock(&entry->lock);
+
+    // Do not have the locks, ask server for all of them at once.
+    // The server revokes conflicting tokens from their
+    // holders and always grants the locks in its respond.
+    if(missing > 0) {
+        void* out;
+        size_t in_size;
+        void* in = rpc_in_pack(filename, missing, offsets, counts, types, NULL, &in_size);
+        tangram_ucx_delegator_sendrecv_server(AM_ID_ACQUIRE_LOCK_REQUEST, in, in_size, &out);
 
-    lock_acquire_result_t* res = lock_acquire_result_deserialize(out);
+        lock_acquire_result_t* res = lock_acquire_result_deserialize(out);
+        tangram_assert(res->result == LOCK_ACQUIRE_SUCCESS && res->num_tokens == missing);
+        pthread_mutex_lock(&entry->lock);
+        for(int i = 0; i < res->num_tokens; i++) {
+            res->tokens[i]->owner = client;
+            lock_token_add_direct(&entry->token_list, res->tokens[i]);
+        }
 
-    while(res->result == LOCK_ACQUIRE_CONFLICT) {
-        // 1. Ask the conflict token onwer to split and release the conflicting range
-        void* ack;
-        tangram_ucx_delegator_sendrecv_delegator(AM_ID_SPLIT_LOCK_REQUEST, res->owner, in, in_size, &ack);
-        free(ack);
+        // A revocation may have overtaken our grant, it was acked
+        // with nothing to drop, but the server has taken the range
+        // away from us. Apply it now. A revocation older than the
+        // grant may drop too much, we then just ask again later.
+        lock_range_t *range, *tmp;
+        DL_FOREACH(entry->revoked, range) {
+            lock_token_t* token;
+            while((token = lock_token_find_conflict(&entry->token_list, range->offset, range->count)) != NULL)
+                split_lock(&entry->token_list, token, range->offset, range->count, false);
+        }
+        if(--entry->acquiring == 0) {
+            DL_FOREACH_SAFE(entry->revoked, range, tmp) {
+                DL_DELETE(entry->revoked, range);
+                free(range);
+            }
+        }
+        pthread_mutex_unlock(&entry->lock);
 
-        // 2. Once the conflict owner release its token, we can acquire it
-        // from the server again
+        lock_acquire_result_free(res);
+        free(in);
         free(out);
-        tangram_ucx_delegator_sendrecv_server(AM_ID_ACQUIRE_LOCK_REQUEST, in, in_size, &out);
+    }
 
-        // 3. Check if we were indeed granted the token
-        // Reason for while() loop due to a very rare
-        // case, where before we complete the whole process
-        // of handling the conflict, someone else acquired the same
-        // lock token before us.
-        // i.e.,
-        // the conflict owner released its token,
-        // then someone acquired the same token before us.
-        tangram_uct_addr_free(res->owner);
-        free(res->owner);
-        free(res);
-        res = lock_acquire_result_deserialize(out);
-    }
-
-    // Exit while loop indicates the token was successfully granted
-    tangram_assert(res->result == LOCK_ACQUIRE_SUCCESS);
-    lock_token_add_direct(&entry->token_list, res->token);
-
-    // only free res, res->owner should be NULL, res->token will be returned;
-    token = res->token;
-    free(res);
-    free(in);
-    free(out);
-    return token;
+    free(offsets);
+    free(counts);
+    free(types);
 }
 
 
-// Someone tries to request a lock that conflicts with ours
-// so we are asked to split our lock.
-void tangram_lockmgr_delegator_split_lock(lock_table_t* lt, char* filename, size_t offset, size_t count, int type) {
-    lock_table_t* entry = NULL;
-    HASH_FIND_STR(lt, filename, entry);
+// The server revokes [offset, offset+count) from us, as
+// someone asks for a conflicting lock. Release every token
+// of ours that overlaps it. The server does the same on its
+// side, so we do not need to notify it.
+//
+// Grants and revocations are handled by different workers, so
+// a revocation can run before the grant it follows is added.
+// Waiting for the grant could deadlock, as our acquire may be
+// waiting for a revocation another delegator is blocked in.
+// Instead, keep the range, and the acquire applies it.
+void tangram_lockmgr_delegator_revoke_lock(lock_table_t* lt, char* filename, size_t offset, size_t count) {
+    lock_table_t* entry = lock_table_find(lt, filename);
     if(!entry) return;
 
+    pthread_mutex_lock(&entry->lock);
     lock_token_t* token;
-    token = lock_token_find_conflict(&entry->token_list, offset, count);
-
-    if(token != NULL) {
+    while((token = lock_token_find_conflict(&entry->token_list, offset, count)) != NULL)
         split_lock(&entry->token_list, token, offset, count, false);
-    } else {
-        printf("CHEN Ask me to split lock, but no conflict found!\n");
+
+    if(entry->acquiring > 0) {
+        lock_range_t* range = malloc(sizeof(lock_range_t));
+        range->offset = offset;
+        range->count  = count;
+        DL_APPEND(entry->revoked, range);
+    }
+    pthread_mutex_unlock(&entry->lock);
+}
+
+/*
+ * Server side lock acquisition
+ *
+ * Acquire requests of a file are parked in a FIFO queue of
+ * waiters, and granted in order as conflicting tokens go away.
+ * A waiter is granted once no token conflicts with it and no
+ * earlier waiter overlaps it, so a stream of new requests can
+ * not starve an earlier one on the same range.
+ *
+ * To make conflicting tokens go away, the server sends a
+ * revocation callback to every holder at once and keeps serving
+ * other lock requests. Once all holders ack, the whole range is
+ * granted as one token. The grant is sent asynchronously, with
+ * the seq_id of the acquire request.
+ *
+ * Overlapping read locks are granted as one token shared by a
+ * set of readers. A writer revokes all of them at once.
+ *
+ * Requests of a file are handled by one server worker at a time,
+ * under entry->lock. Different files are handled in parallel.
+ */
+
+// Shared by all files, only bumped atomically
+static uint64_t g_revoke_id = 0;
+
+static bool waiter_overlap(lock_waiter_t* w1, lock_waiter_t* w2) {
+    return !(w1->offset >= w2->offset + w2->count || w2->offset >= w1->offset + w1->count);
+}
+
+/**
+ * A waiter only needs to be looked at when it is new, when its
+ * last blocker leaves the queue, or when its last revocation is
+ * acked. Otherwise it is ready or waiting for acks or blockers.
+ */
+static void waiter_runnable(lock_table_t* entry, lock_waiter_t* waiter) {
+    if(waiter->blockers == 0 && waiter->pending == 0 && !waiter->ready)
+        DL_APPEND2(entry->runnable, waiter, run_prev, run_next);
+}
+
+// Append to the queue, behind the earlier waiters of its range
+static void waiter_enqueue(lock_table_t* entry, lock_waiter_t* waiter) {
+    lock_waiter_t* prev;
+    waiter->blockers = 0;
+    DL_FOREACH(entry->waiters, prev) {
+        if(waiter_overlap(prev, waiter))
+            waiter->blockers++;
     }
+    DL_APPEND(entry->waiters, waiter);
+    waiter_runnable(entry, waiter);
+}
 
-    // Once I split my token and released locally partial of it,
-    // notify the server (use release lock request) and ask it to do the same
-    void* ack;
-    size_t in_size;
-    void* in = rpc_in_pack(filename, 1, &offset, &count, &type, &in_size);
-    tangram_ucx_delegator_sendrecv_server(AM_ID_RELEASE_LOCK_REQUEST, in, in_size, &ack);
-    free(ack);
+// Remove from the queue, the later waiters of its range may run now
+static void waiter_dequeue(lock_table_t* entry, lock_waiter_t* waiter) {
+    lock_waiter_t* next;
+    for(next = waiter->next; next != NULL; next = next->next) {
+        if(waiter_overlap(waiter, next) && --next->blockers == 0)
+            waiter_runnable(entry, next);
+    }
+    DL_DELETE(entry->waiters, waiter);
 }
 
-lock_acquire_result_t* tangram_lockmgr_server_acquire_lock(lock_table_t** lt, tangram_uct_addr_t* delegator, char* filename, size_t offset, size_t count, int type, int lock_algo) {
-    lock_acquire_result_t *result = malloc(sizeof(lock_acquire_result_t));
-    result->result = LOCK_ACQUIRE_SUCCESS;
+/**
+ * `holder` gives up [offset, offset+count) of the token.
+ * A shared token stays for the other readers, and the holder
+ * keeps what is left of the range as its own read token.
+ */
+static void relinquish_token(lock_table_t* entry, lock_token_t* token, uint32_t holder, size_t offset, size_t count) {
+    if(lock_token_num_holders(&entry->token_list, token) == 1) {
+        split_lock(&entry->token_list, token, offset, count, true);
+        return;
+    }
 
-    lock_table_t* entry = NULL;
-    HASH_FIND_STR(*lt, filename, entry);
+    int64_t new_start, new_end;
+    bool left = split_range(token->start, token->end, offset, count, &new_start, &new_end);
+    lock_token_remove_holder(&entry->token_list, token, holder);
+    if(left)
+        lock_token_add_direct(&entry->token_list, lock_token_create(new_start, new_end, LOCK_TYPE_RD, holder));
+}
 
-    if(!entry) {
-        entry = malloc(sizeof(lock_table_t));
-        lock_token_list_init(&entry->token_list);
-        strcpy(entry->filename, filename);
-        HASH_ADD_STR(*lt, filename, entry);
+// Release all tokens of `owner` that overlap the range of `waiter`
+static void drop_tokens(lock_table_t* entry, uint32_t owner, lock_waiter_t* waiter) {
+    lock_token_t** tokens;
+    int num = lock_token_find_conflicts(&entry->token_list, waiter->offset, waiter->count, &tokens);
+    for(int i = 0; i < num; i++) {
+        if(lock_token_held_by(&entry->token_list, tokens[i], owner)) {
+            relinquish_token(entry, tokens[i], owner, waiter->offset, waiter->count);
+            entry->stats.splits++;
+            entry->stats.window_splits++;
+        }
     }
+    free(tokens);
+}
 
-    // First see if the requestor already hold the lock
-    // but simply ask to upgrade it, i.e., RD->WR
-    result->token = lock_token_find_cover(&entry->token_list, offset, count);
-    if( result->token && (tangram_uct_addr_compare(result->token->owner, delegator) == 0) ) {
-        if(type == LOCK_TYPE_WR)
-            lock_token_update_type(&entry->token_list, result->token, type);
-        return result;
-    }
-
-    lock_token_t* conflict_token = lock_token_find_conflict(&entry->token_list, offset, count);
-
-    // No one has the lock for the range yet
-    // We can safely grant the lock
-    //
-    // Two implementations:
-    // 1. Grant the lock range as asked
-    // 2. We can try to extend the lock range
-    //    e.g., user asks for [0, 100], we can give [0, infinity]
-    if(!conflict_token) {
-        if(lock_algo == TANGRAM_LOCK_ALGO_EXACT)
-            result->token = lock_token_add_exact(&entry->token_list, offset, count, type, delegator);
-        if(lock_algo == TANGRAM_LOCK_ALGO_EXTEND)
-            result->token = lock_token_add_extend(&entry->token_list, offset, count, type, delegator);
-        return result;
-    }
-
-    // Someone has already held the lock
-    int conflict_start = lock_token_start(&entry->token_list, conflict_token);
-    int conflict_end   = lock_token_end(&entry->token_list, conflict_token);
-    int conflict_type  = lock_token_type(&entry->token_list, conflict_token);
-    tangram_uct_addr_t* conflict_owner = lock_token_owner(&entry->token_list, conflict_token);
-
-    // Case 1. Both are read locks
-    if(type == conflict_type && type == LOCK_TYPE_RD) {
-    // Case 2. Different lock type, split the current owner's lock
-    // the requestor is responsible for contatcing the owner
-    //
-    // TODO we don't consider the case where we have multiple conflicting owners.
-    // e.g. P1:[0-10], P2:[10-20], Accquire[0-20]
-    } else {
-        //printf("server found conflict: [%d-%d], ask: [%ld-%ld]\n", conflict_start, conflict_end, offset/4096, (offset+count-1)/4096);
-        result->result = LOCK_ACQUIRE_CONFLICT;
-        result->owner  = tangram_uct_addr_duplicate(conflict_owner);
-        result->token  = NULL;
-    }
-
-    return result;
-}
-
-void tangram_lockmgr_server_release_lock(lock_table_t* lt, tangram_uct_addr_t* delegator, char* filename, size_t offset, size_t count) {
-    lock_table_t* entry = NULL;
-    HASH_FIND_STR(lt, filename, entry);
+static int add_victim(uint32_t** victims, int num_victims, uint32_t holder) {
+    for(int j = 0; j < num_victims; j++) {
+        if((*victims)[j] == holder)
+            return num_victims;
+    }
+    *victims = realloc(*victims, sizeof(uint32_t) * (num_victims+1));
+    (*victims)[num_victims++] = holder;
+    return num_victims;
+}
+
+// Return the number of distinct holders of tokens that conflict
+// with the waiter, and their ids in *victims. Read locks do
+// not conflict with each other.
+static int find_victims(lock_table_t* entry, lock_waiter_t* waiter, bool* shared, uint32_t** victims) {
+    lock_token_t** tokens;
+    int num = lock_token_find_conflicts(&entry->token_list, waiter->offset, waiter->count, &tokens);
+
+    int num_victims = 0;
+    *victims = NULL;
+    *shared = false;
+    for(int i = 0; i < num; i++) {
+        if(waiter->type == LOCK_TYPE_RD && tokens[i]->type == LOCK_TYPE_RD) {
+            *shared = true;
+            continue;
+        }
+
+        num_victims = add_victim(victims, num_victims, tokens[i]->owner);
+        for(int j = 0; j < tokens[i]->num_readers; j++)
+            num_victims = add_victim(victims, num_victims, tokens[i]->readers[j]);
+    }
+    free(tokens);
+    return num_victims;
+}
+
+static lock_batch_t* batch_create(int num) {
+    lock_batch_t* batch = malloc(sizeof(lock_batch_t));
+    batch->num       = num;
+    batch->remaining = num;
+    batch->queued    = 0;
+    batch->grants    = calloc(num, sizeof(lock_token_t*));
+    batch->waiters   = calloc(num, sizeof(lock_waiter_t*));
+    return batch;
+}
+
+static void batch_free(lock_batch_t* batch) {
+    for(int i = 0; i < batch->num; i++) {
+        if(batch->grants[i])
+            lock_token_free(batch->grants[i]);
+    }
+    free(batch->grants);
+    free(batch->waiters);
+    free(batch);
+}
+
+static void send_batch(lock_batch_t* batch, uint32_t owner, uint64_t seq_id) {
+    lock_acquire_result_t res;
+    res.result     = LOCK_ACQUIRE_SUCCESS;
+    res.num_tokens = batch->num;
+    res.tokens     = batch->grants;
+
+    size_t len;
+    void* buf = lock_acquire_result_serialize(&res, &len);
+    tangram_ucx_server_send(AM_ID_ACQUIRE_LOCK_RESPOND, tangram_ucx_server_client_addr(owner), seq_id, buf, len);
+    free(buf);
+}
+
+/**
+ * Record the grant of one range. The token may be split later,
+ * so keep a copy of what it is now.
+ */
+static void record_grant(lock_batch_t* batch, int index, lock_token_t* token) {
+    batch->grants[index] = lock_token_create(token->start, token->end, token->type, LOCK_OWNER_NONE);
+}
+
+static void waiter_free(lock_waiter_t* waiter) {
+    // Only happens at finalize, the batch is never answered
+    if(waiter->batch && --waiter->batch->queued == 0)
+        batch_free(waiter->batch);
+    free(waiter->victims);
+    free(waiter);
+}
+
+static const char* lock_algo_name(int algo) {
+    switch(algo) {
+        case TANGRAM_LOCK_ALGO_EXACT:    return "exact";
+        case TANGRAM_LOCK_ALGO_EXTEND:   return "extend";
+        case TANGRAM_LOCK_ALGO_BOUNDED:  return "bounded";
+        case TANGRAM_LOCK_ALGO_ADAPTIVE: return "adaptive";
+        default:                         return "unknown";
+    }
+}
+
+static int lock_policy(lock_table_t* entry) {
+    if(entry->lock_algo == TANGRAM_LOCK_ALGO_ADAPTIVE)
+        return entry->policy;
+    return entry->lock_algo;
+}
+
+/**
+ * Adaptive policy, decided per file every LOCK_POLICY_WINDOW grants.
+ *
+ * Extended tokens are great when each process has its own file
+ * or region, but on interleaved shared files they only end up
+ * being split and revoked again. So if conflicts or splits are
+ * frequent we move one step towards exact, and if they are rare
+ * one step towards extend: extend <-> bounded <-> exact. Moving
+ * one step at a time keeps the policy from flapping.
+ */
+static void lock_policy_update(lock_table_t* entry) {
+    lock_stats_t* stats = &entry->stats;
+    if(entry->lock_algo != TANGRAM_LOCK_ALGO_ADAPTIVE || stats->window_grants < LOCK_POLICY_WINDOW)
+        return;
+
+    uint64_t conflict_rate = stats->window_conflicts * 100 / stats->window_grants;
+    uint64_t split_rate    = stats->window_splits * 100 / stats->window_grants;
+
+    int policy = entry->policy;
+    if(conflict_rate > LOCK_POLICY_HIGH || split_rate > LOCK_POLICY_HIGH) {
+        if(policy == TANGRAM_LOCK_ALGO_EXTEND)
+            policy = TANGRAM_LOCK_ALGO_BOUNDED;
+        else
+            policy = TANGRAM_LOCK_ALGO_EXACT;
+    } else if(conflict_rate < LOCK_POLICY_LOW && split_rate < LOCK_POLICY_LOW) {
+        if(policy == TANGRAM_LOCK_ALGO_EXACT)
+            policy = TANGRAM_LOCK_ALGO_BOUNDED;
+        else
+            policy = TANGRAM_LOCK_ALGO_EXTEND;
+    }
+
+    if(policy != entry->policy) {
+        tangram_debug("[tangramfs server] lock policy, filename: %s, %s -> %s, conflicts: %lu%%, splits: %lu%%\n", entry->filename,
+                      lock_algo_name(entry->policy), lock_algo_name(policy), conflict_rate, split_rate);
+        entry->policy = policy;
+        stats->switches++;
+    }
+
+    stats->window_grants    = 0;
+    stats->window_splits    = 0;
+    stats->window_conflicts = 0;
+}
+
+// The requestor already holds a token that covers the range
+static lock_token_t* held_cover(lock_table_t* entry, lock_waiter_t* waiter) {
+    lock_token_t* token = lock_token_find_cover(&entry->token_list, waiter->offset, waiter->count);
+    if(token && lock_token_held_by(&entry->token_list, token, waiter->owner) &&
+       (waiter->type == LOCK_TYPE_RD || lock_token_type(&entry->token_list, token) == LOCK_TYPE_WR))
+        return token;
+    return NULL;
+}
+
+// Whether anyone other than `batch` is waiting
+static bool others_waiting(lock_table_t* entry, lock_batch_t* batch) {
+    lock_waiter_t* waiter;
+    DL_FOREACH(entry->waiters, waiter) {
+        if(waiter->batch != batch)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Add the token of a ready range and record the grant.
+ *
+ * Three implementations, see lock_policy_update():
+ * 1. Grant the lock range as asked
+ * 2. We can try to extend the lock range
+ *    e.g., user asks for [0, 100], we can give [0, infinity]
+ * 3. Extend, but only up to LOCK_BOUNDED_EXTEND times the request
+ *
+ * Shared read locks are granted as asked, as the extension
+ * only works if no token overlaps the range. If a read token
+ * covers the range already, the waiter joins its readers.
+ * We also do not extend while others are waiting, as the
+ * extended range could cover a range being revoked for them.
+ */
+static void grant_waiter(lock_table_t* entry, lock_waiter_t* waiter, bool others) {
+    lock_token_t* token = held_cover(entry, waiter);
+    if(token) {
+        record_grant(waiter->batch, waiter->index, token);
+        return;
+    }
+
+    // Only read tokens can overlap a ready range
+    bool shared = lock_token_find_conflict(&entry->token_list, waiter->offset, waiter->count) != NULL;
+    if(shared) {
+        token = lock_token_find_cover(&entry->token_list, waiter->offset, waiter->count);
+        if(token && lock_token_type(&entry->token_list, token) == LOCK_TYPE_RD)
+            lock_token_add_reader(&entry->token_list, token, waiter->owner);
+        else
+            token = NULL;
+    }
+
+    int policy = lock_policy(entry);
+    if(token == NULL) {
+        if(shared || policy == TANGRAM_LOCK_ALGO_EXACT || others)
+            token = lock_token_add_exact(&entry->token_list, waiter->offset, waiter->count, waiter->type, waiter->owner);
+        else if(policy == TANGRAM_LOCK_ALGO_BOUNDED)
+            token = lock_token_add_extend(&entry->token_list, waiter->offset, waiter->count, waiter->type, waiter->owner, waiter->count*LOCK_BOUNDED_EXTEND);
+        else
+            token = lock_token_add_extend(&entry->token_list, waiter->offset, waiter->count, waiter->type, waiter->owner, LOCK_EXTEND_UNBOUNDED);
+    }
+
+    entry->stats.grants++;
+    entry->stats.window_grants++;
+    if(token->start < waiter->offset || token->end > waiter->offset+waiter->count-1)
+        entry->stats.extends++;
+
+    tangram_debug("[tangramfs server] grant lock, filename: %s, ask [%ld-%ld], grant [%ld-%ld]\n", entry->filename,
+                  waiter->offset, waiter->offset+waiter->count-1, token->start, token->end);
+
+    record_grant(waiter->batch, waiter->index, token);
+}
+
+/**
+ * All ranges of the batch are ready. Add their tokens, send the
+ * respond and remove the waiters, all under entry->lock, so no
+ * revocation of these tokens can be sent before the grant.
+ *
+ * The send is asynchronous and the delegator handles grants and
+ * revocations on different workers, so a later revocation may
+ * still reach it first. We do not rely on the order: the tokens
+ * count as held from here, and the delegator applies revocations
+ * that arrive while its acquire is pending to the grant, see
+ * tangram_lockmgr_delegator_revoke_lock().
+ */
+static void grant_batch(lock_table_t* entry, lock_batch_t* batch) {
+    bool others = others_waiting(entry, batch);
+
+    lock_waiter_t* last = NULL;
+    for(int i = 0; i < batch->num; i++) {
+        if(batch->waiters[i]) {
+            last = batch->waiters[i];
+            grant_waiter(entry, last, others);
+        }
+    }
+    send_batch(batch, last->owner, last->seq_id);
+
+    for(int i = 0; i < batch->num; i++) {
+        lock_waiter_t* waiter = batch->waiters[i];
+        if(waiter) {
+            waiter_dequeue(entry, waiter);
+            waiter->batch = NULL;
+            waiter_free(waiter);
+        }
+    }
+    batch_free(batch);
+
+    lock_policy_update(entry);
+}
 
+/**
+ * Go through the runnable waiters, mark the ones we can grant
+ * as ready and send revocation callbacks for the others.
+ *
+ * A waiter does not jump ahead of an earlier waiter of the same
+ * range, it only becomes runnable once it has no blockers left.
+ * So runnable waiters never overlap earlier ones, and the order
+ * we handle them in does not matter.
+ *
+ * A ready range stays in the queue until its whole batch is
+ * ready, so later waiters of the same range keep waiting
+ * behind it, and nothing is revoked from the requestor before
+ * it receives the grant.
+ *
+ * e.g. P1:[0-10], P2:[10-20], Accquire[0-20]: P1 and P2
+ * are revoked in parallel, then [0-20] is granted.
+ */
+static void lock_queue_progress(lock_table_t* entry) {
+    while(entry->runnable != NULL) {
+        lock_waiter_t* waiter = entry->runnable;
+        DL_DELETE2(entry->runnable, waiter, run_prev, run_next);
+
+        // Had the lock already, e.g., an extended token
+        if(held_cover(entry, waiter) == NULL) {
+            bool shared;
+            free(waiter->victims);
+            waiter->num_victims = find_victims(entry, waiter, &shared, &waiter->victims);
+            if(waiter->num_victims > 0) {
+                entry->stats.conflicts++;
+                entry->stats.window_conflicts++;
+            }
+
+            // Without delegators, clients do not cache tokens,
+            // so there is no one to call back. Drop them directly.
+            if(waiter->num_victims > 0 && !entry->callback) {
+                for(int i = 0; i < waiter->num_victims; i++)
+                    drop_tokens(entry, waiter->victims[i], waiter);
+                free(waiter->victims);
+                waiter->num_victims = find_victims(entry, waiter, &shared, &waiter->victims);
+                tangram_assert(waiter->num_victims == 0);
+            }
+
+            // All callbacks of a waiter share one revoke_id,
+            // acks are told apart by who sent them.
+            if(waiter->num_victims > 0) {
+                waiter->revoke_id = __atomic_add_fetch(&g_revoke_id, 1, __ATOMIC_RELAXED);
+                waiter->pending   = waiter->num_victims;
+
+                size_t in_size;
+                void* in = rpc_in_pack(entry->filename, 1, &waiter->offset, &waiter->count, &waiter->type, NULL, &in_size);
+                for(int i = 0; i < waiter->num_victims; i++)
+                    tangram_ucx_server_send(AM_ID_REVOKE_LOCK_REQUEST, tangram_ucx_server_client_addr(waiter->victims[i]), waiter->revoke_id, in, in_size);
+                free(in);
+                continue;
+            }
+        }
+
+        // No one else has a conflicting lock for the range now
+        // Granting the batch may make later waiters runnable.
+        waiter->ready = true;
+        if(--waiter->batch->remaining == 0)
+            grant_batch(entry, waiter->batch);
+    }
+}
+
+/**
+ * All ranges of a request are queued at once, so the waiters
+ * of two batches are in the same order on every range they
+ * share, and a batch never waits for a range another batch
+ * holds while that batch waits for one of ours.
+ */
+void tangram_lockmgr_server_acquire_lock(lock_table_t** lt, uint32_t delegator, uint64_t seq_id, char* filename, interval_t* intervals, int num, int lock_algo, bool callback) {
+
+    lock_table_t* entry = lock_table_find_or_create(lt, filename);
+
+    lock_batch_t* batch = batch_create(num);
+    if(num == 0) {
+        send_batch(batch, delegator, seq_id);
+        batch_free(batch);
+        return;
+    }
+
+    pthread_mutex_lock(&entry->lock);
+    entry->lock_algo = lock_algo;
+    entry->callback  = callback;
+
+    for(int i = 0; i < num; i++) {
+        size_t offset = intervals[i].offset;
+        size_t count  = intervals[i].count;
+        int    type   = intervals[i].type;
+
+        // Ask to upgrade a lock, i.e., RD->WR. The requestor has
+        // dropped its read token already. Other readers
+        // need to be revoked before we grant the write lock.
+        lock_token_t* token = lock_token_find_cover(&entry->token_list, offset, count);
+        if(token && type == LOCK_TYPE_WR && lock_token_type(&entry->token_list, token) == LOCK_TYPE_RD &&
+           lock_token_held_by(&entry->token_list, token, delegator)) {
+            if(lock_token_num_holders(&entry->token_list, token) > 1)
+                lock_token_remove_holder(&entry->token_list, token, delegator);
+            else
+                lock_token_delete(&entry->token_list, token);
+        }
+
+        // Ranges the requestor already holds are queued as well,
+        // then no one can revoke them before the batch is sent.
+        lock_waiter_t* waiter = malloc(sizeof(lock_waiter_t));
+        waiter->owner     = delegator;
+        waiter->seq_id    = seq_id;
+        waiter->batch     = batch;
+        waiter->index     = i;
+        waiter->offset    = offset;
+        waiter->count     = count;
+        waiter->type      = type;
+        waiter->ready     = false;
+        waiter->revoke_id   = 0;
+        waiter->pending     = 0;
+        waiter->victims     = NULL;
+        waiter->num_victims = 0;
+
+        batch->waiters[i] = waiter;
+        batch->queued++;
+        waiter_enqueue(entry, waiter);
+    }
+
+    lock_queue_progress(entry);
+    pthread_mutex_unlock(&entry->lock);
+}
+
+/**
+ * The holder `victim` has released its tokens as we asked,
+ * the `revoke_id` is the seq_id of our revocation callback.
+ */
+void tangram_lockmgr_server_revoke_done(lock_table_t* lt, uint32_t victim, char* filename, uint64_t revoke_id) {
+    lock_table_t* entry = lock_table_find(lt, filename);
     if(!entry) return;
 
-    lock_token_t* token = NULL;
-    token = lock_token_find_conflict(&entry->token_list, offset, count);
+    pthread_mutex_lock(&entry->lock);
+    lock_waiter_t* waiter;
+    DL_FOREACH(entry->waiters, waiter) {
+        if(waiter->revoke_id == revoke_id)
+            break;
+    }
+    if(!waiter) {
+        pthread_mutex_unlock(&entry->lock);
+        return;
+    }
 
-    if(token && tangram_uct_addr_compare(token->owner, delegator) == 0)
-        split_lock(&entry->token_list, token, offset, count, true);
+    for(int i = 0; i < waiter->num_victims; i++) {
+        if(waiter->victims[i] == victim) {
+            drop_tokens(entry, victim, waiter);
+            waiter->victims[i] = LOCK_OWNER_NONE;
+            waiter->pending--;
+            break;
+        }
+    }
+
+    // Grant the whole range once all holders are done
+    if(waiter->pending == 0) {
+        waiter->revoke_id = 0;
+        waiter_runnable(entry, waiter);
+        lock_queue_progress(entry);
+    }
+    pthread_mutex_unlock(&entry->lock);
 }
 
-void tangram_lockmgr_server_release_lock_file(lock_table_t* lt, tangram_uct_addr_t* client, char* filename) {
-    lock_table_t* entry = NULL;
-    HASH_FIND_STR(lt, filename, entry);
+/**
+ * Release all ranges of a request under one lock of the file.
+ * A range, e.g., a merged one of a batched release, can cover
+ * many tokens, and read tokens of other readers may overlap
+ * ours, so go through all of them, not only the first one.
+ */
+void tangram_lockmgr_server_release_lock(lock_table_t* lt, uint32_t delegator, char* filename, interval_t* intervals, int num) {
+    lock_table_t* entry = lock_table_find(lt, filename);
+    if(!entry) return;
+
+    pthread_mutex_lock(&entry->lock);
+    for(int i = 0; i < num; i++) {
+        size_t offset = intervals[i].offset;
+        size_t count  = intervals[i].count;
+
+        lock_token_t** tokens;
+        int num_tokens = lock_token_find_conflicts(&entry->token_list, offset, count, &tokens);
+        for(int j = 0; j < num_tokens; j++) {
+            if(lock_token_held_by(&entry->token_list, tokens[j], delegator))
+                relinquish_token(entry, tokens[j], delegator, offset, count);
+        }
+        free(tokens);
+    }
+
+    // No need to progress the queue, waiters conflicting with
+    // these tokens wait for the acks of their revocations.
+    pthread_mutex_unlock(&entry->lock);
+}
+
+void tangram_lockmgr_server_release_lock_file(lock_table_t* lt, uint32_t client, char* filename) {
+    lock_table_t* entry = lock_table_find(lt, filename);
 
     if(entry) {
+        pthread_mutex_lock(&entry->lock);
         lock_token_delete_client(&entry->token_list, client);
+        pthread_mutex_unlock(&entry->lock);
     }
 }
 
-void tangram_lockmgr_server_release_lock_client(lock_table_t* lt, tangram_uct_addr_t* client) {
+// Goes through all files, may run along with
+// other workers that handle requests of them.
+void tangram_lockmgr_server_release_lock_client(lock_table_t* lt, uint32_t client) {
     lock_table_t *entry, *tmp;
+    pthread_rwlock_rdlock(&g_lt_lock);
     HASH_ITER(hh, lt, entry, tmp) {
+        pthread_mutex_lock(&entry->lock);
         lock_token_delete_client(&entry->token_list, client);
+        pthread_mutex_unlock(&entry->lock);
     }
+    pthread_rwlock_unlock(&g_lt_lock);
 }
 
 
+void tangram_lockmgr_print_stats(lock_table_t* lt) {
+    lock_table_t *entry, *tmp;
+    HASH_ITER(hh, lt, entry, tmp) {
+        lock_stats_t* stats = &entry->stats;
+        printf("[tangramfs server] lock stats, filename: %s, algo: %s, policy: %s, grants: %lu, extends: %lu, splits: %lu, conflicts: %lu, switches: %lu\n",
+               entry->filename, lock_algo_name(entry->lock_algo), lock_algo_name(lock_policy(entry)),
+               stats->grants, stats->extends, stats->splits, stats->conflicts, stats->switches);
+    }
+}
+
 void tangram_lockmgr_init(lock_table_t** lt) {
     *lt = NULL;
 }
@@ -303,7 +858,18 @@ void tangram_lockmgr_init(lock_table_t** lt) {
 void tangram_lockmgr_finalize(lock_table_t** lt) {
     lock_table_t *entry, *tmp;
     HASH_ITER(hh, *lt, entry, tmp) {
+        lock_waiter_t *waiter, *tmp2;
+        DL_FOREACH_SAFE(entry->waiters, waiter, tmp2) {
+            DL_DELETE(entry->waiters, waiter);
+            waiter_free(waiter);
+        }
+        lock_range_t *range, *tmp3;
+        DL_FOREACH_SAFE(entry->revoked, range, tmp3) {
+            DL_DELETE(entry->revoked, range);
+            free(range);
+        }
         lock_token_list_destroy(&entry->token_list);
+        pthread_mutex_destroy(&entry->lock);
         HASH_DEL(*lt, entry);
         free(entry);
     }
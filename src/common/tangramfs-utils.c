@@ -56,14 +56,73 @@ void tangram_info_init(tfs_info_t* tfs_info) {
     if(use_delegator)
         tfs_info->use_delegator = atoi(use_delegator);
 
-    tfs_info->lock_algo = TANGRAM_LOCK_ALGO_EXACT;
+    tfs_info->lock_algo = TANGRAM_LOCK_ALGO_ADAPTIVE;
     const char* lock_algo_str = getenv(TANGRAM_LOCK_ALGO_ENV);
     if(lock_algo_str)  {
         if(strcmp(lock_algo_str, "exact") == 0)
             tfs_info->lock_algo = TANGRAM_LOCK_ALGO_EXACT;
         if(strcmp(lock_algo_str, "extend") == 0)
             tfs_info->lock_algo = TANGRAM_LOCK_ALGO_EXTEND;
+        if(strcmp(lock_algo_str, "bounded") == 0)
+            tfs_info->lock_algo = TANGRAM_LOCK_ALGO_BOUNDED;
+        if(strcmp(lock_algo_str, "adaptive") == 0)
+            tfs_info->lock_algo = TANGRAM_LOCK_ALGO_ADAPTIVE;
     }
+
+    tfs_info->write_behind = false;
+    const char* write_behind = getenv(TANGRAM_WRITE_BEHIND_ENV);
+    if(write_behind)
+        tfs_info->write_behind = atoi(write_behind);
+
+    tfs_info->write_behind_size = 64 * 1024 * 1024;
+    const char* write_behind_size = getenv(TANGRAM_WRITE_BEHIND_SIZE_ENV);
+    if(write_behind_size && atol(write_behind_size) > 0)
+        tfs_info->write_behind_size = atol(write_behind_size) * 1024 * 1024;
+
+    tfs_info->flush_threads = 4;
+    const char* flush_threads = getenv(TANGRAM_FLUSH_THREADS_ENV);
+    if(flush_threads && atoi(flush_threads) > 0)
+        tfs_info->flush_threads = atoi(flush_threads);
+
+    tfs_info->rma_window_size = 16 * 1024 * 1024;
+    const char* rma_window_size = getenv(TANGRAM_RMA_WINDOW_SIZE_ENV);
+    if(rma_window_size && atol(rma_window_size) > 0)
+        tfs_info->rma_window_size = atol(rma_window_size) * 1024 * 1024;
+
+    tfs_info->rma_streams = 4;
+    const char* rma_streams = getenv(TANGRAM_RMA_STREAMS_ENV);
+    if(rma_streams && atoi(rma_streams) > 0)
+        tfs_info->rma_streams = atoi(rma_streams);
+
+    tfs_info->rma_pull = true;
+    const char* rma_pull = getenv(TANGRAM_RMA_PULL_ENV);
+    if(rma_pull)
+        tfs_info->rma_pull = atoi(rma_pull);
+
+    tfs_info->ep_cache_size = 256;
+    const char* ep_cache_size = getenv(TANGRAM_EP_CACHE_SIZE_ENV);
+    if(ep_cache_size && atoi(ep_cache_size) > 0)
+        tfs_info->ep_cache_size = atoi(ep_cache_size);
+
+    tfs_info->lock_cache = true;
+    const char* lock_cache = getenv(TANGRAM_LOCK_CACHE_ENV);
+    if(lock_cache)
+        tfs_info->lock_cache = atoi(lock_cache);
+
+    tfs_info->lock_block_size = 4096;
+    const char* lock_block_size = getenv(TANGRAM_LOCK_BLOCK_SIZE_ENV);
+    if(lock_block_size && atol(lock_block_size) >= 0)
+        tfs_info->lock_block_size = atol(lock_block_size);
+
+    tfs_info->progress_spin = 1000;
+    const char* progress_spin = getenv(TANGRAM_PROGRESS_SPIN_ENV);
+    if(progress_spin && atoi(progress_spin) >= -1)
+        tfs_info->progress_spin = atoi(progress_spin);
+
+    tfs_info->progress_timeout = 100;
+    const char* progress_timeout = getenv(TANGRAM_PROGRESS_TIMEOUT_ENV);
+    if(progress_timeout && atoi(progress_timeout) > 0)
+        tfs_info->progress_timeout = atoi(progress_timeout);
 }
 
 void tangram_info_finalize(tfs_info_t *tfs_info) {
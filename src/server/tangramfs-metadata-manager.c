@@ -1,17 +1,44 @@
 #include <stdio.h>
+#include <pthread.h>
 #include "uthash.h"
 #include "seg_tree.h"
 #include "tangramfs-utils.h"
 #include "tangramfs-metadata-manager.h"
+#include "tangramfs-ucx-server.h"
+
+// RMA region of a client's buffer file
+typedef struct region_entry {
+    uint32_t client;        // key, client id
+    void*  region;
+    size_t region_len;
+    UT_hash_handle hh;
+} region_entry_t;
+
+// Must be a power of two
+#define METAMGR_NUM_SHARDS      64
 
 typedef struct seg_tree_table {
     char filename[256];
     struct seg_tree tree;
+    region_entry_t* regions;        // protected by the tree's rwlock
     UT_hash_handle hh;
 } seg_tree_table_t;
 
-// Hash Map <filename, seg_tree>
-static seg_tree_table_t *g_stt = NULL;
+/**
+ * Hash Map <filename, seg_tree>, split into shards so requests
+ * on different files handled by different server workers do
+ * not contend on a single lock.
+ *
+ * A shard lock only protects its hash table. Entries are never
+ * removed before finalize, so an entry stays valid after the
+ * shard lock is released and its seg_tree has its own rwlock.
+ */
+typedef struct stt_shard {
+    pthread_rwlock_t  lock;
+    seg_tree_table_t* table;
+} stt_shard_t;
+
+static stt_shard_t g_shards[METAMGR_NUM_SHARDS];
 
 
 char* print_tree(char* dst, struct seg_tree* seg_tree)
@@ -30,98 +57,174 @@ char* print_tree(char* dst, struct seg_tree* seg_tree)
 }
 
 
-void tangram_metamgr_handle_post(tangram_uct_addr_t* client, char* filename, size_t offset, size_t count) {
+static stt_shard_t* stt_shard(char* filename, unsigned* hashv) {
+    HASH_VALUE(filename, strlen(filename), *hashv);
+    return &g_shards[*hashv & (METAMGR_NUM_SHARDS-1)];
+}
+
+static seg_tree_table_t* stt_find(char* filename) {
+    unsigned hashv;
+    stt_shard_t* shard = stt_shard(filename, &hashv);
 
     seg_tree_table_t *entry = NULL;
-    HASH_FIND_STR(g_stt, filename, entry);
+    pthread_rwlock_rdlock(&shard->lock);
+    HASH_FIND_BYHASHVALUE(hh, shard->table, filename, strlen(filename), hashv, entry);
+    pthread_rwlock_unlock(&shard->lock);
+    return entry;
+}
+
+static seg_tree_table_t* stt_find_or_create(char* filename) {
+    seg_tree_table_t *entry = stt_find(filename);
+    if(entry)
+        return entry;
 
+    unsigned hashv;
+    stt_shard_t* shard = stt_shard(filename, &hashv);
+
+    // Look again, someone else may have created it
+    pthread_rwlock_wrlock(&shard->lock);
+    HASH_FIND_BYHASHVALUE(hh, shard->table, filename, strlen(filename), hashv, entry);
     if(!entry) {
         entry = malloc(sizeof(seg_tree_table_t));
         seg_tree_init(&entry->tree);
+        entry->regions = NULL;
         strcpy(entry->filename, filename);
-        HASH_ADD_STR(g_stt, filename, entry);
+        HASH_ADD_KEYPTR_BYHASHVALUE(hh, shard->table, entry->filename, strlen(entry->filename), hashv, entry);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    return entry;
+}
+
+static region_entry_t* region_find(seg_tree_table_t* entry, uint32_t client) {
+    region_entry_t* region = NULL;
+    HASH_FIND(hh, entry->regions, &client, sizeof(uint32_t), region);
+    return region;
+}
+
+static void region_remove(seg_tree_table_t* entry, uint32_t client) {
+    region_entry_t* region = region_find(entry, client);
+    if(region) {
+        HASH_DEL(entry->regions, region);
+        free(region->region);
+        free(region);
     }
+}
 
-    // TODO should ask clients to post local offset as well
-    int res = seg_tree_add(&entry->tree, offset, offset+count-1, 0, client, true);
+void tangram_metamgr_handle_post(uint32_t client, char* filename, size_t offset, size_t count, size_t ptr) {
+    seg_tree_table_t *entry = stt_find_or_create(filename);
+    int res = seg_tree_add(&entry->tree, offset, offset+count-1, ptr, client, true);
     tangram_assert(res == 0);
 }
 
-void tangram_metamgr_handle_unpost_file(tangram_uct_addr_t* client, char* filename) {
-    seg_tree_table_t *entry = NULL;
-    HASH_FIND_STR(g_stt, filename, entry);
-    if(entry) {
-        seg_tree_clear_client(&entry->tree, client);
-    }
+/**
+ * The client has (re)registered its buffer file of `filename`
+ * for RMA, the latest region covers all data it has posted.
+ */
+void tangram_metamgr_handle_expose(uint32_t client, char* filename, void* region, size_t region_len) {
+    seg_tree_table_t *entry = stt_find_or_create(filename);
+
+    seg_tree_wrlock(&entry->tree);
+    region_remove(entry, client);
+
+    region_entry_t* r = malloc(sizeof(region_entry_t));
+    r->client     = client;
+    r->region     = malloc(region_len);
+    r->region_len = region_len;
+    memcpy(r->region, region, region_len);
+    HASH_ADD(hh, entry->regions, client, sizeof(uint32_t), r);
+    seg_tree_unlock(&entry->tree);
 }
 
-void tangram_metamgr_handle_unpost_client(tangram_uct_addr_t* client) {
-    seg_tree_table_t *entry, *tmp;
-    HASH_ITER(hh, g_stt, entry, tmp) {
-        seg_tree_clear_client(&entry->tree, client);
+static void stt_unpost(seg_tree_table_t* entry, uint32_t client) {
+    seg_tree_clear_client(&entry->tree, client);
+    seg_tree_wrlock(&entry->tree);
+    region_remove(entry, client);
+    seg_tree_unlock(&entry->tree);
+}
+
+void tangram_metamgr_handle_unpost_file(uint32_t client, char* filename) {
+    seg_tree_table_t *entry = stt_find(filename);
+    if(entry)
+        stt_unpost(entry, client);
+}
+
+void tangram_metamgr_handle_unpost_client(uint32_t client) {
+    // Shard read lock only stops new entries from being
+    // added while iterating, posts can still proceed.
+    for(int i = 0; i < METAMGR_NUM_SHARDS; i++) {
+        seg_tree_table_t *entry, *tmp;
+        pthread_rwlock_rdlock(&g_shards[i].lock);
+        HASH_ITER(hh, g_shards[i].table, entry, tmp) {
+            stt_unpost(entry, client);
+        }
+        pthread_rwlock_unlock(&g_shards[i].lock);
     }
 }
 
-tangram_uct_addr_t* tangram_metamgr_handle_query(char* filename, size_t req_start, size_t req_count) {
-    seg_tree_table_t *entry = NULL;
-    HASH_FIND_STR(g_stt, filename, entry);
-    if(entry == NULL) return false;
+/**
+ * Find who has posted [req_start, req_start+req_count).
+ *
+ * Return the number of pieces, each piece is a sub-range
+ * with a single owner. Pieces are sorted by offset, adjacent
+ * pieces of the same owner that are also contiguous in the
+ * owner's buffer file are merged. Holes (not posted by anyone)
+ * are not included.
+ */
+int tangram_metamgr_handle_query(char* filename, size_t req_start, size_t req_count, rpc_piece_t** pieces) {
+    *pieces = NULL;
+
+    seg_tree_table_t *entry = stt_find(filename);
+    if(entry == NULL) return 0;
 
     struct seg_tree *extents = &entry->tree;
+    size_t req_end = req_start + req_count - 1;
 
     seg_tree_rdlock(extents);
 
-    /* can we fully satisfy this request? assume we can */
-    bool have_data = true;
+    int num = 0, capacity = 0;
+    rpc_piece_t* last = NULL;
 
-    /* this will point to the offset of the next byte we
-     * need to account for */
-    size_t req_end = req_start + req_count - 1;
-    size_t expected_start = req_start;
-
-    /* iterate over extents we have for this file,
-     * and check that there are no holes in coverage.
-     * we search for a starting extent using a range
-     * of just the very first byte that we need */
-    struct seg_tree_node* first;
-    first = seg_tree_find_nolock(extents, req_start, req_start);
-    struct seg_tree_node* next = first;
-    while (next != NULL && next->start < req_end) {
-        if (expected_start >= next->start) {
-            /* this extent has the next byte we expect,
-             * bump up to the first byte past the end
-             * of this extent */
-            expected_start = next->end + 1;
+    struct seg_tree_node* next = seg_tree_find_nolock(extents, req_start, req_end);
+    while (next != NULL && next->start <= req_end) {
+        size_t start = (next->start > req_start) ? next->start : req_start;
+        size_t end   = (next->end < req_end) ? next->end : req_end;
+        size_t ptr   = next->ptr + (start - next->start);
+
+        if(last && last->offset+last->count == start && last->ptr+last->count == ptr &&
+           last->owner->id == next->owner) {
+            last->count += end - start + 1;
         } else {
-            /* there is a gap between extents so we're missing
-             * some bytes */
-            have_data = false;
-            break;
+            if(num == capacity) {
+                capacity = capacity ? capacity * 2 : 4;
+                *pieces = realloc(*pieces, sizeof(rpc_piece_t) * capacity);
+            }
+            last = &(*pieces)[num++];
+            last->offset = start;
+            last->count  = end - start + 1;
+            last->ptr    = ptr;
+            // Owners go to other clients, send the full address
+            last->owner  = tangram_uct_addr_duplicate(tangram_ucx_server_client_addr(next->owner));
+            last->region = NULL;
+            last->region_len = 0;
+
+            region_entry_t* region = region_find(entry, next->owner);
+            if(region) {
+                last->region     = malloc(region->region_len);
+                last->region_len = region->region_len;
+                memcpy(last->region, region->region, region->region_len);
+            }
         }
 
         /* get the next element in the tree */
         next = seg_tree_iter(extents, next);
     }
-    seg_tree_unlock(extents);
-
-    /* check that we account for the full request
-     * up until the last byte */
-    if (expected_start < req_end) {
-        /* missing some bytes at the end of the request */
-        have_data = false;
-    }
-
-    // TODO now I assume that only one rank holds the
-    // entire content in a single segment.
-    if (have_data)
-        return first->owner;
 
-    return NULL;
+    seg_tree_unlock(extents);
+    return num;
 }
 
 void tangram_metamgr_handle_stat(char* filename, struct stat *buf) {
-    seg_tree_table_t *entry = NULL;
-    HASH_FIND_STR(g_stt, filename, entry);
+    seg_tree_table_t *entry = stt_find(filename);
 
     size_t size = 0;
 
@@ -136,14 +239,27 @@ void tangram_metamgr_handle_stat(char* filename, struct stat *buf) {
 }
 
 void tangram_metamgr_init() {
-    g_stt = NULL;
+    for(int i = 0; i < METAMGR_NUM_SHARDS; i++) {
+        g_shards[i].table = NULL;
+        pthread_rwlock_init(&g_shards[i].lock, NULL);
+    }
 }
 
 void tangram_metamgr_finalize() {
-    seg_tree_table_t * entry, *tmp;
-    HASH_ITER(hh, g_stt, entry, tmp) {
-        HASH_DEL(g_stt, entry);
-        seg_tree_destroy(&entry->tree);
-        free(entry);
+    for(int i = 0; i < METAMGR_NUM_SHARDS; i++) {
+        seg_tree_table_t * entry, *tmp;
+        HASH_ITER(hh, g_shards[i].table, entry, tmp) {
+            HASH_DEL(g_shards[i].table, entry);
+            seg_tree_destroy(&entry->tree);
+
+            region_entry_t *region, *tmp2;
+            HASH_ITER(hh, entry->regions, region, tmp2) {
+                HASH_DEL(entry->regions, region);
+                free(region->region);
+                free(region);
+            }
+            free(entry);
+        }
+        pthread_rwlock_destroy(&g_shards[i].lock);
     }
 }
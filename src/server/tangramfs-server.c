@@ -13,10 +13,80 @@
 static lock_table_t* g_lt;
 static tfs_info_t    g_tfs_info;
 
+/**
+ * Respond of a query, for each interval:
+ *
+ * answered   | num_pieces | {offset, count, ptr, owner, region_len, region}*
+ * size_t     | int        | size_t, size_t, size_t, serialized addr, size_t, bytes
+ *
+ * The respond must fit in one AM. If it does not, pieces that
+ * do not fit are left out and `answered` tells how many bytes
+ * from the start of the interval this respond accounts for.
+ * Clients query again for the remaining part.
+ */
+static void* query_respond_pack(rpc_in_t* in, size_t* respond_len) {
+    tangram_uct_addr_t* self = tangram_ucx_server_addr();
+    size_t budget = tangram_ucx_server_am_short_max_size() - sizeof(size_t)*2 - self->dev_len - self->iface_len - 40/*safe guard*/;
+
+    size_t header = sizeof(size_t) + sizeof(int);
+    tangram_assert(budget >= header * in->num_intervals);
+    budget -= header * in->num_intervals;
+
+    void* respond = malloc(budget + header * in->num_intervals);
+    void* ptr = respond;
+    bool full = false;
+
+    for(int i = 0; i < in->num_intervals; i++) {
+        size_t offset = in->intervals[i].offset;
+        size_t count  = in->intervals[i].count;
+
+        rpc_piece_t* pieces = NULL;
+        int num_pieces = full ? 0 : tangram_metamgr_handle_query(in->filename, offset, count, &pieces);
+
+        void* header_ptr = ptr;
+        ptr += header;
+
+        size_t answered = full ? 0 : count;
+        int n;
+        for(n = 0; n < num_pieces; n++) {
+            size_t addr_len;
+            void* addr = tangram_uct_addr_serialize(pieces[n].owner, &addr_len);
+            size_t piece_len = sizeof(size_t)*4 + addr_len + pieces[n].region_len;
+            if(piece_len > budget) {
+                free(addr);
+                answered = pieces[n].offset - offset;
+                full = true;
+                break;
+            }
+            memcpy(ptr, &pieces[n].offset, sizeof(size_t));
+            ptr += sizeof(size_t);
+            memcpy(ptr, &pieces[n].count, sizeof(size_t));
+            ptr += sizeof(size_t);
+            memcpy(ptr, &pieces[n].ptr, sizeof(size_t));
+            ptr += sizeof(size_t);
+            memcpy(ptr, addr, addr_len);
+            ptr += addr_len;
+            memcpy(ptr, &pieces[n].region_len, sizeof(size_t));
+            ptr += sizeof(size_t);
+            memcpy(ptr, pieces[n].region, pieces[n].region_len);
+            ptr += pieces[n].region_len;
+            budget -= piece_len;
+            free(addr);
+        }
+
+        memcpy(header_ptr, &answered, sizeof(size_t));
+        memcpy(header_ptr+sizeof(size_t), &n, sizeof(int));
+        rpc_pieces_free(pieces, num_pieces);
+    }
+
+    *respond_len = ptr - respond;
+    return respond;
+}
+
 /**
  * Return a respond, can be NULL
  */
-void* server_rpc_handler(int8_t id, tangram_uct_addr_t* client, void* data, uint8_t* respond_id, size_t *respond_len) {
+void* server_rpc_handler(int8_t id, tangram_uct_addr_t* client, uint64_t seq_id, void* data, uint8_t* respond_id, size_t *respond_len) {
     *respond_len = 0;
     void *respond = NULL;
 
@@ -25,22 +95,29 @@ void* server_rpc_handler(int8_t id, tangram_uct_addr_t* client, void* data, uint
         tangram_debug("[tangramfs server] post, filename: %s, num_intervals: %d, offset:%luKB, size:%luKB\n",
                         in->filename, in->num_intervals, in->intervals[0].offset/1024, in->intervals[0].count/1024);
 
+        // The region of the buffer file follows the intervals
+        size_t region_len;
+        void* region = data + rpc_in_packed_size(in);
+        memcpy(&region_len, region, sizeof(size_t));
+        if(region_len > 0)
+            tangram_metamgr_handle_expose(client->id, in->filename, region+sizeof(size_t), region_len);
+
         for(int i = 0; i < in->num_intervals; i++)
-            tangram_metamgr_handle_post(client, in->filename, in->intervals[i].offset, in->intervals[i].count);
+            tangram_metamgr_handle_post(client->id, in->filename, in->intervals[i].offset, in->intervals[i].count, in->intervals[i].ptr);
         rpc_in_free(in);
         respond = malloc(sizeof(int));
         *respond_len = sizeof(int);
         *respond_id = AM_ID_POST_RESPOND;
     } else if(id == AM_ID_UNPOST_FILE_REQUEST) {
         rpc_in_t* in = rpc_in_unpack(data);
-        tangram_metamgr_handle_unpost_file(client, in->filename);
+        tangram_metamgr_handle_unpost_file(client->id, in->filename);
         tangram_debug("[tangramfs server] unpost file: %s\n", in->filename);
         respond = malloc(sizeof(int));
         *respond_len = sizeof(int);
         *respond_id = AM_ID_UNPOST_FILE_RESPOND;
         rpc_in_free(in);
     } else if(id == AM_ID_UNPOST_CLIENT_REQUEST) {
-        tangram_metamgr_handle_unpost_client(client);
+        tangram_metamgr_handle_unpost_client(client->id);
         tangram_debug("[tangramfs server] unpost client\n");
         respond = malloc(sizeof(int));
         *respond_len = sizeof(int);
@@ -48,39 +125,10 @@ void* server_rpc_handler(int8_t id, tangram_uct_addr_t* client, void* data, uint
     } else if(id == AM_ID_QUERY_REQUEST) {
 
         rpc_in_t* in = rpc_in_unpack(data);
+        respond = query_respond_pack(in, respond_len);
 
-        tangram_uct_addr_t** owners = (tangram_uct_addr_t**)malloc(sizeof(tangram_uct_addr_t*)*in->num_intervals);
-        *respond_len = in->num_intervals * sizeof(bool);
-        void** tmp = (void**) malloc(sizeof(void*) * in->num_intervals);
-        size_t* tmp_lens = (size_t*) malloc(in->num_intervals * sizeof(size_t));
-
-        for(int i = 0; i < in->num_intervals; i++) {
-            owners[i] = tangram_metamgr_handle_query(in->filename, in->intervals[i].offset, in->intervals[i].count);
-            tmp[i] = tangram_uct_addr_serialize(owners[i], &tmp_lens[i]);
-            *respond_len += tmp_lens[i];
-        }
-
-        respond = malloc(*respond_len);
-        memset(respond, 0, *respond_len);
-
-        void* ptr = respond;
-        for(int i = 0; i < in->num_intervals; i++) {
-            bool found = (tmp[i] != NULL);
-            memcpy(ptr, &found, sizeof(bool));
-            ptr += sizeof(bool);
-            if(found) {
-                memcpy(ptr, tmp[i], tmp_lens[i]);
-                ptr += tmp_lens[i];
-                free(tmp[i]);
-            }
-        }
-
-        tangram_debug("[tangramfs server] query, filename: %s, offset:%luKB, count: %luKB\n",
-                in->filename, in->intervals[0].offset/1024, in->intervals[0].count/1024);
-
-        free(tmp);
-        free(tmp_lens);
-        free(owners);
+        tangram_debug("[tangramfs server] query, filename: %s, num_intervals: %d, offset:%luKB, count: %luKB\n",
+                in->filename, in->num_intervals, in->intervals[0].offset/1024, in->intervals[0].count/1024);
         rpc_in_free(in);
 
         *respond_id = AM_ID_QUERY_RESPOND;
@@ -92,28 +140,20 @@ void* server_rpc_handler(int8_t id, tangram_uct_addr_t* client, void* data, uint
         *respond_id = AM_ID_STAT_RESPOND;
     } else if(id == AM_ID_ACQUIRE_LOCK_REQUEST) {
         rpc_in_t* in = rpc_in_unpack(data);
-        tangram_assert(in->num_intervals == 1);
-        //tangram_debug("[tangramfs server] acquire lock, filename: %s, ask [%ld-%ld] start\n",
-        //        in->filename, in->intervals[0].offset/LOCK_BLOCK_SIZE, (in->intervals[0].offset+in->intervals[0].count-1)/LOCK_BLOCK_SIZE);
-        lock_acquire_result_t* res = tangram_lockmgr_server_acquire_lock(&g_lt, client, in->filename, in->intervals[0].offset, in->intervals[0].count, in->intervals[0].type, g_tfs_info.lock_algo);
-        tangram_assert( tangram_uct_addr_compare(res->token->owner, client) == 0);
-
-        if(res->result == LOCK_ACQUIRE_SUCCESS) {
-            tangram_debug("[tangramfs server] acquire lock, filename: %s, ask [%ld-%ld], grant [%d-%d]\n",
-                    in->filename, in->intervals[0].offset/LOCK_BLOCK_SIZE, (in->intervals[0].offset+in->intervals[0].count-1)/LOCK_BLOCK_SIZE, res->token->block_start, res->token->block_end);
-        } else {
-            tangram_debug("[tangramfs server] acquire lock, filename: %s, ask [%ld-%ld], need split!\n",
-                    in->filename, in->intervals[0].offset/LOCK_BLOCK_SIZE, (in->intervals[0].offset+in->intervals[0].count-1)/LOCK_BLOCK_SIZE);
-        }
-
+        tangram_debug("[tangramfs server] acquire lock, filename: %s, num_intervals: %d, ask [%ld-%ld]\n",
+                in->filename, in->num_intervals, in->intervals[0].offset, in->intervals[0].offset+in->intervals[0].count-1);
+        // The lock manager sends the grant, maybe later
+        tangram_lockmgr_server_acquire_lock(&g_lt, client->id, seq_id, in->filename, in->intervals, in->num_intervals, g_tfs_info.lock_algo, g_tfs_info.use_delegator);
+        rpc_in_free(in);
+    } else if(id == AM_ID_REVOKE_LOCK_RESPOND) {
+        // The ack echoes our revocation request
+        rpc_in_t* in = rpc_in_unpack(data);
+        tangram_lockmgr_server_revoke_done(g_lt, client->id, in->filename, seq_id);
         rpc_in_free(in);
-        *respond_id = AM_ID_ACQUIRE_LOCK_RESPOND;
-        respond = lock_acquire_result_serialize(res, respond_len);
     } else if(id == AM_ID_RELEASE_LOCK_REQUEST) {
         rpc_in_t* in = rpc_in_unpack(data);
-        tangram_assert(in->num_intervals == 1);
-        tangram_debug("[tangramfs server] release lock, filename: %s, offset:%lu, count: %lu\n", in->filename, in->intervals[0].offset, in->intervals[0].count);
-        tangram_lockmgr_server_release_lock(g_lt, client, in->filename, in->intervals[0].offset, in->intervals[0].count);
+        tangram_debug("[tangramfs server] release lock, filename: %s, num_intervals: %d, offset:%lu, count: %lu\n", in->filename, in->num_intervals, in->intervals[0].offset, in->intervals[0].count);
+        tangram_lockmgr_server_release_lock(g_lt, client->id, in->filename, in->intervals, in->num_intervals);
         //tangram_debug("[tangramfs server] release lock success, filename: %s, offset:%lu, count: %lu\n", in->filename, in->intervals[0].offset, in->intervals[0].count);
         rpc_in_free(in);
         respond = malloc(sizeof(int));
@@ -121,14 +161,14 @@ void* server_rpc_handler(int8_t id, tangram_uct_addr_t* client, void* data, uint
         *respond_id = AM_ID_RELEASE_LOCK_RESPOND;
     } else if(id == AM_ID_RELEASE_LOCK_FILE_REQUEST) {
         rpc_in_t* in = rpc_in_unpack(data);
-        tangram_lockmgr_server_release_lock_file(g_lt, client, in->filename);
+        tangram_lockmgr_server_release_lock_file(g_lt, client->id, in->filename);
         tangram_debug("[tangramfs server] release lock file: %s\n", in->filename);
         rpc_in_free(in);
         respond = malloc(sizeof(int));
         *respond_len = sizeof(int);
         *respond_id = AM_ID_RELEASE_LOCK_FILE_RESPOND;
     } else if(id == AM_ID_RELEASE_LOCK_CLIENT_REQUEST) {
-        tangram_lockmgr_server_release_lock_client(g_lt, client);
+        tangram_lockmgr_server_release_lock_client(g_lt, client->id);
         tangram_debug("[tangramfs server] release lock client.\n");
         respond = malloc(sizeof(int));
         *respond_len = sizeof(int);
@@ -151,6 +191,8 @@ void tangram_server_start() {
     tangram_ucx_server_stop();
 
     tangram_metamgr_finalize();
+    if(g_tfs_info.debug)
+        tangram_lockmgr_print_stats(g_lt);
     tangram_lockmgr_finalize(&g_lt);
 }
 
@@ -6,6 +6,7 @@
 #include "tangramfs-ucx-rma.h"
 #include "tangramfs-ucx-client.h"
 #include "tangramfs-ucx-delegator.h"
+#include "tangramfs-ucx-epcache.h"
 
 static tfs_info_t*           g_tfs_info;
 static ucs_async_context_t*  g_client_async;
@@ -35,22 +36,74 @@ static tangram_uct_context_t g_client_inter_context;
 static uct_ep_h g_ep_delegator;
 static uct_ep_h g_ep_server;
 
+// Our inter address with the id the server gave us,
+// messages to the server carry only the id
+static tangram_uct_addr_t g_client_id_addr;
+
+// Endpoints to other clients
+static tangram_ep_cache_t g_ep_cache;
+
+
+// In-flight RPCs of both contexts, keyed by seq_id
+static tangram_ucx_req_t*    g_inflight;
+static uint64_t              g_next_seq_id;     // seq_id 0 is used by AMs that need no respond
+static pthread_mutex_t       g_inflight_lock;
+
 
 /**
- * Handles both query and post respond from server
+ * Handles responds from server and delegator.
+ *
+ * Runs inside uct_worker_progress(), with the context mutex held.
+ * Lock order: context mutex, then g_inflight_lock.
  */
-static ucs_status_t am_inter_respond_listener(void *arg, void *buf, size_t buf_len, unsigned flags) {
+static ucs_status_t am_respond_listener(void *arg, void *buf, size_t buf_len, unsigned flags) {
     uint64_t seq_id;
-    unpack_rpc_buffer(buf, buf_len, &seq_id, TANGRAM_UCT_ADDR_IGNORE, g_client_inter_context.respond_ptr);
-    g_client_inter_context.respond_flag = true;
+    memcpy(&seq_id, buf, sizeof(uint64_t));
+
+    tangram_ucx_req_t* req = NULL;
+    pthread_mutex_lock(&g_inflight_lock);
+    HASH_FIND(hh, g_inflight, &seq_id, sizeof(uint64_t), req);
+    if(req)
+        HASH_DEL(g_inflight, req);
+    pthread_mutex_unlock(&g_inflight_lock);
+
+    if(req) {
+        unpack_rpc_buffer(buf, buf_len, &seq_id, TANGRAM_UCT_ADDR_IGNORE, req->respond_ptr);
+        req->done = true;
+    }
     return UCS_OK;
 }
 
-static ucs_status_t am_intra_respond_listener(void *arg, void *buf, size_t buf_len, unsigned flags) {
-    uint64_t seq_id;
-    unpack_rpc_buffer(buf, buf_len, &seq_id, TANGRAM_UCT_ADDR_IGNORE, g_client_intra_context.respond_ptr);
-    g_client_intra_context.respond_flag = true;
-    return UCS_OK;
+/**
+ * Send a RPC request without waiting for the respond.
+ * The request must be registered before sending,
+ * as the respond may arrive right away.
+ */
+static tangram_uct_addr_t* sender_addr(tangram_uct_context_t* context, uct_ep_h ep) {
+    if(ep == g_ep_server && g_client_id_addr.id != 0)
+        return &g_client_id_addr;
+    return &context->self_addr;
+}
+
+static void client_send_nb(uint8_t id, tangram_uct_context_t* context, uct_ep_h ep, void* data, size_t length, void** respond_ptr, tangram_ucx_req_t* req) {
+    req->context     = context;
+    req->respond_ptr = respond_ptr;
+    req->done        = false;
+
+    pthread_mutex_lock(&g_inflight_lock);
+    req->seq_id = ++g_next_seq_id;
+    HASH_ADD(hh, g_inflight, seq_id, sizeof(uint64_t), req);
+    pthread_mutex_unlock(&g_inflight_lock);
+
+    do_uct_am_short_lock(context, ep, id, req->seq_id, sender_addr(context, ep), data, length);
+}
+
+void tangram_ucx_wait(tangram_ucx_req_t* req) {
+    while(!req->done) {
+        pthread_mutex_lock(&req->context->mutex);
+        uct_worker_progress(req->context->worker);
+        pthread_mutex_unlock(&req->context->mutex);
+    }
 }
 
 /**
@@ -58,24 +111,21 @@ static ucs_status_t am_intra_respond_listener(void *arg, void *buf, size_t buf_l
  * This is the core function for ucx communications
  */
 void client_sendrecv_core(uint8_t id, tangram_uct_context_t* context, uct_ep_h ep, void* data, size_t length, void** respond_ptr) {
-    context->respond_ptr  = respond_ptr;
-    context->respond_flag = false;
-
-    do_uct_am_short_progress(context->worker, ep, id, 0, &context->self_addr, data, length);
-
-    // if need to wait for a respond
-    if(respond_ptr != NULL) {
-        while(!context->respond_flag) {
-            uct_worker_progress(context->worker);
-        }
+    // No need to wait for a respond
+    if(respond_ptr == NULL) {
+        do_uct_am_short_lock(context, ep, id, 0, sender_addr(context, ep), data, length);
+        return;
     }
+
+    tangram_ucx_req_t req;
+    client_send_nb(id, context, ep, data, length, respond_ptr, &req);
+    tangram_ucx_wait(&req);
 }
 
 void sendrecv_inter(uint8_t id, tangram_uct_addr_t* dest, void* data, size_t length, void** respond_ptr) {
-    uct_ep_h ep;
-    uct_ep_create_connect(g_client_inter_context.iface, dest, &ep);
-    client_sendrecv_core(id, &g_client_inter_context, ep, data, length, respond_ptr);
-    uct_ep_destroy(ep);
+    tangram_ep_entry_t* entry = tangram_ep_cache_acquire(&g_ep_cache, dest);
+    client_sendrecv_core(id, &g_client_inter_context, entry->ep, data, length, respond_ptr);
+    tangram_ep_cache_release(&g_ep_cache, entry);
 }
 
 void tangram_ucx_sendrecv_client(uint8_t id, tangram_uct_addr_t* dest, void* data, size_t length, void** respond_ptr) {
@@ -94,6 +144,14 @@ void tangram_ucx_sendrecv_delegator(uint8_t id, void* data, size_t length, void*
     client_sendrecv_core(id, &g_client_intra_context, g_ep_delegator, data, length, respond_ptr);
 }
 
+void tangram_ucx_send_server_nb(uint8_t id, void* data, size_t length, void** respond_ptr, tangram_ucx_req_t* req) {
+    client_send_nb(id, &g_client_inter_context, g_ep_server, data, length, respond_ptr, req);
+}
+
+void tangram_ucx_send_delegator_nb(uint8_t id, void* data, size_t length, void** respond_ptr, tangram_ucx_req_t* req) {
+    client_send_nb(id, &g_client_intra_context, g_ep_delegator, data, length, respond_ptr, req);
+}
+
 
 /**
  * Send server a short AM that contains only the header
@@ -109,6 +167,14 @@ void tangram_ucx_stop_server() {
     tangram_ucx_sendrecv_server(AM_ID_STOP_REQUEST, NULL, 0, NULL);
 }
 
+static void client_register() {
+    uint32_t* id;
+    tangram_ucx_sendrecv_server(AM_ID_REGISTER_REQUEST, NULL, 0, (void**)&id);
+    g_client_id_addr    = g_client_inter_context.self_addr;
+    g_client_id_addr.id = *id;
+    free(id);
+}
+
 void set_delegator_intra_addr(tangram_uct_context_t* context) {
     // Broadcast local server address
     void* buf;
@@ -135,6 +201,10 @@ void tangram_ucx_client_start(tfs_info_t *tfs_info) {
     ucs_status_t status;
     ucs_async_context_create(UCS_ASYNC_MODE_THREAD_SPINLOCK, &g_client_async);
 
+    g_inflight    = NULL;
+    g_next_seq_id = 0;
+    pthread_mutex_init(&g_inflight_lock, NULL);
+
     tangram_uct_context_init(g_client_async, g_tfs_info, true,  &g_client_intra_context);
     tangram_uct_context_init(g_client_async, g_tfs_info, false, &g_client_inter_context);
     if(tfs_info->use_delegator) {
@@ -142,19 +212,29 @@ void tangram_ucx_client_start(tfs_info_t *tfs_info) {
         uct_ep_create_connect(g_client_intra_context.iface, &g_client_intra_context.delegator_addr, &g_ep_delegator);
     }
     uct_ep_create_connect(g_client_inter_context.iface, &g_client_inter_context.server_addr, &g_ep_server);
+    tangram_ep_cache_init(&g_ep_cache, &g_client_inter_context, tfs_info->ep_cache_size);
 
     // Communicatinos between global server, use inter_context
-    uct_iface_set_am_handler(g_client_inter_context.iface, AM_ID_QUERY_RESPOND, am_inter_respond_listener, NULL, 0);
-    uct_iface_set_am_handler(g_client_inter_context.iface, AM_ID_POST_RESPOND, am_inter_respond_listener, NULL, 0);
-    uct_iface_set_am_handler(g_client_inter_context.iface, AM_ID_UNPOST_FILE_RESPOND, am_inter_respond_listener, NULL, 0);
-    uct_iface_set_am_handler(g_client_inter_context.iface, AM_ID_UNPOST_CLIENT_RESPOND, am_inter_respond_listener, NULL, 0);
-    uct_iface_set_am_handler(g_client_inter_context.iface, AM_ID_STAT_RESPOND, am_inter_respond_listener, NULL, 0);
+    uct_iface_set_am_handler(g_client_inter_context.iface, AM_ID_QUERY_RESPOND, am_respond_listener, NULL, 0);
+    uct_iface_set_am_handler(g_client_inter_context.iface, AM_ID_POST_RESPOND, am_respond_listener, NULL, 0);
+    uct_iface_set_am_handler(g_client_inter_context.iface, AM_ID_UNPOST_FILE_RESPOND, am_respond_listener, NULL, 0);
+    uct_iface_set_am_handler(g_client_inter_context.iface, AM_ID_UNPOST_CLIENT_RESPOND, am_respond_listener, NULL, 0);
+    uct_iface_set_am_handler(g_client_inter_context.iface, AM_ID_STAT_RESPOND, am_respond_listener, NULL, 0);
+    uct_iface_set_am_handler(g_client_inter_context.iface, AM_ID_REGISTER_RESPOND, am_respond_listener, NULL, 0);
+    // Lock requests go to the server directly if we do not use delegators
+    uct_iface_set_am_handler(g_client_inter_context.iface, AM_ID_ACQUIRE_LOCK_RESPOND, am_respond_listener, NULL, 0);
+    uct_iface_set_am_handler(g_client_inter_context.iface, AM_ID_RELEASE_LOCK_RESPOND, am_respond_listener, NULL, 0);
+    uct_iface_set_am_handler(g_client_inter_context.iface, AM_ID_RELEASE_LOCK_FILE_RESPOND, am_respond_listener, NULL, 0);
+    uct_iface_set_am_handler(g_client_inter_context.iface, AM_ID_RELEASE_LOCK_CLIENT_RESPOND, am_respond_listener, NULL, 0);
 
     // Communications between node-local delegator, use intra_context
-    uct_iface_set_am_handler(g_client_intra_context.iface, AM_ID_ACQUIRE_LOCK_RESPOND, am_intra_respond_listener, NULL, 0);
-    uct_iface_set_am_handler(g_client_intra_context.iface, AM_ID_RELEASE_LOCK_RESPOND, am_intra_respond_listener, NULL, 0);
-    uct_iface_set_am_handler(g_client_intra_context.iface, AM_ID_RELEASE_LOCK_FILE_RESPOND, am_intra_respond_listener, NULL, 0);
-    uct_iface_set_am_handler(g_client_intra_context.iface, AM_ID_RELEASE_LOCK_CLIENT_RESPOND, am_intra_respond_listener, NULL, 0);
+    uct_iface_set_am_handler(g_client_intra_context.iface, AM_ID_ACQUIRE_LOCK_RESPOND, am_respond_listener, NULL, 0);
+    uct_iface_set_am_handler(g_client_intra_context.iface, AM_ID_RELEASE_LOCK_RESPOND, am_respond_listener, NULL, 0);
+    uct_iface_set_am_handler(g_client_intra_context.iface, AM_ID_RELEASE_LOCK_FILE_RESPOND, am_respond_listener, NULL, 0);
+    uct_iface_set_am_handler(g_client_intra_context.iface, AM_ID_RELEASE_LOCK_CLIENT_RESPOND, am_respond_listener, NULL, 0);
+
+    g_client_id_addr.id = 0;
+    client_register();
 }
 
 void tangram_ucx_client_stop() {
@@ -164,12 +244,14 @@ void tangram_ucx_client_stop() {
     if(g_tfs_info->use_delegator)
         uct_ep_destroy(g_ep_delegator);
     uct_ep_destroy(g_ep_server);
+    tangram_ep_cache_destroy(&g_ep_cache);
 
     MPI_Barrier(g_tfs_info->mpi_comm);
 
     tangram_uct_context_destroy(&g_client_intra_context);
     tangram_uct_context_destroy(&g_client_inter_context);
     ucs_async_context_destroy(g_client_async);
+    pthread_mutex_destroy(&g_inflight_lock);
 }
 
 tangram_uct_addr_t* tangram_ucx_client_inter_addr() {
@@ -1,8 +1,27 @@
 #ifndef _TANGRAMFS_UCX_CLIENT_H_
 #define _TANGRAMFS_UCX_CLIENT_H_
 
+#include "uthash.h"
 #include "tangramfs-ucx-comm.h"
 
+/**
+ * An in-flight RPC. The respond carries back the seq_id
+ * of the request, which is used to find the request and
+ * deliver the respond to respond_ptr.
+ */
+typedef struct tangram_ucx_req {
+    uint64_t               seq_id;      // key
+    tangram_uct_context_t* context;
+    void**                 respond_ptr;
+    volatile bool          done;
+    UT_hash_handle         hh;
+} tangram_ucx_req_t;
+
+// Send and return immediately, use tangram_ucx_wait() to wait for the respond
+void tangram_ucx_send_server_nb(uint8_t id, void* data, size_t length, void** respond_ptr, tangram_ucx_req_t* req);
+void tangram_ucx_send_delegator_nb(uint8_t id, void* data, size_t length, void** respond_ptr, tangram_ucx_req_t* req);
+void tangram_ucx_wait(tangram_ucx_req_t* req);
+
 void tangram_ucx_sendrecv_server(uint8_t id, void* data, size_t length, void** respond_ptr);
 void tangram_ucx_sendrecv_delegator(uint8_t id, void* data, size_t length, void** respond_ptr);
 void tangram_ucx_sendrecv_client(uint8_t id, tangram_uct_addr_t* dest, void* data, size_t length, void** respond_ptr);
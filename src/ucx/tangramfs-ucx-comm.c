@@ -6,6 +6,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <alloca.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <mpi.h>
 #include "tangramfs.h"
 #include "tangramfs-ucx-comm.h"
@@ -129,6 +131,7 @@ void exchange_dev_iface_addr(tangram_uct_context_t* context, tangram_uct_addr_t*
     for(int rank = 0; rank < mpi_size; rank++) {
         peer_addrs[rank].dev     = malloc(addr_len);
         peer_addrs[rank].dev_len = addr_len;
+        peer_addrs[rank].id      = 0;
         memcpy(peer_addrs[rank].dev, all_addrs+rank*addr_len, addr_len);
     }
     free(all_addrs);
@@ -206,6 +209,7 @@ void tangram_uct_context_init(ucs_async_context_t* async, tfs_info_t* tfs_info,
     // Set up myself's addr
     context->self_addr.dev_len   = context->iface_attr.device_addr_len;
     context->self_addr.iface_len = context->iface_attr.iface_addr_len;
+    context->self_addr.id        = 0;
     context->self_addr.dev       = malloc(context->self_addr.dev_len);
     context->self_addr.iface     = malloc(context->self_addr.iface_len);
     uct_iface_get_device_address(context->iface, context->self_addr.dev);
@@ -269,11 +273,32 @@ void uct_ep_create_connect(uct_iface_h iface, tangram_uct_addr_t* addr, uct_ep_h
     tangram_assert(status == UCS_OK);
 }
 
+/*
+ * The sender is padded to a multiple of 8 bytes. With the 8 bytes
+ * seq_id header, the data is then as aligned as the AM buffer and
+ * handlers can parse it in place, see rpc_in_unpack().
+ */
+#define RPC_SENDER_LEN(len)     (((len) + 7) & ~(size_t)7)
+
 void* pack_rpc_buffer(tangram_uct_addr_t* addr, void* data, size_t inlen, size_t* outlen) {
 
-    *outlen = 2 * sizeof(size_t) + addr->dev_len + addr->iface_len + inlen;
+    // Registered client, send the id only
+    if(addr->id != 0) {
+        size_t compact = TANGRAM_UCT_ADDR_COMPACT;
+        size_t sender_len = RPC_SENDER_LEN(sizeof(size_t) + sizeof(uint32_t));
+        *outlen = sender_len + inlen;
+        void* out = calloc(1, *outlen);
+        memcpy(out, &compact, sizeof(size_t));
+        memcpy(out+sizeof(size_t), &addr->id, sizeof(uint32_t));
+        if(data && inlen > 0)
+            memcpy(out+sender_len, data, inlen);
+        return out;
+    }
+
+    size_t sender_len = RPC_SENDER_LEN(2 * sizeof(size_t) + addr->dev_len + addr->iface_len);
+    *outlen = sender_len + inlen;
 
-    void* out = malloc(*outlen);
+    void* out = calloc(1, *outlen);
 
     void* ptr = out;
     memcpy(ptr, &addr->dev_len, sizeof(size_t));
@@ -287,13 +312,39 @@ void* pack_rpc_buffer(tangram_uct_addr_t* addr, void* data, size_t inlen, size_t
     ptr += sizeof(size_t);
     memcpy(ptr, addr->iface, addr->iface_len);
 
-    ptr += addr->iface_len;
     if(data && inlen > 0)
-        memcpy(ptr, data, inlen);
+        memcpy(out+sender_len, data, inlen);
 
     return out;
 }
 
+/*
+ * Parse the sender at `ptr`, dev and iface point into the buffer.
+ * A compact sender only has the id set. Return the size of it,
+ * including the padding.
+ */
+static size_t parse_sender(void* ptr, tangram_uct_addr_t* sender) {
+    size_t dev_len, iface_len;
+    memcpy(&dev_len, ptr, sizeof(size_t));
+
+    if(dev_len == TANGRAM_UCT_ADDR_COMPACT) {
+        sender->dev       = NULL;
+        sender->iface     = NULL;
+        sender->dev_len   = 0;
+        sender->iface_len = 0;
+        memcpy(&sender->id, ptr+sizeof(size_t), sizeof(uint32_t));
+        return RPC_SENDER_LEN(sizeof(size_t) + sizeof(uint32_t));
+    }
+
+    memcpy(&iface_len, ptr+sizeof(size_t)+dev_len, sizeof(size_t));
+    sender->id        = 0;
+    sender->dev_len   = dev_len;
+    sender->dev       = ptr + sizeof(size_t);
+    sender->iface_len = iface_len;
+    sender->iface     = ptr + 2*sizeof(size_t) + dev_len;
+    return RPC_SENDER_LEN(2*sizeof(size_t) + dev_len + iface_len);
+}
+
 void unpack_rpc_buffer(void* buf, size_t buf_len, uint64_t* seq_id, tangram_uct_addr_t *sender, void** data_ptr) {
 
     // uint64_t header is used to pass seq_id
@@ -305,28 +356,25 @@ void unpack_rpc_buffer(void* buf, size_t buf_len, uint64_t* seq_id, tangram_uct_
     buf_len = buf_len - sizeof(uint64_t);
     ptr += sizeof(uint64_t);
 
-    size_t dev_len, iface_len;
-    memcpy(&dev_len, ptr, sizeof(size_t));
-    ptr += sizeof(size_t);
-
-    if(sender != TANGRAM_UCT_ADDR_IGNORE) {
-        sender->dev_len = dev_len;
-        sender->dev = malloc(dev_len);
-        memcpy(sender->dev, ptr, dev_len);
-    }
-
-    ptr += dev_len;
-    memcpy(&iface_len, ptr, sizeof(size_t));
-    ptr += sizeof(size_t);
+    tangram_uct_addr_t view;
+    size_t sender_len = parse_sender(ptr, &view);
 
     if(sender != TANGRAM_UCT_ADDR_IGNORE) {
-        sender->iface_len = iface_len;
-        sender->iface = malloc(iface_len);
-        memcpy(sender->iface, ptr, iface_len);
+        sender->id        = view.id;
+        sender->dev_len   = view.dev_len;
+        sender->iface_len = view.iface_len;
+        sender->dev       = NULL;
+        sender->iface     = NULL;
+        if(view.id == 0) {
+            sender->dev   = malloc(view.dev_len);
+            sender->iface = malloc(view.iface_len);
+            memcpy(sender->dev, view.dev, view.dev_len);
+            memcpy(sender->iface, view.iface, view.iface_len);
+        }
     }
 
-    ptr += iface_len;
-    size_t data_len = buf_len - 2 * sizeof(size_t) - dev_len - iface_len;
+    ptr += sender_len;
+    size_t data_len = buf_len - sender_len;
 
     if(data_len > 0 && data_ptr != NULL) {
         *data_ptr = malloc(data_len);
@@ -334,15 +382,39 @@ void unpack_rpc_buffer(void* buf, size_t buf_len, uint64_t* seq_id, tangram_uct_
     }
 }
 
-void do_uct_am_short_lock(pthread_mutex_t *lock, uct_ep_h ep, uint8_t id, uint64_t seq_id, tangram_uct_addr_t* my_addr, void* data, size_t data_len) {
+void* peek_rpc_buffer(void* buf, size_t buf_len, size_t* data_len) {
+    tangram_uct_addr_t view;
+    size_t sender_len = parse_sender(buf+sizeof(uint64_t), &view);
+    *data_len = buf_len - sizeof(uint64_t) - sender_len;
+    return buf + sizeof(uint64_t) + sender_len;
+}
+
+void view_rpc_buffer(void* buf, size_t buf_len, uint64_t* seq_id, tangram_uct_addr_t* sender, void** data_ptr) {
+    memcpy(seq_id, buf, sizeof(uint64_t));
+    size_t sender_len = parse_sender(buf+sizeof(uint64_t), sender);
+
+    size_t data_len = buf_len - sizeof(uint64_t) - sender_len;
+    *data_ptr = data_len > 0 ? buf + sizeof(uint64_t) + sender_len : NULL;
+}
+
+/*
+ * Like do_uct_am_short_progress(), but for workers shared with
+ * other threads, the context mutex is held around each try.
+ * On UCS_ERR_NO_RESOURCE we progress the worker ourselves to
+ * free send resources instead of waiting for the progress
+ * thread, which may be blocked in epoll_wait().
+ */
+void do_uct_am_short_lock(tangram_uct_context_t* context, uct_ep_h ep, uint8_t id, uint64_t seq_id, tangram_uct_addr_t* my_addr, void* data, size_t data_len) {
     size_t buf_len;
     void* buf = pack_rpc_buffer(my_addr, data, data_len, &buf_len);
 
     ucs_status_t status = UCS_OK;
     do {
-        pthread_mutex_lock(lock);
+        pthread_mutex_lock(&context->mutex);
         status = uct_ep_am_short(ep, id, seq_id, buf, buf_len);
-        pthread_mutex_unlock(lock);
+        if(status == UCS_ERR_NO_RESOURCE)
+            uct_worker_progress(context->worker);
+        pthread_mutex_unlock(&context->mutex);
     } while (status == UCS_ERR_NO_RESOURCE);
 
     free(buf);
@@ -364,6 +436,123 @@ void do_uct_am_short_progress(uct_worker_h worker, uct_ep_h ep, uint8_t id, uint
 }
 
 
+void tangram_uct_progress_init(tangram_uct_progress_t* progress, tangram_uct_context_t** contexts, int num_contexts, tfs_info_t* tfs_info) {
+    progress->contexts     = malloc(sizeof(tangram_uct_context_t*) * num_contexts);
+    progress->events       = malloc(sizeof(unsigned) * num_contexts);
+    progress->num_contexts = num_contexts;
+    progress->spin         = tfs_info->progress_spin;
+    progress->timeout      = tfs_info->progress_timeout;
+    progress->idle         = 0;
+    progress->num_sleeps   = 0;
+    progress->epfd         = -1;
+    progress->wakeup_fd    = -1;
+    memcpy(progress->contexts, contexts, sizeof(tangram_uct_context_t*) * num_contexts);
+
+    if(progress->spin < 0)
+        return;
+
+    for(int i = 0; i < num_contexts; i++) {
+        uint64_t flags = contexts[i]->iface_attr.cap.event_flags;
+        if(!(flags & UCT_IFACE_FLAG_EVENT_FD) || !(flags & UCT_IFACE_FLAG_EVENT_RECV)) {
+            tangram_debug("[tangramfs] iface has no event fd support, progress thread falls back to polling\n");
+            return;
+        }
+        // Senders retry on UCS_ERR_NO_RESOURCE and need us to progress
+        // the send completions, without this event the timeout bounds
+        // the delay.
+        progress->events[i] = UCT_EVENT_RECV;
+        if(flags & UCT_IFACE_FLAG_EVENT_SEND_COMP)
+            progress->events[i] |= UCT_EVENT_SEND_COMP;
+    }
+
+    progress->epfd      = epoll_create1(EPOLL_CLOEXEC);
+    progress->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    struct epoll_event ev;
+    ev.events  = EPOLLIN;
+    ev.data.fd = progress->wakeup_fd;
+    epoll_ctl(progress->epfd, EPOLL_CTL_ADD, progress->wakeup_fd, &ev);
+
+    for(int i = 0; i < num_contexts; i++) {
+        int fd;
+        ucs_status_t status = uct_iface_event_fd_get(contexts[i]->iface, &fd);
+        tangram_assert(status == UCS_OK);
+        ev.events  = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(progress->epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+void tangram_uct_progress_destroy(tangram_uct_progress_t* progress) {
+    if(progress->epfd >= 0) {
+        close(progress->epfd);
+        close(progress->wakeup_fd);
+    }
+    free(progress->contexts);
+    free(progress->events);
+}
+
+/*
+ * Arm all ifaces, return false if some iface already
+ * has pending events, then we should not block.
+ */
+static bool progress_arm(tangram_uct_progress_t* progress) {
+    for(int i = 0; i < progress->num_contexts; i++) {
+        tangram_uct_context_t* context = progress->contexts[i];
+        pthread_mutex_lock(&context->mutex);
+        ucs_status_t status = uct_iface_event_arm(context->iface, progress->events[i]);
+        pthread_mutex_unlock(&context->mutex);
+        if(status != UCS_OK)
+            return false;
+    }
+    return true;
+}
+
+unsigned tangram_uct_progress(tangram_uct_progress_t* progress) {
+    unsigned count = 0;
+    for(int i = 0; i < progress->num_contexts; i++) {
+        tangram_uct_context_t* context = progress->contexts[i];
+        pthread_mutex_lock(&context->mutex);
+        count += uct_worker_progress(context->worker);
+        pthread_mutex_unlock(&context->mutex);
+    }
+
+    if(count > 0) {
+        progress->idle = 0;
+        return count;
+    }
+
+    if(progress->epfd < 0 || ++progress->idle < progress->spin)
+        return 0;
+
+    progress->idle = 0;
+    if(!progress_arm(progress))
+        return 0;
+
+    // The mutexes are not held here, worker threads
+    // can send through the contexts while we sleep.
+    struct epoll_event evs[8];
+    int n = epoll_wait(progress->epfd, evs, 8, progress->timeout);
+    progress->num_sleeps++;
+
+    for(int i = 0; i < n; i++) {
+        if(evs[i].data.fd == progress->wakeup_fd) {
+            uint64_t val;
+            ssize_t rc = read(progress->wakeup_fd, &val, sizeof(val));
+            (void) rc;
+        }
+    }
+    return 0;
+}
+
+void tangram_uct_progress_wakeup(tangram_uct_progress_t* progress) {
+    if(progress->wakeup_fd < 0)
+        return;
+    uint64_t val = 1;
+    ssize_t rc = write(progress->wakeup_fd, &val, sizeof(val));
+    (void) rc;
+}
+
 void* tangram_uct_addr_serialize(tangram_uct_addr_t* addr, size_t *len) {
     *len = 0;
     if(!addr) return NULL;
@@ -388,6 +577,7 @@ void* tangram_uct_addr_serialize(tangram_uct_addr_t* addr, size_t *len) {
 
 void tangram_uct_addr_deserialize(void* buf, tangram_uct_addr_t* addr) {
     void* ptr = buf;
+    addr->id = 0;
     memcpy(&addr->dev_len, ptr, sizeof(size_t));
 
     ptr += sizeof(size_t);
@@ -406,8 +596,17 @@ tangram_uct_addr_t* tangram_uct_addr_duplicate(tangram_uct_addr_t* in) {
     if(in == TANGRAM_UCT_ADDR_IGNORE)
         return TANGRAM_UCT_ADDR_IGNORE;
     tangram_uct_addr_t* out = malloc(sizeof(tangram_uct_addr_t));
+    out->id = in->id;
     out->dev_len = in->dev_len;
     out->iface_len = in->iface_len;
+
+    // Share the registered address
+    if(in->id != 0) {
+        out->dev   = in->dev;
+        out->iface = in->iface;
+        return out;
+    }
+
     out->dev = malloc(out->dev_len);
     out->iface = malloc(out->iface_len);
     memcpy(out->dev, in->dev, out->dev_len);
@@ -418,6 +617,13 @@ tangram_uct_addr_t* tangram_uct_addr_duplicate(tangram_uct_addr_t* in) {
 void tangram_uct_addr_free(tangram_uct_addr_t* addr) {
     if(addr == TANGRAM_UCT_ADDR_IGNORE) return;
 
+    // Owned by the client registry
+    if(addr->id != 0) {
+        addr->dev = NULL;
+        addr->iface = NULL;
+        return;
+    }
+
     if(addr->dev != NULL)
         free(addr->dev);
     if(addr->iface != NULL)
@@ -431,6 +637,8 @@ void tangram_uct_addr_free(tangram_uct_addr_t* addr) {
 int tangram_uct_addr_compare(tangram_uct_addr_t* a, tangram_uct_addr_t* b) {
     if(!a || !b) return -1;
     if(a == b) return 0;
+    if(a->id != 0 && b->id != 0)
+        return a->id == b->id ? 0 : 1;
     if(a->dev_len == b->dev_len && a->iface_len == b->iface_len) {
         int r1 = memcmp(a->dev, b->dev, a->dev_len);
         int r2 = memcmp(a->iface, b->iface, a->iface_len);
@@ -24,6 +24,7 @@
 #define AM_ID_UNPOST_FILE_RESPOND           14
 #define AM_ID_UNPOST_CLIENT_REQUEST         15
 #define AM_ID_UNPOST_CLIENT_RESPOND         16
+#define AM_ID_RMA_CONNECT                   17
 
 
 #define AM_ID_ACQUIRE_LOCK_REQUEST          20
@@ -34,20 +35,33 @@
 #define AM_ID_RELEASE_LOCK_FILE_RESPOND     25
 #define AM_ID_RELEASE_LOCK_CLIENT_REQUEST   26
 #define AM_ID_RELEASE_LOCK_CLIENT_RESPOND   27
-#define AM_ID_SPLIT_LOCK_REQUEST            28
-#define AM_ID_SPLIT_LOCK_RESPOND            29
+#define AM_ID_REVOKE_LOCK_REQUEST           28
+#define AM_ID_REVOKE_LOCK_RESPOND           29
+
+#define AM_ID_REGISTER_REQUEST              30
+#define AM_ID_REGISTER_RESPOND              31
 
 #define TANGRAM_UCX_ROLE_CLIENT             0
 #define TANGRAM_UCX_ROLE_SERVER             1
 
 #define TANGRAM_UCT_ADDR_IGNORE             NULL
 
+// In place of dev_len, the sender is given by its client id
+#define TANGRAM_UCT_ADDR_COMPACT            ((size_t)-1)
+
 
+/**
+ * A client registered with the server gets a small id and sends
+ * it in place of its address. On the server, an address with an
+ * id shares dev and iface with the server's client registry, so
+ * copies of it are cheap and are compared by id.
+ */
 typedef struct tangram_uct_addr {
     uct_device_addr_t* dev;
     uct_iface_addr_t*  iface;
     size_t             dev_len;
     size_t             iface_len;
+    uint32_t           id;          // client id, 0 if none
 } tangram_uct_addr_t;
 
 
@@ -73,6 +87,29 @@ typedef struct tangram_uct_context {
     volatile bool      respond_flag;
 } tangram_uct_context_t;
 
+/**
+ * Progress engine of a progress thread.
+ *
+ * Polls its contexts while there is work to do. After
+ * `spin` empty rounds it arms the ifaces and blocks in
+ * epoll until a message arrives, a wakeup is signaled or
+ * the timeout expires. If any iface has no event fd, it
+ * falls back to polling only.
+ */
+typedef struct tangram_uct_progress {
+    tangram_uct_context_t** contexts;
+    unsigned*               events;     // events to arm on each iface
+    int                     num_contexts;
+
+    int                     epfd;       // -1 if we can not block
+    int                     wakeup_fd;
+    int                     spin;
+    int                     timeout;    // in ms
+    int                     idle;       // empty rounds since the last work
+
+    uint64_t                num_sleeps;
+} tangram_uct_progress_t;
+
 void tangram_uct_context_init(ucs_async_context_t* async, tfs_info_t* tfs_info, bool intra_comm, tangram_uct_context_t* context);
 void tangram_uct_context_destroy(tangram_uct_context_t* context);
 void exchange_dev_iface_addr(tangram_uct_context_t* context, tangram_uct_addr_t* peer_addrs);
@@ -81,10 +118,24 @@ void uct_ep_create_connect(uct_iface_h iface, tangram_uct_addr_t* dest, uct_ep_h
 
 
 void unpack_rpc_buffer(void* buf, size_t buf_len, uint64_t* seq_id, tangram_uct_addr_t* sender, void** data_ptr);
-
-void do_uct_am_short_lock(pthread_mutex_t *lock, uct_ep_h ep, uint8_t id, uint64_t seq_id, tangram_uct_addr_t* my_addr, void* data, size_t length);
+// Point to the data part of the buffer without copying it
+void* peek_rpc_buffer(void* buf, size_t buf_len, size_t* data_len);
+// Like unpack_rpc_buffer(), but the sender address and the data
+// point into `buf`, they are only valid as long as `buf` is.
+// Do not free them.
+void view_rpc_buffer(void* buf, size_t buf_len, uint64_t* seq_id, tangram_uct_addr_t* sender, void** data_ptr);
+
+void do_uct_am_short_lock(tangram_uct_context_t* context, uct_ep_h ep, uint8_t id, uint64_t seq_id, tangram_uct_addr_t* my_addr, void* data, size_t length);
 void do_uct_am_short_progress(uct_worker_h worker, uct_ep_h ep, uint8_t id, uint64_t seq_id, tangram_uct_addr_t* my_addr, void* data, size_t length);
 
+void tangram_uct_progress_init(tangram_uct_progress_t* progress, tangram_uct_context_t** contexts, int num_contexts, tfs_info_t* tfs_info);
+void tangram_uct_progress_destroy(tangram_uct_progress_t* progress);
+// Progress all contexts once, block if idle for long enough.
+// Return the number of events processed.
+unsigned tangram_uct_progress(tangram_uct_progress_t* progress);
+// Wake up a blocked tangram_uct_progress(), e.g., to stop the thread
+void tangram_uct_progress_wakeup(tangram_uct_progress_t* progress);
+
 void* tangram_uct_addr_serialize(tangram_uct_addr_t* addr, size_t* len);
 void  tangram_uct_addr_deserialize(void* buf, tangram_uct_addr_t* addr);
 tangram_uct_addr_t* tangram_uct_addr_duplicate(tangram_uct_addr_t* in);
@@ -7,6 +7,7 @@
 #include "utlist.h"
 #include "tangramfs-ucx-delegator.h"
 #include "tangramfs-ucx-taskmgr.h"
+#include "tangramfs-ucx-epcache.h"
 
 #define NUM_THREADS         2
 #define NUM_OUTGOING_RPC    4
@@ -34,30 +35,38 @@ static tangram_uct_context_t g_delegator_intra_context;
 // inter-node communication with server and other delegators, use network
 static tangram_uct_context_t g_delegator_inter_context;
 
+static tangram_uct_progress_t g_progress;
+static pthread_t              g_progress_thread;
+
+// Our inter address with the id the server gave us,
+// messages to the server carry only the id
+static tangram_uct_addr_t g_delegator_id_addr;
+
 static uct_ep_h g_ep_server;
 
+// Endpoints to node-local clients and to other delegators
+static tangram_ep_cache_t g_intra_ep_cache;
+static tangram_ep_cache_t g_inter_ep_cache;
+
 
 void* (*delegator_am_handler)(uint8_t, tangram_uct_addr_t* client, void* data, uint8_t* respond_id, size_t *respond_len);
 
 static ucs_status_t am_acquire_lock_listener(void *arg, void *buf, size_t buf_len, unsigned flags) {
-    taskmgr_append_task_to_worker(&g_taskmgr, AM_ID_ACQUIRE_LOCK_REQUEST, buf, buf_len, 0);
-    return UCS_OK;
+    return taskmgr_append_task_to_worker(&g_taskmgr, AM_ID_ACQUIRE_LOCK_REQUEST, buf, buf_len, flags, &g_delegator_intra_context.mutex, 0);
 }
 static ucs_status_t am_release_lock_listener(void *arg, void *buf, size_t buf_len, unsigned flags) {
-    taskmgr_append_task_to_worker(&g_taskmgr, AM_ID_RELEASE_LOCK_REQUEST, buf, buf_len, 0);
-    return UCS_OK;
+    return taskmgr_append_task_to_worker(&g_taskmgr, AM_ID_RELEASE_LOCK_REQUEST, buf, buf_len, flags, &g_delegator_intra_context.mutex, 0);
 }
 static ucs_status_t am_release_lock_file_listener(void *arg, void *buf, size_t buf_len, unsigned flags) {
-    taskmgr_append_task_to_worker(&g_taskmgr, AM_ID_RELEASE_LOCK_FILE_REQUEST, buf, buf_len, 0);
-    return UCS_OK;
+    return taskmgr_append_task_to_worker(&g_taskmgr, AM_ID_RELEASE_LOCK_FILE_REQUEST, buf, buf_len, flags, &g_delegator_intra_context.mutex, 0);
 }
 static ucs_status_t am_release_lock_client_listener(void *arg, void *buf, size_t buf_len, unsigned flags) {
-    taskmgr_append_task_to_worker(&g_taskmgr, AM_ID_RELEASE_LOCK_CLIENT_REQUEST, buf, buf_len, 0);
-    return UCS_OK;
+    return taskmgr_append_task_to_worker(&g_taskmgr, AM_ID_RELEASE_LOCK_CLIENT_REQUEST, buf, buf_len, flags, &g_delegator_intra_context.mutex, 0);
 }
-static ucs_status_t am_split_lock_request_listener(void *arg, void *buf, size_t buf_len, unsigned flags) {
-    taskmgr_append_task_to_worker(&g_taskmgr, AM_ID_SPLIT_LOCK_REQUEST, buf, buf_len, 1);
-    return UCS_OK;
+// Revocations must not wait behind our own acquires, which
+// may be blocked on the server waiting for this revocation.
+static ucs_status_t am_revoke_lock_request_listener(void *arg, void *buf, size_t buf_len, unsigned flags) {
+    return taskmgr_append_task_to_worker(&g_taskmgr, AM_ID_REVOKE_LOCK_REQUEST, buf, buf_len, flags, &g_delegator_inter_context.mutex, 1);
 }
 static ucs_status_t am_respond_listener(void *arg, void *buf, size_t buf_len, unsigned flags) {
     uint64_t seq_id;
@@ -81,25 +90,23 @@ static ucs_status_t am_stop_listener(void *arg, void *buf, size_t buf_len, unsig
 
 // Handle RPC tasks
 // Most tasks are from node-local clients
-// Currently, only one task (SPLIT_LOCK_REQUEST) is
-// requested from remote delegators.
+// Currently, only one task (REVOKE_LOCK_REQUEST) is
+// requested from the server.
 void delegator_handle_task(task_t* task) {
     tangram_uct_context_t* context = &g_delegator_intra_context;
-    if(task->id == AM_ID_SPLIT_LOCK_REQUEST)
+    tangram_ep_cache_t* cache = &g_intra_ep_cache;
+    tangram_uct_addr_t* self = &context->self_addr;
+    if(task->id == AM_ID_REVOKE_LOCK_REQUEST) {
         context = &g_delegator_inter_context;
-
-    pthread_mutex_lock(&context->mutex);
-    uct_ep_h ep;
-    uct_ep_create_connect(context->iface, &task->client, &ep);
-    pthread_mutex_unlock(&context->mutex);
+        cache   = &g_inter_ep_cache;
+        self    = g_delegator_id_addr.id ? &g_delegator_id_addr : &context->self_addr;
+    }
 
     task->respond = (*delegator_am_handler)(task->id, &task->client, task->data, &task->id, &task->respond_len);
 
-    do_uct_am_short_lock(&context->mutex, ep, task->id, task->seq_id, &context->self_addr, task->respond, task->respond_len);
-
-    pthread_mutex_lock(&context->mutex);
-    uct_ep_destroy(ep);
-    pthread_mutex_unlock(&context->mutex);
+    tangram_ep_entry_t* entry = tangram_ep_cache_acquire(cache, &task->client);
+    do_uct_am_short_lock(context, entry->ep, task->id, task->seq_id, self, task->respond, task->respond_len);
+    tangram_ep_cache_release(cache, entry);
 }
 
 void delegator_sendrecv_core(uint8_t id, tangram_uct_context_t* context, uct_ep_h ep, void* data, size_t length, void** respond_ptr) {
@@ -123,7 +130,10 @@ void delegator_sendrecv_core(uint8_t id, tangram_uct_context_t* context, uct_ep_
 
     }
 
-    do_uct_am_short_lock(&context->mutex, ep, id, seq_id, &context->self_addr, data, length);
+    tangram_uct_addr_t* self = &context->self_addr;
+    if(ep == g_ep_server && g_delegator_id_addr.id != 0)
+        self = &g_delegator_id_addr;
+    do_uct_am_short_lock(context, ep, id, seq_id, self, data, length);
 
     // wait for respond
     if(respond_ptr != NULL) {
@@ -140,16 +150,9 @@ void tangram_ucx_delegator_sendrecv_server(uint8_t id, void* data, size_t length
 }
 
 void tangram_ucx_delegator_sendrecv_delegator(uint8_t id, tangram_uct_addr_t* dest, void* data, size_t length, void** respond_ptr) {
-    pthread_mutex_lock(&g_delegator_inter_context.mutex);
-    uct_ep_h ep;
-    uct_ep_create_connect(g_delegator_inter_context.iface, dest, &ep);
-    pthread_mutex_unlock(&g_delegator_inter_context.mutex);
-
-    delegator_sendrecv_core(id, &g_delegator_inter_context, ep, data, length, respond_ptr);
-
-    pthread_mutex_lock(&g_delegator_inter_context.mutex);
-    uct_ep_destroy(ep);
-    pthread_mutex_unlock(&g_delegator_inter_context.mutex);
+    tangram_ep_entry_t* entry = tangram_ep_cache_acquire(&g_inter_ep_cache, dest);
+    delegator_sendrecv_core(id, &g_delegator_inter_context, entry->ep, data, length, respond_ptr);
+    tangram_ep_cache_release(&g_inter_ep_cache, entry);
 }
 
 void tangram_ucx_delegator_init(tfs_info_t *tfs_info) {
@@ -170,6 +173,8 @@ void tangram_ucx_delegator_init(tfs_info_t *tfs_info) {
     tangram_uct_context_init(g_delegator_async, tfs_info, false, &g_delegator_inter_context);
 
     uct_ep_create_connect(g_delegator_inter_context.iface, &g_delegator_inter_context.server_addr, &g_ep_server);
+    tangram_ep_cache_init(&g_intra_ep_cache, &g_delegator_intra_context, tfs_info->ep_cache_size);
+    tangram_ep_cache_init(&g_inter_ep_cache, &g_delegator_inter_context, tfs_info->ep_cache_size);
 
     // From node-local clients, use intra_context
     uct_iface_set_am_handler(g_delegator_intra_context.iface, AM_ID_ACQUIRE_LOCK_REQUEST, am_acquire_lock_listener, NULL, 0);
@@ -178,13 +183,16 @@ void tangram_ucx_delegator_init(tfs_info_t *tfs_info) {
     uct_iface_set_am_handler(g_delegator_intra_context.iface, AM_ID_RELEASE_LOCK_CLIENT_REQUEST, am_release_lock_client_listener, NULL, 0);
     uct_iface_set_am_handler(g_delegator_intra_context.iface, AM_ID_STOP_REQUEST, am_stop_listener, NULL, 0);
 
-    // From other delegators, use inter_context
-    uct_iface_set_am_handler(g_delegator_inter_context.iface, AM_ID_SPLIT_LOCK_REQUEST, am_split_lock_request_listener, NULL, 0);
-    uct_iface_set_am_handler(g_delegator_inter_context.iface, AM_ID_SPLIT_LOCK_RESPOND, am_respond_listener, NULL, 0);
+    // Lock revocation callbacks from server, use inter_context
+    uct_iface_set_am_handler(g_delegator_inter_context.iface, AM_ID_REVOKE_LOCK_REQUEST, am_revoke_lock_request_listener, NULL, 0);
 
     // From server, respond to our acquire_lock and release_lock request
     uct_iface_set_am_handler(g_delegator_inter_context.iface, AM_ID_ACQUIRE_LOCK_RESPOND, am_respond_listener, NULL, 0);
     uct_iface_set_am_handler(g_delegator_inter_context.iface, AM_ID_RELEASE_LOCK_RESPOND, am_respond_listener, NULL, 0);
+    uct_iface_set_am_handler(g_delegator_inter_context.iface, AM_ID_REGISTER_RESPOND, am_respond_listener, NULL, 0);
+
+    tangram_uct_context_t* contexts[] = {&g_delegator_intra_context, &g_delegator_inter_context};
+    tangram_uct_progress_init(&g_progress, contexts, 2, tfs_info);
 
     taskmgr_init(&g_taskmgr, NUM_THREADS, delegator_handle_task);
 }
@@ -194,22 +202,22 @@ void tangram_ucx_delegator_register_rpc(void* (*user_handler)(uint8_t, tangram_u
 }
 
 void* delegator_progress_loop(void* arg) {
-    while(g_delegator_running) {
-        pthread_mutex_lock(&g_delegator_intra_context.mutex);
-        uct_worker_progress(g_delegator_intra_context.worker);
-        pthread_mutex_unlock(&g_delegator_intra_context.mutex);
-
-        pthread_mutex_lock(&g_delegator_inter_context.mutex);
-        uct_worker_progress(g_delegator_inter_context.worker);
-        pthread_mutex_unlock(&g_delegator_inter_context.mutex);
-    }
+    while(g_delegator_running)
+        tangram_uct_progress(&g_progress);
 
     return NULL;
 }
 
 void tangram_ucx_delegator_start() {
-    pthread_t thread;
-    pthread_create(&thread, NULL, delegator_progress_loop, NULL);
+    pthread_create(&g_progress_thread, NULL, delegator_progress_loop, NULL);
+
+    // Register with the server, needs the progress loop
+    uint32_t* id;
+    g_delegator_id_addr.id = 0;
+    tangram_ucx_delegator_sendrecv_server(AM_ID_REGISTER_REQUEST, NULL, 0, (void**)&id);
+    g_delegator_id_addr    = g_delegator_inter_context.self_addr;
+    g_delegator_id_addr.id = *id;
+    free(id);
 }
 
 void tangram_ucx_delegator_stop() {
@@ -218,6 +226,7 @@ void tangram_ucx_delegator_stop() {
         printf("Delegator still running...");
         sleep(1);
     }
+    pthread_join(g_progress_thread, NULL);
 
     taskmgr_finalize(&g_taskmgr);
 
@@ -228,6 +237,18 @@ void tangram_ucx_delegator_stop() {
     free(g_responds);
 
 
+    if(g_tfs_info->debug) {
+        uint64_t hits, misses, evictions;
+        tangram_ep_cache_stats(&g_intra_ep_cache, &hits, &misses, &evictions);
+        printf("[tangramfs delegator] intra ep cache hits: %lu, misses: %lu, evictions: %lu\n", hits, misses, evictions);
+        tangram_ep_cache_stats(&g_inter_ep_cache, &hits, &misses, &evictions);
+        printf("[tangramfs delegator] inter ep cache hits: %lu, misses: %lu, evictions: %lu\n", hits, misses, evictions);
+        printf("[tangramfs delegator] progress sleeps: %lu\n", g_progress.num_sleeps);
+    }
+    tangram_uct_progress_destroy(&g_progress);
+    tangram_ep_cache_destroy(&g_intra_ep_cache);
+    tangram_ep_cache_destroy(&g_inter_ep_cache);
+
     uct_ep_destroy(g_ep_server);
     tangram_uct_context_destroy(&g_delegator_intra_context);
     tangram_uct_context_destroy(&g_delegator_inter_context);
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utlist.h"
+#include "tangramfs-ucx-epcache.h"
+
+/*
+ * The context mutex must be held when creating
+ * or destroying endpoints of the context.
+ *
+ * Lock order: cache->lock, then context->mutex.
+ */
+static void ep_entry_destroy(tangram_ep_cache_t* cache, tangram_ep_entry_t* entry) {
+    pthread_mutex_lock(&cache->context->mutex);
+    uct_ep_destroy(entry->ep);
+    pthread_mutex_unlock(&cache->context->mutex);
+    free(entry->key);
+    free(entry);
+}
+
+// Remove entry from the cache, assume cache->lock is held
+static void ep_entry_evict(tangram_ep_cache_t* cache, tangram_ep_entry_t* entry) {
+    HASH_DEL(cache->table, entry);
+    DL_DELETE(cache->lru, entry);
+    cache->size--;
+    cache->evictions++;
+    entry->evicted = true;
+}
+
+// Evict unpinned entries from the LRU end until we are within capacity
+static void ep_cache_shrink(tangram_ep_cache_t* cache) {
+    tangram_ep_entry_t* entry = cache->lru ? cache->lru->prev : NULL;  // tail
+    while(cache->size > cache->capacity && entry) {
+        tangram_ep_entry_t* prev = (entry == cache->lru) ? NULL : entry->prev;
+        if(entry->refs == 0) {
+            ep_entry_evict(cache, entry);
+            ep_entry_destroy(cache, entry);
+        }
+        entry = prev;
+    }
+}
+
+tangram_ep_entry_t* tangram_ep_cache_acquire(tangram_ep_cache_t* cache, tangram_uct_addr_t* dest) {
+    size_t key_len;
+    void* key = tangram_uct_addr_serialize(dest, &key_len);
+
+    pthread_mutex_lock(&cache->lock);
+
+    tangram_ep_entry_t* entry = NULL;
+    HASH_FIND(hh, cache->table, key, key_len, entry);
+
+    if(entry) {
+        cache->hits++;
+        free(key);
+        DL_DELETE(cache->lru, entry);
+    } else {
+        cache->misses++;
+        entry = calloc(1, sizeof(tangram_ep_entry_t));
+        entry->key     = key;
+        entry->key_len = key_len;
+
+        pthread_mutex_lock(&cache->context->mutex);
+        uct_ep_create_connect(cache->context->iface, dest, &entry->ep);
+        pthread_mutex_unlock(&cache->context->mutex);
+
+        HASH_ADD_KEYPTR(hh, cache->table, entry->key, entry->key_len, entry);
+        cache->size++;
+    }
+
+    DL_PREPEND(cache->lru, entry);
+    entry->refs++;
+
+    ep_cache_shrink(cache);
+
+    pthread_mutex_unlock(&cache->lock);
+    return entry;
+}
+
+void tangram_ep_cache_release(tangram_ep_cache_t* cache, tangram_ep_entry_t* entry) {
+    pthread_mutex_lock(&cache->lock);
+    entry->refs--;
+    if(entry->evicted && entry->refs == 0)
+        ep_entry_destroy(cache, entry);
+    else
+        ep_cache_shrink(cache);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void tangram_ep_cache_stats(tangram_ep_cache_t* cache, uint64_t* hits, uint64_t* misses, uint64_t* evictions) {
+    pthread_mutex_lock(&cache->lock);
+    *hits      = cache->hits;
+    *misses    = cache->misses;
+    *evictions = cache->evictions;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void tangram_ep_cache_init(tangram_ep_cache_t* cache, tangram_uct_context_t* context, int capacity) {
+    cache->context   = context;
+    cache->capacity  = capacity > 0 ? capacity : 1;
+    cache->size      = 0;
+    cache->table     = NULL;
+    cache->lru       = NULL;
+    cache->hits      = 0;
+    cache->misses    = 0;
+    cache->evictions = 0;
+    pthread_mutex_init(&cache->lock, NULL);
+}
+
+// Assume no entry is in use
+void tangram_ep_cache_destroy(tangram_ep_cache_t* cache) {
+    tangram_ep_entry_t *entry, *tmp;
+    HASH_ITER(hh, cache->table, entry, tmp) {
+        HASH_DEL(cache->table, entry);
+        DL_DELETE(cache->lru, entry);
+        ep_entry_destroy(cache, entry);
+    }
+    cache->size = 0;
+    pthread_mutex_destroy(&cache->lock);
+}
@@ -0,0 +1,47 @@
+#ifndef _TANGRAMFS_UCX_EPCACHE_H_
+#define _TANGRAMFS_UCX_EPCACHE_H_
+#include "uthash.h"
+#include "tangramfs-ucx-comm.h"
+
+/**
+ * Cache of connected endpoints of one context,
+ * keyed by the serialized remote address.
+ *
+ * An entry is pinned while in use (between acquire and
+ * release). When the cache is full, the least recently
+ * used unpinned entry is evicted. If every entry is in
+ * use, the cache grows beyond its capacity for a while.
+ */
+typedef struct tangram_ep_entry {
+    void*    key;
+    size_t   key_len;
+    uct_ep_h ep;
+    int      refs;
+    bool     evicted;           // removed from the cache, destroy on last release
+    UT_hash_handle hh;
+    struct tangram_ep_entry *next, *prev;
+} tangram_ep_entry_t;
+
+typedef struct tangram_ep_cache {
+    tangram_uct_context_t* context;
+    int                    capacity;
+    int                    size;
+    tangram_ep_entry_t*    table;       // hash table
+    tangram_ep_entry_t*    lru;         // most recently used first
+    pthread_mutex_t        lock;
+
+    uint64_t               hits;
+    uint64_t               misses;
+    uint64_t               evictions;
+} tangram_ep_cache_t;
+
+void tangram_ep_cache_init(tangram_ep_cache_t* cache, tangram_uct_context_t* context, int capacity);
+void tangram_ep_cache_destroy(tangram_ep_cache_t* cache);
+
+// Return a pinned entry connected to dest, create one if not cached
+tangram_ep_entry_t* tangram_ep_cache_acquire(tangram_ep_cache_t* cache, tangram_uct_addr_t* dest);
+void tangram_ep_cache_release(tangram_ep_cache_t* cache, tangram_ep_entry_t* entry);
+
+void tangram_ep_cache_stats(tangram_ep_cache_t* cache, uint64_t* hits, uint64_t* misses, uint64_t* evictions);
+
+#endif
@@ -5,6 +5,7 @@
 #include <stdbool.h>
 #include <alloca.h>
 #include "utlist.h"
+#include "uthash.h"
 #include "tangramfs-ucx-rma.h"
 #include "tangramfs-ucx-client.h"
 
@@ -17,19 +18,15 @@ static ucs_async_context_t* g_rma_async;
 tfs_info_t*                 gg_tfs_info;
 
 /**
- * Request context is for sending RMA request
- * this is used by the main thread
- *
- * Respond context is for perforimng the acutal RMA put
- * this is done by a pthread spawned upon receiving the request.
- *
- * We only allow one outgoing request or respond at a time
- * so we use pthread mutex to protect the rma_request() and
- * rma_respond() function.
+ * Outgoing streams are for sending RMA requests, used
+ * by the application threads, see rma_stream_t.
  *
+ * Ingoing context is for serving peers' requests, this
+ * is done by the RMA progress thread. Puts of different
+ * requests are in flight at the same time, see rma_xfer_t.
  */
-static tangram_uct_context_t  g_outgoing_context;
 static tangram_uct_context_t  g_ingoing_context;
+static tangram_uct_progress_t g_ingoing_progress;
 
 
 typedef struct zcopy_comp {
@@ -40,19 +37,102 @@ typedef struct zcopy_comp {
 } zcopy_comp_t;
 
 
+/**
+ * Receive window, registered once at service start.
+ * Peers put the requested data here. A stream only
+ * has one request at a time, so one window per stream
+ * is enough.
+ */
+typedef struct rma_window {
+    uct_allocated_memory_t mem;
+    uct_mem_h              memh;
+    size_t                 size;
+    void*                  rkey;
+    size_t                 rkey_len;
+} rma_window_t;
+
+
+/**
+ * Connection with a peer, set up at the first
+ * RMA between us and kept until the service stops.
+ *
+ * am_ep is connected to the peer's iface, used to send AMs.
+ * rma_ep is connected to the peer's rma_ep, used by the
+ * responder to put data into the requester's window.
+ */
+typedef struct rma_peer {
+    void*               key;        // serialized peer address
+    uct_ep_h            am_ep;
+    uct_ep_h            rma_ep;
+
+    // Only used by the responder, the requester's window
+    uint64_t            mem_addr;
+    uct_rkey_bundle_t   rkey;
+
+    UT_hash_handle      hh;
+} rma_peer_t;
+
+static rma_peer_t* g_ingoing_peers;     // peers read from us
+
+
+/**
+ * Outgoing RMA stream. Each stream has its own worker, iface,
+ * receive window and connections, so requests on different
+ * streams run concurrently, e.g., a reader pulling from several
+ * owners at once. The context mutex is held for a whole request.
+ */
+typedef struct rma_stream {
+    tangram_uct_context_t context;
+    rma_window_t          window;
+    rma_peer_t*           peers;    // peers we read from
+} rma_stream_t;
+
+static rma_stream_t* g_streams;
+static int           g_num_streams;
+static unsigned      g_next_stream;
+
+// Requests receiving at least this many bytes have the
+// peer put into the user buffer instead of the window
+#define RMA_DIRECT_MIN      (64*1024)
+
+
+/**
+ * A peer's request being served. The put runs in the
+ * background, once it completes, the progress thread
+ * sends the RMA_RESPOND.
+ *
+ * The put goes to the requester's window, or straight to
+ * its buffer if the request carries an rkey for it.
+ */
+typedef struct rma_xfer {
+    zcopy_comp_t      comp;         // must be the first member
+    rma_peer_t*       peer;
+    void*             buf;
+    uint64_t          mem_addr;
+    uct_rkey_bundle_t rkey;
+    bool              direct;       // rkey is ours to release
+    struct rma_xfer  *next, *prev;
+} rma_xfer_t;
+
+static int           g_num_xfers;   // puts in flight
+static rma_xfer_t*   g_done_xfers;  // puts completed, RMA_RESPOND not sent yet
+
+
 // The user of RMA serice needs to provide
 // this funciton to provide the actual data to
 // send though RMA
 void* (*g_serve_rma_data_cb)(void*, size_t *size);
 
 void  rma_respond(tangram_rma_req_t* in);
+static void rma_xfers_finish();
 void* rma_req_pack(tangram_rma_req_t* in, size_t* total_size);
 void  rma_req_unpack(void* buf, tangram_rma_req_t* in);
 void  rma_req_free(tangram_rma_req_t* in);
 
 
-static ucs_status_t am_rma_request_listener(void *arg, void *buf, size_t buf_len, unsigned flags) {
-    tangram_rma_req_t* req = malloc(sizeof(tangram_rma_req_t));
+static ucs_status_t am_rma_connect_listener(void *arg, void *buf, size_t buf_len, unsigned flags) {
+    tangram_rma_req_t* req = calloc(1, sizeof(tangram_rma_req_t));
+    req->id = AM_ID_RMA_CONNECT;
 
     uint64_t seq_id;
     void* tmp;
@@ -64,44 +144,39 @@ static ucs_status_t am_rma_request_listener(void *arg, void *buf, size_t buf_len
     return UCS_OK;
 }
 
-static ucs_status_t am_ep_addr_listener(void *arg, void *buf, size_t buf_len, unsigned flags) {
+static ucs_status_t am_rma_request_listener(void *arg, void *buf, size_t buf_len, unsigned flags) {
+    tangram_rma_req_t* req = calloc(1, sizeof(tangram_rma_req_t));
+    req->id = AM_ID_RMA_REQUEST;
+
+    // Connection is already established, the request
+    // carries no ep addresses, only the user argument
+    // and possibly the buffer to put into.
     uint64_t seq_id;
-    unpack_rpc_buffer(buf, buf_len, &seq_id, TANGRAM_UCT_ADDR_IGNORE, g_outgoing_context.respond_ptr);
-    g_outgoing_context.respond_flag = true;
+    void* tmp;
+    unpack_rpc_buffer(buf, buf_len, &seq_id, &req->src, &tmp);
+    rma_req_unpack(tmp, req);
+    free(tmp);
+
+    DL_APPEND(g_rma_reqs, req);
     return UCS_OK;
 }
 
-static ucs_status_t am_rma_respond_listener(void *arg, void *data, size_t length, unsigned flags) {
-    g_outgoing_context.respond_flag = true;
+// arg is the context of the stream
+static ucs_status_t am_ep_addr_listener(void *arg, void *buf, size_t buf_len, unsigned flags) {
+    tangram_uct_context_t* context = (tangram_uct_context_t*) arg;
+    uint64_t seq_id;
+    unpack_rpc_buffer(buf, buf_len, &seq_id, TANGRAM_UCT_ADDR_IGNORE, context->respond_ptr);
+    context->respond_flag = true;
     return UCS_OK;
 }
 
-static ucs_status_t am_rma_respond_ack_listener(void *arg, void *data, size_t length, unsigned flags) {
-    g_ingoing_context.respond_flag = true;
-    *(g_ingoing_context.respond_ptr) = malloc(sizeof(int));
+static ucs_status_t am_rma_respond_listener(void *arg, void *data, size_t length, unsigned flags) {
+    tangram_uct_context_t* context = (tangram_uct_context_t*) arg;
+    context->respond_flag = true;
     return UCS_OK;
 }
 
 
-// Assume the mutex is locked by the caller
-void rma_sendrecv_core(uint8_t id, tangram_uct_context_t* context, tangram_uct_addr_t* dest, void* data, size_t length, void** respond_ptr) {
-    context->respond_ptr  = respond_ptr;
-    context->respond_flag = false;
-
-    uct_ep_h ep;
-    uct_ep_create_connect(context->iface, dest, &ep);
-
-    do_uct_am_short_progress(context->worker, ep, id, 0, &context->self_addr, data, length);
-
-    // if need to wait for a respond
-    if(context->respond_ptr != NULL) {
-        while(!context->respond_flag || *(context->respond_ptr)==NULL) {
-            uct_worker_progress(context->worker);
-        }
-    }
-    uct_ep_destroy(ep);
-}
-
 
 void* rma_req_pack(tangram_rma_req_t* in, size_t* total_size) {
     // Format:
@@ -253,18 +328,56 @@ void do_am_zcopy(uct_ep_h ep, tangram_uct_context_t* context, uint8_t id, void*
     }
 }
 
-void do_put_zcopy(uct_ep_h ep, tangram_uct_context_t* context, uint64_t remote_addr,
-                    uct_rkey_t rkey, void* buf, size_t buf_len) {
+static void rma_xfer_completion_cb(uct_completion_t *self) {
+    rma_xfer_t* xfer = (rma_xfer_t*) self;
+    zcopy_completion_cb(self);
+    DL_APPEND(g_done_xfers, xfer);
+}
+
+/*
+ * Start the put of a transfer without waiting for it.
+ * Assume the ingoing mutex is locked by the caller.
+ */
+static void rma_xfer_post(rma_xfer_t* xfer, size_t buf_len) {
     uct_iov_t iov;
+    build_iov_and_zcopy_comp(&iov, &xfer->comp, &g_ingoing_context, xfer->buf, buf_len);
+    xfer->comp.uct_comp.func = rma_xfer_completion_cb;
+
+    ucs_status_t status = UCS_OK;
+    do {
+        status = uct_ep_put_zcopy(xfer->peer->rma_ep, &iov, 1, xfer->mem_addr, xfer->rkey.rkey, (uct_completion_t *)&xfer->comp);
+        if(status == UCS_ERR_NO_RESOURCE)
+            uct_worker_progress(g_ingoing_context.worker);
+    } while (status == UCS_ERR_NO_RESOURCE);
+    tangram_assert(status == UCS_OK || status == UCS_INPROGRESS);
+
+    g_num_xfers++;
+    // Completed right away, the callback will not be called
+    if(status == UCS_OK)
+        rma_xfer_completion_cb((uct_completion_t*) &xfer->comp);
+}
+
+void do_get_zcopy(uct_ep_h ep, tangram_uct_context_t* context, uint64_t remote_addr,
+                    uct_rkey_t rkey, void* buf, uct_mem_h memh, size_t buf_len) {
+    uct_iov_t iov;
+    iov.buffer = buf;
+    iov.length = buf_len;
+    iov.memh   = memh;
+    iov.stride = 0;
+    iov.count  = 1;
+
+    // buf is already registered, nothing to release at completion
     zcopy_comp_t comp;
-    build_iov_and_zcopy_comp(&iov, &comp, context, buf, buf_len);
+    build_zcopy_comp(&comp);
+    comp.md   = context->md;
+    comp.memh = UCT_MEM_HANDLE_NULL;
 
     ucs_status_t status = UCS_OK;
-    context->respond_flag = false;
     do {
-        status = uct_ep_put_zcopy(ep, &iov, 1, remote_addr, rkey, (uct_completion_t *)&comp);
+        status = uct_ep_get_zcopy(ep, &iov, 1, remote_addr, rkey, (uct_completion_t *)&comp);
         uct_worker_progress(context->worker);
     } while (status == UCS_ERR_NO_RESOURCE);
+    tangram_assert(status == UCS_OK || status == UCS_INPROGRESS);
 
     if (status == UCS_INPROGRESS) {
         while (!comp.done) {
@@ -273,122 +386,172 @@ void do_put_zcopy(uct_ep_h ep, tangram_uct_context_t* context, uint64_t remote_a
     }
 }
 
-void rma_respond(tangram_rma_req_t* in) {
+static rma_peer_t* rma_peer_find(rma_peer_t* peers, tangram_uct_addr_t* addr) {
+    size_t key_len;
+    void* key = tangram_uct_addr_serialize(addr, &key_len);
+    rma_peer_t* peer = NULL;
+    HASH_FIND(hh, peers, key, key_len, peer);
+    free(key);
+    return peer;
+}
+
+static rma_peer_t* rma_peer_create(rma_peer_t** peers, tangram_uct_context_t* context, tangram_uct_addr_t* addr, uct_ep_addr_t* ep_addr) {
+    size_t key_len;
+    rma_peer_t* peer = calloc(1, sizeof(rma_peer_t));
+    peer->key = tangram_uct_addr_serialize(addr, &key_len);
+    uct_ep_create_connect(context->iface, addr, &peer->am_ep);
+    ep_create_get_address(context, &peer->rma_ep, ep_addr);
+    HASH_ADD_KEYPTR(hh, *peers, peer->key, key_len, peer);
+    return peer;
+}
+
+// has_rkey: the peer keeps the rkey of a requester's window
+static void rma_peer_destroy(rma_peer_t** peers, rma_peer_t* peer, tangram_uct_context_t* context, bool has_rkey) {
+    HASH_DEL(*peers, peer);
+    if(has_rkey)
+        uct_rkey_release(context->component, &peer->rkey);
+    uct_ep_destroy(peer->rma_ep);
+    uct_ep_destroy(peer->am_ep);
+    free(peer->key);
+    free(peer);
+}
+
+static void rma_peers_destroy(rma_peer_t** peers, tangram_uct_context_t* context, bool has_rkey) {
+    rma_peer_t *peer, *tmp;
+    HASH_ITER(hh, *peers, peer, tmp) {
+        rma_peer_destroy(peers, peer, context, has_rkey);
+    }
+}
+
+/**
+ * A requester connects to us for the first time.
+ * Send back my ep address, connect to its ep
+ * and keep its window's address and rkey.
+ */
+void rma_accept(tangram_rma_req_t* in) {
+    // The requester restarted its service, drop the old connection
+    rma_peer_t* peer = rma_peer_find(g_ingoing_peers, &in->src);
+    if(peer) {
+        // Puts in flight may still use it
+        while(g_num_xfers > 0) {
+            pthread_mutex_lock(&g_ingoing_context.mutex);
+            uct_worker_progress(g_ingoing_context.worker);
+            pthread_mutex_unlock(&g_ingoing_context.mutex);
+            rma_xfers_finish();
+        }
+    }
+
     pthread_mutex_lock(&g_ingoing_context.mutex);
+    if(peer)
+        rma_peer_destroy(&g_ingoing_peers, peer, &g_ingoing_context, true);
 
-    // First send back rma dev address and my ep address
-    uct_ep_h ep;
     size_t ep_addr_len = g_ingoing_context.iface_attr.ep_addr_len;
     uct_ep_addr_t* ep_addr = alloca(ep_addr_len);
-    ep_create_get_address(&g_ingoing_context, &ep, ep_addr);
+    peer = rma_peer_create(&g_ingoing_peers, &g_ingoing_context, &in->src, ep_addr);
+
+    // First send back rma dev address and my ep address
     size_t dev_and_ep_len = sizeof(size_t)*2 + ep_addr_len + g_ingoing_context.self_addr.dev_len;
     void* dev_and_ep = alloca(dev_and_ep_len);
     memcpy(dev_and_ep, &ep_addr_len, sizeof(size_t));
-    memcpy(dev_and_ep+sizeof(size_t), ep_addr, g_ingoing_context.iface_attr.ep_addr_len);
+    memcpy(dev_and_ep+sizeof(size_t), ep_addr, ep_addr_len);
     memcpy(dev_and_ep+sizeof(size_t)+ep_addr_len, &g_ingoing_context.self_addr.dev_len, sizeof(size_t));
     memcpy(dev_and_ep+sizeof(size_t)*2+ep_addr_len, g_ingoing_context.self_addr.dev, g_ingoing_context.self_addr.dev_len);
-    rma_sendrecv_core(AM_ID_RMA_EP_ADDR, &g_ingoing_context, &in->src, dev_and_ep, dev_and_ep_len, NULL);
+    do_uct_am_short_progress(g_ingoing_context.worker, peer->am_ep, AM_ID_RMA_EP_ADDR, 0, &g_ingoing_context.self_addr, dev_and_ep, dev_and_ep_len);
 
     // Then connect to the request ep
     // Note uct_ep_connect_to_ep() requires UCT_IFACE_FLAG_CONNECT_TO_EP capability.
     // dc_mlx5 doesn't have this ability, it only supports connecting to iface
     ucs_status_t status;
-    status = uct_ep_connect_to_ep(ep, in->dev_addr, in->ep_addr);
+    status = uct_ep_connect_to_ep(peer->rma_ep, in->dev_addr, in->ep_addr);
     tangram_assert(status == UCS_OK);
 
     // Get rkey
-    uct_rkey_bundle_t rkey_ob;
-    status = uct_rkey_unpack(g_ingoing_context.component, in->rkey, &rkey_ob);
+    status = uct_rkey_unpack(g_ingoing_context.component, in->rkey, &peer->rkey);
     tangram_assert(status == UCS_OK);
+    peer->mem_addr = in->mem_addr;
+
+    pthread_mutex_unlock(&g_ingoing_context.mutex);
+}
+
+void rma_respond(tangram_rma_req_t* in) {
+    rma_xfer_t* xfer = malloc(sizeof(rma_xfer_t));
+    xfer->peer = rma_peer_find(g_ingoing_peers, &in->src);
+    tangram_assert(xfer->peer != NULL);
 
-    // RMA
     size_t buf_len;
-    void* buf = g_serve_rma_data_cb(in->user_arg, &buf_len);
-    do_put_zcopy(ep, &g_ingoing_context, in->mem_addr, rkey_ob.rkey, buf, buf_len);
-
-    // Send RMA_RESPOND to let the peer konw we
-    // have finished RMA put. Then wait for the ACK
-    // so we can safely destory the EP for RMA
-    //g_ingoing_context.respond_flag = false;
-    //do_am_zcopy(ep, &g_ingoing_context, AM_ID_RMA_RESPOND, NULL, 0, true);
-    void *ack = NULL;
-    rma_sendrecv_core(AM_ID_RMA_RESPOND, &g_ingoing_context, &in->src, NULL, 0, &ack);
-    if(ack) free(ack);
-
-    uct_rkey_release(g_ingoing_context.component, &rkey_ob);
-    uct_ep_destroy(ep);
-    free(buf);
+    xfer->buf = g_serve_rma_data_cb(in->user_arg, &buf_len);
 
+    pthread_mutex_lock(&g_ingoing_context.mutex);
+    xfer->direct = in->rkey_len > 0;
+    if(xfer->direct) {
+        ucs_status_t status = uct_rkey_unpack(g_ingoing_context.component, in->rkey, &xfer->rkey);
+        tangram_assert(status == UCS_OK);
+        xfer->mem_addr = in->mem_addr;
+    } else {
+        xfer->rkey     = xfer->peer->rkey;
+        xfer->mem_addr = xfer->peer->mem_addr;
+    }
+    rma_xfer_post(xfer, buf_len);
     pthread_mutex_unlock(&g_ingoing_context.mutex);
 }
 
+/*
+ * Send RMA_RESPOND for the completed puts to let the
+ * peers know their data is in their windows or buffers.
+ */
+static void rma_xfers_finish() {
+    pthread_mutex_lock(&g_ingoing_context.mutex);
+    while(g_done_xfers != NULL) {
+        rma_xfer_t* xfer = g_done_xfers;
+        DL_DELETE(g_done_xfers, xfer);
+        do_uct_am_short_progress(g_ingoing_context.worker, xfer->peer->am_ep, AM_ID_RMA_RESPOND, 0, &g_ingoing_context.self_addr, NULL, 0);
+        if(xfer->direct)
+            uct_rkey_release(g_ingoing_context.component, &xfer->rkey);
+        g_num_xfers--;
+        free(xfer->buf);
+        free(xfer);
+    }
+    pthread_mutex_unlock(&g_ingoing_context.mutex);
+}
 
-/** Send a RMA request and wait for the peer
- *  to do the RMA put. There should be only
- *  one outgoing RMA request at a time.
- * (1) connect
- * (2) register memory
- * (3) send my rkey
- * (4) wait for ack
+/**
+ * Connect the stream to dest for the first time. Send it
+ * my ep address, device address and the stream's window
+ * address and rkey, then connect to the ep address it
+ * sends back.
  *
- * void* recv_buf is the user's buffer in fs_read()
- * we will check if it is page-aligned, if so we
- * will use it directly for RMA.
- * if not we let UCX to allocate memory for RMA
- * and copy it to user's buffer.
- m
- * this function should be called by the main thread.
+ * Assume the stream is acquired by the caller
  */
-void tangram_ucx_rma_request(tangram_uct_addr_t* dest, void* user_arg, size_t user_arg_len, void* recv_buf, size_t recv_size) {
-    pthread_mutex_lock(&g_outgoing_context.mutex);
-    ucs_status_t status;
-    // TODO: should directly put data to user's buffer
+static rma_peer_t* rma_connect(rma_stream_t* stream, tangram_uct_addr_t* dest) {
+    tangram_uct_context_t* context = &stream->context;
+    rma_peer_t* peer = rma_peer_find(stream->peers, dest);
+    if(peer)
+        return peer;
 
-    // Fill in every filed of rma_req
     tangram_rma_req_t req_in;
-    req_in.user_arg     = user_arg;
-    req_in.user_arg_len = user_arg_len;
+    memset(&req_in, 0, sizeof(req_in));
 
-    req_in.dev_addr_len = g_outgoing_context.self_addr.dev_len;
-    req_in.dev_addr     = alloca(req_in.dev_addr_len);
-    memcpy(req_in.dev_addr, g_outgoing_context.self_addr.dev, req_in.dev_addr_len);
-
-    req_in.ep_addr_len  = g_outgoing_context.iface_attr.ep_addr_len;
+    req_in.dev_addr_len = context->self_addr.dev_len;
+    req_in.dev_addr     = context->self_addr.dev;
+    req_in.ep_addr_len  = context->iface_attr.ep_addr_len;
     req_in.ep_addr      = alloca(req_in.ep_addr_len);
+    req_in.mem_addr     = (uint64_t) stream->window.mem.address;
+    req_in.rkey_len     = stream->window.rkey_len;
+    req_in.rkey         = stream->window.rkey;
 
-    uct_ep_h ep;
-    ep_create_get_address(&g_outgoing_context, &ep, req_in.ep_addr);
-
-    uct_mem_alloc_params_t params;
-    params.field_mask = UCT_MEM_ALLOC_PARAM_FIELD_ADDRESS  |
-                        UCT_MEM_ALLOC_PARAM_FIELD_MEM_TYPE;
-    params.address    = NULL;
-    params.mem_type   = UCS_MEMORY_TYPE_HOST;
-    // TODO which one is the best?
-    uct_alloc_method_t methods[] = {UCT_ALLOC_METHOD_MD, UCT_ALLOC_METHOD_HEAP};
-    uct_allocated_memory_t mem;
-    status = uct_mem_alloc(recv_size, methods, 2, &params, &mem);
-    tangram_assert(mem.address && status == UCS_OK);
-    req_in.mem_addr = (uint64_t) mem.address;
-
-    uct_mem_h memh;
-    if(mem.method != UCT_ALLOC_METHOD_MD)
-        uct_md_mem_reg(g_outgoing_context.md, mem.address, mem.length, UCT_MD_MEM_ACCESS_RMA, &memh);
-
-    req_in.rkey_len = g_outgoing_context.md_attr.rkey_packed_size;
-    req_in.rkey     = alloca(req_in.rkey_len);
-    uct_md_mkey_pack(g_outgoing_context.md, memh, req_in.rkey);
+    peer = rma_peer_create(&stream->peers, context, dest, req_in.ep_addr);
 
-    // send to peer and get peer ep address to connect
     size_t sendbuf_size;
     void*  sendbuf = rma_req_pack(&req_in, &sendbuf_size);
 
-    // Send RMA request to the destination client and wait
-    // it to send back the ep address. The outgoing context
-    // will receive a RMA_EP_ADDR am.
+    // The stream will receive a RMA_EP_ADDR am.
     void* peer_ep_dev = NULL;
-    rma_sendrecv_core(AM_ID_RMA_REQUEST, &g_outgoing_context, dest, sendbuf, sendbuf_size, &peer_ep_dev);
-    tangram_assert(peer_ep_dev != NULL);
+    context->respond_ptr  = &peer_ep_dev;
+    context->respond_flag = false;
+    do_uct_am_short_progress(context->worker, peer->am_ep, AM_ID_RMA_CONNECT, 0, &context->self_addr, sendbuf, sendbuf_size);
+    while(!context->respond_flag || peer_ep_dev == NULL)
+        uct_worker_progress(context->worker);
+    free(sendbuf);
 
     size_t peer_ep_len, peer_dev_len;
     memcpy(&peer_ep_len, peer_ep_dev, sizeof(size_t));
@@ -398,47 +561,252 @@ void tangram_ucx_rma_request(tangram_uct_addr_t* dest, void* user_arg, size_t us
     uct_device_addr_t* peer_dev_addr = alloca(peer_dev_len);
     memcpy(peer_dev_addr, peer_ep_dev+sizeof(size_t)*2+peer_ep_len, peer_dev_len);
 
-    uct_ep_connect_to_ep(ep, peer_dev_addr, peer_ep_addr);
+    ucs_status_t status = uct_ep_connect_to_ep(peer->rma_ep, peer_dev_addr, peer_ep_addr);
+    tangram_assert(status == UCS_OK);
     free(peer_ep_dev);
 
-    // Once we made the connection with the dest client,
-    // we wait for it to finish the RMA put
-    // The client will send us a RMA_RESPOND am.
-    g_outgoing_context.respond_flag = false;
-    while(!g_outgoing_context.respond_flag)
-        uct_worker_progress(g_outgoing_context.worker);
-    memcpy(recv_buf, mem.address, recv_size);
+    return peer;
+}
+
+/*
+ * Take a free stream, starting from a different one each
+ * time. If all are busy, wait for the first one we tried.
+ */
+static rma_stream_t* rma_stream_acquire() {
+    unsigned start = __atomic_fetch_add(&g_next_stream, 1, __ATOMIC_RELAXED);
+    for(int i = 0; i < g_num_streams; i++) {
+        rma_stream_t* stream = &g_streams[(start+i) % g_num_streams];
+        if(pthread_mutex_trylock(&stream->context.mutex) == 0)
+            return stream;
+    }
+
+    rma_stream_t* stream = &g_streams[start % g_num_streams];
+    pthread_mutex_lock(&stream->context.mutex);
+    return stream;
+}
+
+static void rma_stream_release(rma_stream_t* stream) {
+    pthread_mutex_unlock(&stream->context.mutex);
+}
+
+/** Send a RMA request and wait for the peer
+ *  to do the RMA put. Each request takes one
+ *  stream, so up to TANGRAM_RMA_STREAMS requests
+ *  can be in flight at the same time.
+ *
+ * The first request to a peer sets up the connection
+ * (see rma_connect()), after that, a request is only
+ * one AM to the peer, then the peer puts data into our
+ * window and sends back a RMA_RESPOND.
+ *
+ * If recv_size is at least RMA_DIRECT_MIN and the md can
+ * register it, recv_buf is registered for this request and
+ * the peer puts into it directly, saving the copy out of
+ * the window. Smaller ones are cheaper to copy.
+ *
+ * recv_size can not exceed the window size, see
+ * tangram_ucx_rma_window_size().
+ */
+void tangram_ucx_rma_request(tangram_uct_addr_t* dest, void* user_arg, size_t user_arg_len, void* recv_buf, size_t recv_size) {
+    rma_stream_t* stream = rma_stream_acquire();
+    tangram_uct_context_t* context = &stream->context;
+    tangram_assert(recv_size <= stream->window.size);
+
+    rma_peer_t* peer = rma_connect(stream, dest);
+
+    tangram_rma_req_t req_in;
+    memset(&req_in, 0, sizeof(req_in));
+    req_in.user_arg     = user_arg;
+    req_in.user_arg_len = user_arg_len;
+
+    uct_mem_h memh;
+    bool direct = recv_size >= RMA_DIRECT_MIN &&
+                  (context->md_attr.cap.flags & UCT_MD_FLAG_REG) &&
+                  uct_md_mem_reg(context->md, recv_buf, recv_size, UCT_MD_MEM_ACCESS_RMA, &memh) == UCS_OK;
+    if(direct) {
+        req_in.mem_addr = (uint64_t) recv_buf;
+        req_in.rkey_len = context->md_attr.rkey_packed_size;
+        req_in.rkey     = alloca(req_in.rkey_len);
+        uct_md_mkey_pack(context->md, memh, req_in.rkey);
+    }
+
+    size_t sendbuf_size;
+    void*  sendbuf = rma_req_pack(&req_in, &sendbuf_size);
+
+    context->respond_flag = false;
+    do_uct_am_short_progress(context->worker, peer->am_ep, AM_ID_RMA_REQUEST, 0, &context->self_addr, sendbuf, sendbuf_size);
+    free(sendbuf);
+
+    // Wait for the peer to finish the RMA put
+    // The peer will send us a RMA_RESPOND am.
+    while(!context->respond_flag)
+        uct_worker_progress(context->worker);
+
+    if(direct)
+        uct_md_mem_dereg(context->md, memh);
+    else
+        memcpy(recv_buf, stream->window.mem.address, recv_size);
+
+    rma_stream_release(stream);
+}
 
-    // We send back a ACK after receiving RMA_RESPOND
-    // so the peer can safely destroy the EP
-    //do_am_zcopy(ep, &g_outgoing_context, AM_ID_RMA_RESPOND_ACK, NULL, 0, false);
-    int ack;
-    rma_sendrecv_core(AM_ID_RMA_RESPOND_ACK, &g_outgoing_context, dest, &ack, sizeof(int), NULL);
+size_t tangram_ucx_rma_request_overhead() {
+    // See rma_req_pack(), no ep and dev addresses for requests
+    return sizeof(uint64_t) + sizeof(size_t)*4 + g_streams[0].context.md_attr.rkey_packed_size;
+}
 
-    uct_ep_destroy(ep);
+size_t tangram_ucx_rma_window_size() {
+    return g_streams[0].window.size;
+}
 
-    if(mem.method != UCT_ALLOC_METHOD_MD)
-        uct_md_mem_dereg(g_outgoing_context.md, memh);
-    uct_mem_free(&mem);
-    pthread_mutex_unlock(&g_outgoing_context.mutex);
+bool tangram_ucx_rma_get_supported() {
+    return (g_streams[0].context.iface_attr.cap.flags & UCT_IFACE_FLAG_GET_ZCOPY) &&
+           (g_ingoing_context.iface_attr.cap.flags & UCT_IFACE_FLAG_GET_ZCOPY);
+}
+
+/**
+ * Register memory for peers to get from. Peers access it
+ * through our ingoing context's rma_ep, so we register it
+ * with the ingoing md.
+ */
+tangram_rma_mem_t* tangram_ucx_rma_mem_reg(void* addr, size_t len) {
+    tangram_rma_mem_t* mem = malloc(sizeof(tangram_rma_mem_t));
+
+    ucs_status_t status;
+    status = uct_md_mem_reg(g_ingoing_context.md, addr, len, UCT_MD_MEM_ACCESS_RMA, &mem->memh);
+    tangram_assert(status == UCS_OK);
+
+    uint64_t mem_addr = (uint64_t) addr;
+    size_t rkey_len = g_ingoing_context.md_attr.rkey_packed_size;
+    mem->region_len = sizeof(uint64_t) + rkey_len;
+    mem->region     = malloc(mem->region_len);
+    memcpy(mem->region, &mem_addr, sizeof(uint64_t));
+    uct_md_mkey_pack(g_ingoing_context.md, mem->memh, mem->region+sizeof(uint64_t));
+    return mem;
+}
+
+void tangram_ucx_rma_mem_dereg(tangram_rma_mem_t* mem) {
+    uct_md_mem_dereg(g_ingoing_context.md, mem->memh);
+    free(mem->region);
+    free(mem);
+}
+
+/**
+ * One-sided read from a region registered by dest with
+ * tangram_ucx_rma_mem_reg(). dest is not involved, its
+ * progress thread does not need to run.
+ *
+ * Data is got straight into recv_buf if the md needs no memh
+ * for it, or if count is at least RMA_DIRECT_MIN and recv_buf
+ * can be registered, in chunks of at most get.max_zcopy.
+ * Otherwise it is got into our window first, in chunks of
+ * at most the window size, and copied out.
+ */
+void tangram_ucx_rma_get(tangram_uct_addr_t* dest, void* region, size_t ptr, size_t count, void* recv_buf) {
+    rma_stream_t* stream = rma_stream_acquire();
+    tangram_uct_context_t* context = &stream->context;
+    rma_window_t* window = &stream->window;
+
+    rma_peer_t* peer = rma_connect(stream, dest);
+
+    uint64_t mem_addr;
+    memcpy(&mem_addr, region, sizeof(uint64_t));
+    uct_rkey_bundle_t rkey;
+    ucs_status_t status = uct_rkey_unpack(context->component, region+sizeof(uint64_t), &rkey);
+    tangram_assert(status == UCS_OK);
+
+    uct_mem_h memh = UCT_MEM_HANDLE_NULL;
+    bool direct, registered = false;
+    if(!(context->md_attr.cap.flags & UCT_MD_FLAG_NEED_MEMH)) {
+        direct = true;
+    } else {
+        registered = count >= RMA_DIRECT_MIN &&
+                     (context->md_attr.cap.flags & UCT_MD_FLAG_REG) &&
+                     uct_md_mem_reg(context->md, recv_buf, count, UCT_MD_MEM_ACCESS_RMA, &memh) == UCS_OK;
+        direct = registered;
+    }
+
+    size_t chunk = context->iface_attr.cap.get.max_zcopy;
+    if(!direct && chunk > window->size)
+        chunk = window->size;
+
+    size_t done = 0;
+    while(done < count) {
+        size_t n = (count - done) < chunk ? (count - done) : chunk;
+        if(direct) {
+            do_get_zcopy(peer->rma_ep, context, mem_addr+ptr+done, rkey.rkey, recv_buf+done, memh, n);
+        } else {
+            do_get_zcopy(peer->rma_ep, context, mem_addr+ptr+done, rkey.rkey, window->mem.address, window->memh, n);
+            memcpy(recv_buf+done, window->mem.address, n);
+        }
+        done += n;
+    }
+
+    if(registered)
+        uct_md_mem_dereg(context->md, memh);
+    uct_rkey_release(context->component, &rkey);
+    rma_stream_release(stream);
+}
+
+static void rma_window_init(rma_window_t* window, tangram_uct_context_t* context, size_t size) {
+    ucs_status_t status;
+
+    uct_mem_alloc_params_t params;
+    params.field_mask = UCT_MEM_ALLOC_PARAM_FIELD_ADDRESS  |
+                        UCT_MEM_ALLOC_PARAM_FIELD_MEM_TYPE;
+    params.address    = NULL;
+    params.mem_type   = UCS_MEMORY_TYPE_HOST;
+    // TODO which one is the best?
+    uct_alloc_method_t methods[] = {UCT_ALLOC_METHOD_MD, UCT_ALLOC_METHOD_HEAP};
+    status = uct_mem_alloc(size, methods, 2, &params, &window->mem);
+    tangram_assert(window->mem.address && status == UCS_OK);
+
+    if(window->mem.method != UCT_ALLOC_METHOD_MD)
+        uct_md_mem_reg(context->md, window->mem.address, window->mem.length, UCT_MD_MEM_ACCESS_RMA, &window->memh);
+    else
+        window->memh = window->mem.memh;
+
+    window->size     = size;
+    window->rkey_len = context->md_attr.rkey_packed_size;
+    window->rkey     = malloc(window->rkey_len);
+    uct_md_mkey_pack(context->md, window->memh, window->rkey);
+}
+
+static void rma_window_finalize(rma_window_t* window, tangram_uct_context_t* context) {
+    if(window->mem.method != UCT_ALLOC_METHOD_MD)
+        uct_md_mem_dereg(context->md, window->memh);
+    uct_mem_free(&window->mem);
+    free(window->rkey);
 }
 
 
 void* rma_ingoing_progress_loop(void* arg) {
-    while(g_rma_running) {
-        pthread_mutex_lock(&g_ingoing_context.mutex);
-        uct_worker_progress(g_ingoing_context.worker);
-        pthread_mutex_unlock(&g_ingoing_context.mutex);
+    // Finish the puts in flight before exit
+    while(g_rma_running || g_num_xfers > 0) {
+        // Do not block while puts are in flight,
+        // their completions may not wake us up.
+        if(g_num_xfers > 0) {
+            pthread_mutex_lock(&g_ingoing_context.mutex);
+            uct_worker_progress(g_ingoing_context.worker);
+            pthread_mutex_unlock(&g_ingoing_context.mutex);
+        } else {
+            tangram_uct_progress(&g_ingoing_progress);
+        }
 
         // We have a new RMA request we need to handle
         while(g_rma_reqs != NULL) {
             tangram_rma_req_t* req = g_rma_reqs;
-            rma_respond(req);
+            if(req->id == AM_ID_RMA_CONNECT)
+                rma_accept(req);
+            else
+                rma_respond(req);
 
             DL_DELETE(g_rma_reqs, req);
             rma_req_free(req);
             free(req);
         }
+
+        rma_xfers_finish();
     }
     return NULL;
 }
@@ -451,16 +819,31 @@ void tangram_ucx_rma_service_start(tfs_info_t* tfs_info, void* (serve_rma_data_c
     ucs_status_t status;
     ucs_async_context_create(UCS_ASYNC_MODE_THREAD_SPINLOCK, &g_rma_async);
 
-    tangram_uct_context_init(g_rma_async, gg_tfs_info, false, &g_outgoing_context);
     tangram_uct_context_init(g_rma_async, gg_tfs_info, false, &g_ingoing_context);
+    g_ingoing_peers = NULL;
+    g_num_xfers     = 0;
+    g_done_xfers    = NULL;
 
     // Listen for incoming RMA request
+    uct_iface_set_am_handler(g_ingoing_context.iface, AM_ID_RMA_CONNECT, am_rma_connect_listener, NULL, 0);
     uct_iface_set_am_handler(g_ingoing_context.iface, AM_ID_RMA_REQUEST, am_rma_request_listener, NULL, 0);
-    uct_iface_set_am_handler(g_ingoing_context.iface, AM_ID_RMA_RESPOND_ACK, am_rma_respond_ack_listener, NULL, 0);
 
-    // Send out RMA request and wait for dest client's ep addr and rma respond
-    uct_iface_set_am_handler(g_outgoing_context.iface, AM_ID_RMA_EP_ADDR, am_ep_addr_listener, NULL, 0);
-    uct_iface_set_am_handler(g_outgoing_context.iface, AM_ID_RMA_RESPOND, am_rma_respond_listener, NULL, 0);
+    g_num_streams = tfs_info->rma_streams;
+    g_next_stream = 0;
+    g_streams     = calloc(g_num_streams, sizeof(rma_stream_t));
+    for(int i = 0; i < g_num_streams; i++) {
+        rma_stream_t* stream = &g_streams[i];
+        tangram_uct_context_init(g_rma_async, gg_tfs_info, false, &stream->context);
+        rma_window_init(&stream->window, &stream->context, tfs_info->rma_window_size);
+        stream->peers = NULL;
+
+        // Send out RMA request and wait for dest client's ep addr and rma respond
+        uct_iface_set_am_handler(stream->context.iface, AM_ID_RMA_EP_ADDR, am_ep_addr_listener, &stream->context, 0);
+        uct_iface_set_am_handler(stream->context.iface, AM_ID_RMA_RESPOND, am_rma_respond_listener, &stream->context, 0);
+    }
+
+    tangram_uct_context_t* contexts[] = {&g_ingoing_context};
+    tangram_uct_progress_init(&g_ingoing_progress, contexts, 1, tfs_info);
 
     g_rma_running = true;
     pthread_create(&g_rma_progress_thread, NULL, rma_ingoing_progress_loop, NULL);
@@ -468,9 +851,19 @@ void tangram_ucx_rma_service_start(tfs_info_t* tfs_info, void* (serve_rma_data_c
 
 void tangram_ucx_rma_service_stop() {
     g_rma_running = false;
+    tangram_uct_progress_wakeup(&g_ingoing_progress);
     pthread_join(g_rma_progress_thread, NULL);
+    tangram_uct_progress_destroy(&g_ingoing_progress);
+
+    for(int i = 0; i < g_num_streams; i++) {
+        rma_stream_t* stream = &g_streams[i];
+        rma_peers_destroy(&stream->peers, &stream->context, false);
+        rma_window_finalize(&stream->window, &stream->context);
+        tangram_uct_context_destroy(&stream->context);
+    }
+    free(g_streams);
 
-    tangram_uct_context_destroy(&g_outgoing_context);
+    rma_peers_destroy(&g_ingoing_peers, &g_ingoing_context, true);
     tangram_uct_context_destroy(&g_ingoing_context);
     ucs_async_context_destroy(g_rma_async);
 }
@@ -4,6 +4,7 @@
 
 // RMA
 typedef struct tangram_rma_req {
+    uint8_t  id;                // AM_ID_RMA_CONNECT or AM_ID_RMA_REQUEST
     tangram_uct_addr_t src;
 
     void*    ep_addr;
@@ -28,6 +29,31 @@ void tangram_ucx_rma_service_start(tfs_info_t *tfs_info, void* (*serve_rma_data_
 void tangram_ucx_rma_service_stop();
 void tangram_ucx_rma_request(tangram_uct_addr_t* addr, void* user_arg, size_t user_arg_size, void* recv_buf, size_t recv_size);
 
+// Max bytes one RMA request can receive
+size_t tangram_ucx_rma_window_size();
+// Bytes a RMA request adds to the user argument
+size_t tangram_ucx_rma_request_overhead();
+
+/**
+ * Memory registered for peers to read with one-sided get.
+ *
+ * region is what peers need to access it:
+ *   mem_addr | rkey
+ *   uint64_t | rkey_packed_size bytes
+ */
+typedef struct tangram_rma_mem {
+    uct_mem_h memh;
+    void*     region;
+    size_t    region_len;
+} tangram_rma_mem_t;
+
+tangram_rma_mem_t* tangram_ucx_rma_mem_reg(void* addr, size_t len);
+void tangram_ucx_rma_mem_dereg(tangram_rma_mem_t* mem);
+bool tangram_ucx_rma_get_supported();
+
+// Read [ptr, ptr+count) of a region registered by dest into recv_buf
+void tangram_ucx_rma_get(tangram_uct_addr_t* dest, void* region, size_t ptr, size_t count, void* recv_buf);
+
 
 tangram_uct_addr_t* tangram_ucx_rma_addr();
 
@@ -5,8 +5,11 @@
 #include <unistd.h>
 #include <pthread.h>
 #include "utlist.h"
+#include "uthash.h"
+#include "tangramfs-rpc.h"
 #include "tangramfs-ucx-server.h"
 #include "tangramfs-ucx-taskmgr.h"
+#include "tangramfs-ucx-epcache.h"
 
 static tfs_info_t*           g_tfs_info;
 static taskmgr_t             g_taskmgr;
@@ -14,47 +17,87 @@ static taskmgr_t             g_taskmgr;
 volatile static bool         g_server_running = true;
 static ucs_async_context_t*  g_server_async;
 static tangram_uct_context_t g_server_context;
+static tangram_uct_progress_t g_progress;
 
+// Endpoints to clients, for sending responds
+static tangram_ep_cache_t    g_ep_cache;
 
-void* (*server_am_handler)(int8_t, tangram_uct_addr_t* client, void* data, uint8_t* respond_id, size_t *respond_len);
+/*
+ * Registered clients (and delegators). Ids start from 1 and are
+ * never reused, entries live until the server stops, so addresses
+ * resolved from them stay valid.
+ */
+typedef struct client_entry {
+    void*              key;         // serialized addr
+    size_t             key_len;
+    tangram_uct_addr_t addr;
+    UT_hash_handle     hh;
+} client_entry_t;
 
+static pthread_rwlock_t      g_clients_lock = PTHREAD_RWLOCK_INITIALIZER;
+static client_entry_t*       g_clients_table;       // by address
+static client_entry_t**      g_clients;             // by id
+static uint32_t              g_num_clients;
+
+
+void* (*server_am_handler)(int8_t, tangram_uct_addr_t* client, uint64_t seq_id, void* data, uint8_t* respond_id, size_t *respond_len);
+
+// Tasks keep the AM descriptors if UCT allows, they are
+// released by the workers once the tasks are done.
 static ucs_status_t am_query_listener(void *arg, void *buf, size_t buf_len, unsigned flags) {
-    // TODO can directly use the data and return UCS_INPROGRESS
-    // then free it later.
-    taskmgr_append_task(&g_taskmgr, AM_ID_QUERY_REQUEST, buf, buf_len);
-    return UCS_OK;
+    return taskmgr_append_task(&g_taskmgr, AM_ID_QUERY_REQUEST, buf, buf_len, flags, &g_server_context.mutex);
 }
 static ucs_status_t am_post_listener(void *arg, void *buf, size_t buf_len, unsigned flags) {
-    taskmgr_append_task(&g_taskmgr, AM_ID_POST_REQUEST, buf, buf_len);
-    return UCS_OK;
+    return taskmgr_append_task(&g_taskmgr, AM_ID_POST_REQUEST, buf, buf_len, flags, &g_server_context.mutex);
 }
 static ucs_status_t am_unpost_file_listener(void *arg, void *buf, size_t buf_len, unsigned flags) {
-    taskmgr_append_task(&g_taskmgr, AM_ID_UNPOST_FILE_REQUEST, buf, buf_len);
-    return UCS_OK;
+    return taskmgr_append_task(&g_taskmgr, AM_ID_UNPOST_FILE_REQUEST, buf, buf_len, flags, &g_server_context.mutex);
 }
 static ucs_status_t am_unpost_client_listener(void *arg, void *buf, size_t buf_len, unsigned flags) {
-    taskmgr_append_task(&g_taskmgr, AM_ID_UNPOST_CLIENT_REQUEST, buf, buf_len);
-    return UCS_OK;
+    return taskmgr_append_task(&g_taskmgr, AM_ID_UNPOST_CLIENT_REQUEST, buf, buf_len, flags, &g_server_context.mutex);
 }
 static ucs_status_t am_stat_listener(void *arg, void *buf, size_t buf_len, unsigned flags) {
-    taskmgr_append_task(&g_taskmgr, AM_ID_STAT_REQUEST, buf, buf_len);
-    return UCS_OK;
+    return taskmgr_append_task(&g_taskmgr, AM_ID_STAT_REQUEST, buf, buf_len, flags, &g_server_context.mutex);
+}
+/**
+ * Lock tasks are hashed by filename onto the workers. Tasks of
+ * one file are handled in the order they arrive, by one worker,
+ * and different files are locked in parallel.
+ */
+static unsigned lock_task_key(void* buf, size_t buf_len) {
+    size_t data_len;
+    void* data = peek_rpc_buffer(buf, buf_len, &data_len);
+
+    int filename_len;
+    char* filename = rpc_in_peek_filename(data, &filename_len);
+
+    unsigned hashv;
+    HASH_VALUE(filename, filename_len, hashv);
+    return hashv;
 }
+
 static ucs_status_t am_acquire_lock_listener(void *arg, void *buf, size_t buf_len, unsigned flags) {
-    taskmgr_append_task_to_worker(&g_taskmgr, AM_ID_ACQUIRE_LOCK_REQUEST, buf, buf_len, 0);
-    return UCS_OK;
+    return taskmgr_append_task_by_key(&g_taskmgr, AM_ID_ACQUIRE_LOCK_REQUEST, buf, buf_len, flags, &g_server_context.mutex, lock_task_key(buf, buf_len));
 }
 static ucs_status_t am_release_lock_listener(void *arg, void *buf, size_t buf_len, unsigned flags) {
-    taskmgr_append_task_to_worker(&g_taskmgr, AM_ID_RELEASE_LOCK_REQUEST, buf, buf_len, 0);
-    return UCS_OK;
+    return taskmgr_append_task_by_key(&g_taskmgr, AM_ID_RELEASE_LOCK_REQUEST, buf, buf_len, flags, &g_server_context.mutex, lock_task_key(buf, buf_len));
 }
 static ucs_status_t am_release_lock_file_listener(void *arg, void *buf, size_t buf_len, unsigned flags) {
-    taskmgr_append_task_to_worker(&g_taskmgr, AM_ID_RELEASE_LOCK_FILE_REQUEST, buf, buf_len, 0);
-    return UCS_OK;
+    return taskmgr_append_task_by_key(&g_taskmgr, AM_ID_RELEASE_LOCK_FILE_REQUEST, buf, buf_len, flags, &g_server_context.mutex, lock_task_key(buf, buf_len));
 }
+// Touches all files, any worker can handle it
 static ucs_status_t am_release_lock_client_listener(void *arg, void *buf, size_t buf_len, unsigned flags) {
-    taskmgr_append_task_to_worker(&g_taskmgr, AM_ID_RELEASE_LOCK_CLIENT_REQUEST, buf, buf_len, 0);
-    return UCS_OK;
+    return taskmgr_append_task(&g_taskmgr, AM_ID_RELEASE_LOCK_CLIENT_REQUEST, buf, buf_len, flags, &g_server_context.mutex);
+}
+
+// Acks of our revocation callbacks carry the filename, so
+// they go to the same worker as other requests of the file
+static ucs_status_t am_revoke_lock_respond_listener(void *arg, void *buf, size_t buf_len, unsigned flags) {
+    return taskmgr_append_task_by_key(&g_taskmgr, AM_ID_REVOKE_LOCK_RESPOND, buf, buf_len, flags, &g_server_context.mutex, lock_task_key(buf, buf_len));
+}
+
+static ucs_status_t am_register_listener(void *arg, void *buf, size_t buf_len, unsigned flags) {
+    return taskmgr_append_task(&g_taskmgr, AM_ID_REGISTER_REQUEST, buf, buf_len, flags, &g_server_context.mutex);
 }
 
 static ucs_status_t am_stop_listener(void *arg, void *buf, size_t buf_len, unsigned flags) {
@@ -64,18 +107,90 @@ static ucs_status_t am_stop_listener(void *arg, void *buf, size_t buf_len, unsig
     return UCS_OK;
 }
 
+// Return the id of the client, registering
+// it again gives the same id
+static uint32_t client_register(tangram_uct_addr_t* addr) {
+    size_t key_len;
+    void* key = tangram_uct_addr_serialize(addr, &key_len);
+
+    client_entry_t* entry = NULL;
+    pthread_rwlock_wrlock(&g_clients_lock);
+    HASH_FIND(hh, g_clients_table, key, key_len, entry);
+    if(entry) {
+        free(key);
+    } else {
+        tangram_uct_addr_t* copy = tangram_uct_addr_duplicate(addr);
+        entry = malloc(sizeof(client_entry_t));
+        entry->key     = key;
+        entry->key_len = key_len;
+        entry->addr    = *copy;
+        entry->addr.id = ++g_num_clients;
+        free(copy);
+
+        g_clients = realloc(g_clients, sizeof(client_entry_t*) * (g_num_clients+1));
+        g_clients[g_num_clients] = entry;
+        HASH_ADD_KEYPTR(hh, g_clients_table, entry->key, entry->key_len, entry);
+    }
+    uint32_t id = entry->addr.id;
+    pthread_rwlock_unlock(&g_clients_lock);
+    return id;
+}
+
+tangram_uct_addr_t* tangram_ucx_server_client_addr(uint32_t id) {
+    pthread_rwlock_rdlock(&g_clients_lock);
+    tangram_assert(id > 0 && id <= g_num_clients);
+    tangram_uct_addr_t* addr = &g_clients[id]->addr;
+    pthread_rwlock_unlock(&g_clients_lock);
+    return addr;
+}
+
+// Fill in the address of a compact sender, nothing is copied
+static void client_resolve(tangram_uct_addr_t* addr) {
+    *addr = *tangram_ucx_server_client_addr(addr->id);
+}
+
+static void clients_destroy() {
+    client_entry_t *entry, *tmp;
+    HASH_ITER(hh, g_clients_table, entry, tmp) {
+        HASH_DEL(g_clients_table, entry);
+        free(entry->addr.dev);
+        free(entry->addr.iface);
+        free(entry->key);
+        free(entry);
+    }
+    free(g_clients);
+    g_clients = NULL;
+    g_num_clients = 0;
+}
+
 void server_handle_task(task_t* task) {
-    pthread_mutex_lock(&g_server_context.mutex);
-    uct_ep_h ep;
-    uct_ep_create_connect(g_server_context.iface, &task->client, &ep);
-    pthread_mutex_unlock(&g_server_context.mutex);
+    if(task->client.id != 0)
+        client_resolve(&task->client);
+
+    if(task->id == AM_ID_REGISTER_REQUEST) {
+        uint32_t id = client_register(&task->client);
+        tangram_ucx_server_send(AM_ID_REGISTER_RESPOND, &task->client, task->seq_id, &id, sizeof(uint32_t));
+        return;
+    }
+
+    task->respond = (*server_am_handler)(task->id, &task->client, task->seq_id, task->data, &task->id, &task->respond_len);
+
+    // NULL respond: nothing to send, or it will
+    // be sent later with tangram_ucx_server_send()
+    if(task->respond == NULL)
+        return;
 
-    task->respond = (*server_am_handler)(task->id, &task->client, task->data, &task->id, &task->respond_len);
-    do_uct_am_short_lock(&g_server_context.mutex, ep, task->id, task->seq_id, &g_server_context.self_addr, task->respond, task->respond_len);
+    tangram_ucx_server_send(task->id, &task->client, task->seq_id, task->respond, task->respond_len);
+}
 
-    pthread_mutex_lock(&g_server_context.mutex);
-    uct_ep_destroy(ep);
-    pthread_mutex_unlock(&g_server_context.mutex);
+/**
+ * Send an AM without waiting for anything, used for
+ * deferred responds (e.g., lock grants) and callbacks.
+ */
+void tangram_ucx_server_send(uint8_t id, tangram_uct_addr_t* dest, uint64_t seq_id, void* data, size_t length) {
+    tangram_ep_entry_t* entry = tangram_ep_cache_acquire(&g_ep_cache, dest);
+    do_uct_am_short_lock(&g_server_context, entry->ep, id, seq_id, &g_server_context.self_addr, data, length);
+    tangram_ep_cache_release(&g_ep_cache, entry);
 }
 
 void tangram_ucx_server_init(tfs_info_t *tfs_info) {
@@ -85,6 +200,7 @@ void tangram_ucx_server_init(tfs_info_t *tfs_info) {
     ucs_async_context_create(UCS_ASYNC_MODE_THREAD_SPINLOCK, &g_server_async);
 
     tangram_uct_context_init(g_server_async, tfs_info, false, &g_server_context);
+    tangram_ep_cache_init(&g_ep_cache, &g_server_context, tfs_info->ep_cache_size);
 
     uct_iface_set_am_handler(g_server_context.iface, AM_ID_QUERY_REQUEST, am_query_listener, NULL, 0);
     uct_iface_set_am_handler(g_server_context.iface, AM_ID_POST_REQUEST, am_post_listener, NULL, 0);
@@ -95,22 +211,24 @@ void tangram_ucx_server_init(tfs_info_t *tfs_info) {
     uct_iface_set_am_handler(g_server_context.iface, AM_ID_RELEASE_LOCK_REQUEST, am_release_lock_listener, NULL, 0);
     uct_iface_set_am_handler(g_server_context.iface, AM_ID_RELEASE_LOCK_FILE_REQUEST, am_release_lock_file_listener, NULL, 0);
     uct_iface_set_am_handler(g_server_context.iface, AM_ID_RELEASE_LOCK_CLIENT_REQUEST, am_release_lock_client_listener, NULL, 0);
+    uct_iface_set_am_handler(g_server_context.iface, AM_ID_REVOKE_LOCK_RESPOND, am_revoke_lock_respond_listener, NULL, 0);
+    uct_iface_set_am_handler(g_server_context.iface, AM_ID_REGISTER_REQUEST, am_register_listener, NULL, 0);
     uct_iface_set_am_handler(g_server_context.iface, AM_ID_STOP_REQUEST, am_stop_listener, NULL, 0);
 
+    tangram_uct_context_t* contexts[] = {&g_server_context};
+    tangram_uct_progress_init(&g_progress, contexts, 1, tfs_info);
+
     taskmgr_init(&g_taskmgr, 8, server_handle_task);
 }
 
-void tangram_ucx_server_register_rpc(void* (*user_handler)(int8_t, tangram_uct_addr_t*, void*, uint8_t*, size_t*)) {
+void tangram_ucx_server_register_rpc(void* (*user_handler)(int8_t, tangram_uct_addr_t*, uint64_t, void*, uint8_t*, size_t*)) {
     server_am_handler = user_handler;
 }
 
 
 void tangram_ucx_server_start() {
-    while(g_server_running) {
-        pthread_mutex_lock(&g_server_context.mutex);
-        uct_worker_progress(g_server_context.worker);
-        pthread_mutex_unlock(&g_server_context.mutex);
-    }
+    while(g_server_running)
+        tangram_uct_progress(&g_progress);
 }
 
 void tangram_ucx_server_stop() {
@@ -122,6 +240,16 @@ void tangram_ucx_server_stop() {
 
     // Server stopped, clean up now
     taskmgr_finalize(&g_taskmgr);
+
+    if(g_tfs_info->debug) {
+        uint64_t hits, misses, evictions;
+        tangram_ep_cache_stats(&g_ep_cache, &hits, &misses, &evictions);
+        printf("[tangramfs server] ep cache hits: %lu, misses: %lu, evictions: %lu\n", hits, misses, evictions);
+        printf("[tangramfs server] progress sleeps: %lu\n", g_progress.num_sleeps);
+    }
+    tangram_uct_progress_destroy(&g_progress);
+    tangram_ep_cache_destroy(&g_ep_cache);
+    clients_destroy();
     tangram_uct_context_destroy(&g_server_context);
     ucs_async_context_destroy(g_server_async);
 }
@@ -129,3 +257,7 @@ void tangram_ucx_server_stop() {
 tangram_uct_addr_t* tangram_ucx_server_addr() {
     return &g_server_context.self_addr;
 }
+
+size_t tangram_ucx_server_am_short_max_size() {
+    return g_server_context.iface_attr.cap.am.max_short;
+}
@@ -4,9 +4,17 @@
 
 // Server
 void tangram_ucx_server_init(tfs_info_t* tfs_info);
-void tangram_ucx_server_register_rpc(void* (*user_handler)(int8_t, tangram_uct_addr_t*, void*, uint8_t*, size_t*));
+// The handler returns the respond, or NULL if there is nothing
+// to send back now, e.g., the respond is deferred
+void tangram_ucx_server_register_rpc(void* (*user_handler)(int8_t, tangram_uct_addr_t*, uint64_t, void*, uint8_t*, size_t*));
 void tangram_ucx_server_start();
 void tangram_ucx_server_stop();
+void tangram_ucx_server_send(uint8_t id, tangram_uct_addr_t* dest, uint64_t seq_id, void* data, size_t length);
 tangram_uct_addr_t* tangram_ucx_server_addr();
+// Address of a registered client, owned by the registry.
+// Lock and metadata tables keep client ids, and only resolve
+// them when they need to reach the client.
+tangram_uct_addr_t* tangram_ucx_server_client_addr(uint32_t id);
+size_t tangram_ucx_server_am_short_max_size();
 
 #endif
@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
 #include "utlist.h"
 #include "tangramfs-ucx-taskmgr.h"
 
@@ -11,98 +12,298 @@ void (*task_handle_cb)(task_t* task);
 
 
 /*
- * uint64_t is the header in am_short();
- * We do not use it for now.
+ * uint64_t is the header in am_short(), i.e., the seq_id.
+ *
+ * The sender address and the data are parsed in place, no
+ * copy is made if we are allowed to keep the descriptor.
  */
-task_t* create_task(uint8_t id, void* buf, size_t buf_len) {
+task_t* create_task(uint8_t id, void* buf, size_t buf_len, unsigned flags, pthread_mutex_t* desc_lock) {
     task_t *task      = malloc(sizeof(task_t));
     task->id          = id;
     task->respond     = NULL;
     task->respond_len = 0;
-    task->data        = NULL;
-    unpack_rpc_buffer(buf, buf_len, &task->seq_id, &task->client, &task->data);
+
+    if((flags & UCT_CB_PARAM_FLAG_DESC) && desc_lock != NULL) {
+        task->buf       = buf;
+        task->desc_lock = desc_lock;
+    } else {
+        task->buf       = malloc(buf_len);
+        task->desc_lock = NULL;
+        memcpy(task->buf, buf, buf_len);
+    }
+
+    view_rpc_buffer(task->buf, buf_len, &task->seq_id, &task->client, &task->data);
     return task;
 }
 
+static void ring_init(task_ring_t* ring) {
+    ring->slots = malloc(sizeof(task_slot_t) * TASKMGR_RING_SIZE);
+    for(uint64_t i = 0; i < TASKMGR_RING_SIZE; i++)
+        ring->slots[i].seq = i;
+    ring->head = 0;
+    ring->tail = 0;
+}
+
+/*
+ * Slot i is free for the writer at position pos if its seq is pos,
+ * and ready for the reader at position pos if its seq is pos+1.
+ * Writers and readers claim a position with a CAS on head/tail.
+ * Return false if the ring is full.
+ */
+static bool ring_push(task_ring_t* ring, task_t* task) {
+    task_slot_t* slot;
+    uint64_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    while(true) {
+        slot = &ring->slots[pos & (TASKMGR_RING_SIZE-1)];
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)seq - (int64_t)pos;
+        if(diff == 0) {
+            if(__atomic_compare_exchange_n(&ring->head, &pos, pos+1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if(diff < 0) {
+            return false;
+        } else {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+    slot->task = task;
+    __atomic_store_n(&slot->seq, pos+1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Return NULL if the ring is empty
+static task_t* ring_pop(task_ring_t* ring) {
+    task_slot_t* slot;
+    uint64_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    while(true) {
+        slot = &ring->slots[pos & (TASKMGR_RING_SIZE-1)];
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)seq - (int64_t)(pos+1);
+        if(diff == 0) {
+            if(__atomic_compare_exchange_n(&ring->tail, &pos, pos+1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if(diff < 0) {
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+    task_t* task = slot->task;
+    __atomic_store_n(&slot->seq, pos+TASKMGR_RING_SIZE, __ATOMIC_RELEASE);
+    return task;
+}
+
+static bool ring_empty(task_ring_t* ring) {
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+static void wake_worker(worker_t* worker) {
+    pthread_mutex_lock(&worker->lock);
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+/*
+ * Wakeups are batched: a sleeping worker is only woken if
+ * no one is awake to pick up the task. The fence pairs with
+ * the one in worker_park(), so either the worker sees the new
+ * task before sleeping, or we see it sleeping.
+ */
+static void notify(taskmgr_t* mgr, worker_t* target, bool shared) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if(__atomic_load_n(&target->sleeping, __ATOMIC_RELAXED)) {
+        wake_worker(target);
+        return;
+    }
+
+    // Someone else can steal it
+    if(shared && __atomic_load_n(&mgr->spinning, __ATOMIC_RELAXED) == 0) {
+        for(int i = 0; i < mgr->num_workers; i++) {
+            if(__atomic_load_n(&mgr->workers[i].sleeping, __ATOMIC_RELAXED)) {
+                wake_worker(&mgr->workers[i]);
+                return;
+            }
+        }
+    }
+}
+
+static void push_pinned(worker_t* worker, task_t* task) {
+    // Once tasks overflow, later ones must queue behind them
+    if(__atomic_load_n(&worker->num_overflow, __ATOMIC_ACQUIRE) > 0 || !ring_push(&worker->pinned, task)) {
+        pthread_mutex_lock(&worker->lock);
+        DL_APPEND(worker->overflow, task);
+        __atomic_add_fetch(&worker->num_overflow, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&worker->lock);
+    }
+}
+
 /**
- * Append a task into one worker's task queue,
+ * Append a task into one worker's pinned queue,
  * then notify that worker.
  *
- * workers[who].lock is used to protect the task list.
- *
- * Sync-based implementation only uses append_task() call
- * which uses a round-robin mannter to assign tasks to workers
+ * Sync-based implementation only uses append_task() call,
+ * those tasks can be handled by any worker.
  *
  * For lock-based implementation, we provide this
- * append_task_to_woker() call to allow
- * specifying a single worker to handle all lock related tasks.
- * This guarantees no concurrent lock related tasks are processed
- * at the same time. This is necessary for correctness.
+ * append_task_to_woker() call to allow specifying
+ * the worker, see also append_task_by_key().
+ * Tasks assigned to a worker are handled by that
+ * worker in the order they are appended.
  */
-void taskmgr_append_task_to_worker(taskmgr_t* mgr, uint8_t id, void* buf, size_t buf_len, int tid) {
+ucs_status_t taskmgr_append_task_to_worker(taskmgr_t* mgr, uint8_t id, void* buf, size_t buf_len, unsigned flags, pthread_mutex_t* desc_lock, int tid) {
+    task_t* task = create_task(id, buf, buf_len, flags, desc_lock);
+    // The task may be done and freed as soon as it is pushed
+    ucs_status_t status = task->desc_lock ? UCS_INPROGRESS : UCS_OK;
 
-    task_t* task = create_task(id, buf, buf_len);
-    worker_t* worker = &(mgr->workers[tid]);
+    worker_t* worker = &mgr->workers[tid];
+    push_pinned(worker, task);
+    notify(mgr, worker, false);
+    return status;
+}
 
-    pthread_mutex_lock(&mgr->workers[tid].lock);
-    DL_APPEND(mgr->workers[tid].tasks, task);
-    pthread_cond_signal(&mgr->workers[tid].cond);
-    pthread_mutex_unlock(&mgr->workers[tid].lock);
+/*
+ * Tasks are spread round-robin over the shared rings,
+ * idle workers steal them, so a slow task does not hold
+ * back the ones queued behind it.
+ */
+ucs_status_t taskmgr_append_task(taskmgr_t* mgr, uint8_t id, void* buf, size_t buf_len, unsigned flags, pthread_mutex_t* desc_lock) {
+    task_t* task = create_task(id, buf, buf_len, flags, desc_lock);
+    ucs_status_t status = task->desc_lock ? UCS_INPROGRESS : UCS_OK;
+    unsigned who = __atomic_fetch_add(&mgr->who, 1, __ATOMIC_RELAXED);
+
+    for(int i = 0; i < mgr->num_workers; i++) {
+        worker_t* worker = &mgr->workers[(who+i) % mgr->num_workers];
+        if(ring_push(&worker->shared, task)) {
+            notify(mgr, worker, true);
+            return status;
+        }
+    }
+
+    // All shared rings are full
+    worker_t* worker = &mgr->workers[who % mgr->num_workers];
+    push_pinned(worker, task);
+    notify(mgr, worker, false);
+    return status;
 }
 
-void taskmgr_append_task(taskmgr_t* mgr, uint8_t id, void* buf, size_t buf_len) {
-    taskmgr_append_task_to_worker(mgr, id, buf, buf_len, mgr->who);
-    mgr->who = (mgr->who + 1) % mgr->num_workers;
+/**
+ * Lock related tasks of one file must be handled in order,
+ * hashing them by filename keeps them on one worker while
+ * tasks of different files are handled in parallel.
+ */
+ucs_status_t taskmgr_append_task_by_key(taskmgr_t* mgr, uint8_t id, void* buf, size_t buf_len, unsigned flags, pthread_mutex_t* desc_lock, unsigned key) {
+    return taskmgr_append_task_to_worker(mgr, id, buf, buf_len, flags, desc_lock, key % mgr->num_workers);
 }
 
 void free_task(task_t* task) {
-    if(task->data)
-        free(task->data);
-
     // TODO if task->respond is tangram_uct_addr_t*, then we did not release all its memory space.
     //if(task->respond)
     //    free(task->respond);
 
-    tangram_uct_addr_free(&task->client);
+    // data and client point into the buffer
+    if(task->desc_lock) {
+        pthread_mutex_lock(task->desc_lock);
+        uct_iface_release_desc(task->buf);
+        pthread_mutex_unlock(task->desc_lock);
+    } else {
+        free(task->buf);
+    }
     free(task);
 }
 
+static task_t* pop_overflow(worker_t* me) {
+    if(__atomic_load_n(&me->num_overflow, __ATOMIC_ACQUIRE) == 0)
+        return NULL;
+
+    pthread_mutex_lock(&me->lock);
+    task_t* task = me->overflow;
+    if(task) {
+        DL_DELETE(me->overflow, task);
+        __atomic_sub_fetch(&me->num_overflow, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&me->lock);
+    return task;
+}
+
+/*
+ * Pinned tasks first, they were appended before
+ * the overflow ones. Then our own shared tasks,
+ * then steal from the others.
+ */
+static task_t* next_task(worker_t* me) {
+    task_t* task = ring_pop(&me->pinned);
+    if(task == NULL)
+        task = pop_overflow(me);
+    if(task == NULL)
+        task = ring_pop(&me->shared);
+
+    taskmgr_t* mgr = me->mgr;
+    for(int i = 1; task == NULL && i < mgr->num_workers; i++)
+        task = ring_pop(&mgr->workers[(me->tid+i) % mgr->num_workers].shared);
+    return task;
+}
+
+static bool has_task(worker_t* me) {
+    if(!ring_empty(&me->pinned) || __atomic_load_n(&me->num_overflow, __ATOMIC_ACQUIRE) > 0)
+        return true;
+    for(int i = 0; i < me->mgr->num_workers; i++) {
+        if(!ring_empty(&me->mgr->workers[i].shared))
+            return true;
+    }
+    return false;
+}
+
+static void worker_park(worker_t* me) {
+    pthread_mutex_lock(&me->lock);
+    __atomic_store_n(&me->sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    // Check again, in case a task came in after we looked
+    if(me->running && !has_task(me))
+        pthread_cond_wait(&me->cond, &me->lock);
+
+    __atomic_store_n(&me->sleeping, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&me->lock);
+}
+
 void* worker_func(void* arg) {
 
     worker_t *me = (worker_t*) arg;
+    taskmgr_t *mgr = me->mgr;
 
-    while(me->running) {
+    while(__atomic_load_n(&me->running, __ATOMIC_ACQUIRE)) {
 
-        pthread_mutex_lock(&me->lock);
-
-        // If no task available, go to sleep
-        // Delegator will insert a task and wake us up later.
-        if (me->tasks == NULL) {
-            pthread_cond_wait(&me->cond, &me->lock);
+        task_t *task = next_task(me);
+        if(task) {
+            task_handle_cb(task);
+            free_task(task);
+            continue;
         }
 
-        // Possible get the signal because delegator stoped
-        if (!me->running) {
-            pthread_mutex_unlock(&me->lock);
-            break;
+        // Look for a while before going to sleep,
+        // tasks often come in bursts.
+        __atomic_add_fetch(&mgr->spinning, 1, __ATOMIC_RELAXED);
+        for(int i = 0; i < TASKMGR_SPIN_ROUNDS && task == NULL; i++) {
+            sched_yield();
+            task = next_task(me);
         }
+        __atomic_sub_fetch(&mgr->spinning, 1, __ATOMIC_RELAXED);
 
-        // FIFO manner
-        task_t *task = me->tasks;
-        tangram_assert(task != NULL);
-        DL_DELETE(me->tasks, task);
-
-        pthread_mutex_unlock(&me->lock);
+        if(task) {
+            task_handle_cb(task);
+            free_task(task);
+            continue;
+        }
 
-        task_handle_cb(task);
-        free_task(task);
+        // Delegator/server will insert a task and wake us up later.
+        worker_park(me);
     }
 
-    // At this point, we should have handled all tasks.
-    // i.e., mgr->workers[tid].tasks should be empty.
-    //
-    // But it is possible that client stoped the delegator
+    // It is possible that client stoped the delegator
     // before all their requests have been finished.
+    // The leftover tasks are freed by taskmgr_finalize().
+    return NULL;
 }
 
 void taskmgr_init(taskmgr_t* mgr, int num_workers,
@@ -111,29 +312,50 @@ void taskmgr_init(taskmgr_t* mgr, int num_workers,
     task_handle_cb = _task_handle_cb;
 
     mgr->num_workers = num_workers;
+    mgr->who = 0;
+    mgr->spinning = 0;
     mgr->workers = malloc(num_workers * sizeof(worker_t));
 
     for(int i = 0; i < num_workers; i++) {
-        mgr->workers[i].tid = i;
-        mgr->workers[i].tasks = NULL;
-        mgr->workers[i].running = 1;
-        pthread_mutex_init(&mgr->workers[i].lock, NULL);
-        pthread_cond_init(&mgr->workers[i].cond, NULL);
-        pthread_create(&(mgr->workers[i].thread), NULL, worker_func, &mgr->workers[i]);
+        worker_t* worker = &mgr->workers[i];
+        worker->tid = i;
+        worker->running = 1;
+        worker->sleeping = 0;
+        worker->overflow = NULL;
+        worker->num_overflow = 0;
+        worker->mgr = mgr;
+        ring_init(&worker->pinned);
+        ring_init(&worker->shared);
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->cond, NULL);
     }
+
+    // Start them after all are set up, they steal from each other
+    for(int i = 0; i < num_workers; i++)
+        pthread_create(&(mgr->workers[i].thread), NULL, worker_func, &mgr->workers[i]);
 }
 
 void taskmgr_finalize(taskmgr_t* mgr) {
 
     for(int i = 0; i < mgr->num_workers; i++) {
         pthread_mutex_lock(&mgr->workers[i].lock);
-        mgr->workers[i].running = 0;
+        __atomic_store_n(&mgr->workers[i].running, 0, __ATOMIC_RELEASE);
         pthread_cond_signal(&mgr->workers[i].cond);
         pthread_mutex_unlock(&mgr->workers[i].lock);
+    }
+
+    for(int i = 0; i < mgr->num_workers; i++)
         pthread_join(mgr->workers[i].thread, NULL);
 
-        pthread_cond_destroy(&mgr->workers[i].cond);
-        pthread_mutex_destroy(&mgr->workers[i].lock);
+    for(int i = 0; i < mgr->num_workers; i++) {
+        worker_t* worker = &mgr->workers[i];
+        task_t* task;
+        while((task = ring_pop(&worker->pinned)) || (task = pop_overflow(worker)) || (task = ring_pop(&worker->shared)))
+            free_task(task);
+        free(worker->pinned.slots);
+        free(worker->shared.slots);
+        pthread_cond_destroy(&worker->cond);
+        pthread_mutex_destroy(&worker->lock);
     }
 
     free(mgr->workers);
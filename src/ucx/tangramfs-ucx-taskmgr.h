@@ -1,5 +1,6 @@
 #ifndef _TANGRAMFS_UCX_TASKMGR_H_
 #define _TANGRAMFS_UCX_TASKMGR_H_
+#include <stdint.h>
 #include "tangramfs-ucx-comm.h"
 
 /* Represents one RPC request */
@@ -8,34 +9,82 @@ typedef struct _task {
     uint64_t seq_id;                 // seq id from AM header
     void*    respond;
     size_t   respond_len;
-    void*    data;
+    void*    data;                   // points into buf
     struct _task *next, *prev;
-    tangram_uct_addr_t client;
+    tangram_uct_addr_t client;      // points into buf
+
+    void*    buf;                    // the AM, a UCT descriptor or our copy of it
+    pthread_mutex_t* desc_lock;     // lock of the descriptor's context, NULL for a copy
 } task_t;
 
+// Capacity of each task ring, must be a power of two
+#define TASKMGR_RING_SIZE       4096
+// Rounds an idle worker looks for tasks before going to sleep
+#define TASKMGR_SPIN_ROUNDS     64
+
 /*
- * Each worker maintains a FIFO queue of RPC tasks
- * Server will insert tasks worker's queue in a
- * round-robin manner.
+ * Bounded lock-free MPMC ring of tasks, each slot has a
+ * sequence number that tells whether it is ready to be
+ * written or read at a given position.
+ */
+typedef struct _task_slot {
+    uint64_t seq;
+    task_t*  task;
+} task_slot_t;
+
+typedef struct _task_ring {
+    task_slot_t* slots;
+    uint64_t     head __attribute__((aligned(64)));     // next position to write
+    uint64_t     tail __attribute__((aligned(64)));     // next position to read
+} task_ring_t;
+
+/*
+ * Each worker has two rings:
+ *  - `pinned` tasks were assigned to this worker and must be
+ *    handled in order, e.g., lock tasks of a file. Only the
+ *    worker itself takes them. If the ring is full they go
+ *    to the `overflow` list, protected by `lock`, and so do
+ *    all later ones until the list is drained.
+ *  - `shared` tasks can be handled by any worker, idle workers
+ *    steal them from the others.
  */
 typedef struct _worker {
     int             tid;            // thread id
     int             running;
+    int             sleeping;
     pthread_t       thread;
     pthread_mutex_t lock;
     pthread_cond_t  cond;
-    task_t*         tasks;
+    task_ring_t     pinned;
+    task_ring_t     shared;
+    task_t*         overflow;
+    int             num_overflow;
+    struct _taskmgr* mgr;
 } worker_t;
 
 typedef struct _taskmgr {
     int num_workers;
-    int who;
+    unsigned who;
+    int spinning;                   // number of workers looking for tasks
     worker_t *workers;
 } taskmgr_t;
 
-void taskmgr_append_task_to_worker(taskmgr_t* mgr, uint8_t id, void* buf, size_t buf_len, int tid);
+/*
+ * The append functions are called from AM handlers with their
+ * `flags`. If UCT lets us keep the AM descriptor, the task uses
+ * it in place and they return UCS_INPROGRESS, which the handler
+ * should return too. The descriptor is released under `desc_lock`,
+ * the lock around the progress of the context it came from, once
+ * the task is done. Otherwise the AM is copied and UCS_OK is
+ * returned.
+ */
+ucs_status_t taskmgr_append_task_to_worker(taskmgr_t* mgr, uint8_t id, void* buf, size_t buf_len, unsigned flags, pthread_mutex_t* desc_lock, int tid);
+
+ucs_status_t taskmgr_append_task(taskmgr_t* mgr, uint8_t id, void* buf, size_t buf_len, unsigned flags, pthread_mutex_t* desc_lock);
 
-void taskmgr_append_task(taskmgr_t* mgr, uint8_t id, void* buf, size_t buf_len);
+// Tasks of the same key always go to the same worker,
+// so they are handled in the order they arrive.
+ucs_status_t taskmgr_append_task_by_key(taskmgr_t* mgr, uint8_t id, void* buf, size_t buf_len, unsigned flags, pthread_mutex_t* desc_lock, unsigned key);
 
 void taskmgr_init(taskmgr_t* mgr, int num_workers, void (*_task_handle_cb)(task_t* task));
 